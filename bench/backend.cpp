@@ -0,0 +1,151 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "backend_p.hpp"
+
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/algorithm/string/find.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+using s5p::bench::Backend;
+using s5p::bench::YieldContext;
+using s5p::bench::SocketPtr;
+using s5p::bench::UdpEndPoint;
+
+
+Backend::Backend(IOLoop & loop)
+    : _(std::make_shared<Private>(loop))
+{
+}
+
+void Backend::set_http(bool http) {
+    _->http = http;
+}
+
+uint16_t Backend::listen() {
+    namespace ph = std::placeholders;
+    auto port = listen_loopback(_->acceptor);
+    boost::asio::spawn(_->loop, std::bind(&Backend::Private::do_accept, _, ph::_1));
+    ErrorCode ec;
+    _->datagrams.open(boost::asio::ip::udp::v4(), ec);
+    _->datagrams.bind(UdpEndPoint(AddressV4::loopback(), port), ec);
+    if (!ec) {
+        boost::asio::spawn(_->loop, std::bind(&Backend::Private::do_echo_datagrams, _, ph::_1));
+    }
+    return port;
+}
+
+Backend::Private::Private(IOLoop & loop)
+    : loop(loop)
+    , acceptor(loop)
+    , datagrams(loop)
+    , http(false)
+{
+}
+
+void Backend::Private::do_accept(YieldContext yield) {
+    ErrorCode ec;
+    while (this->acceptor.is_open()) {
+        auto socket = std::make_shared<Socket>(this->loop);
+        this->acceptor.async_accept(*socket, yield[ec]);
+        if (ec) {
+            continue;
+        }
+        if (this->http) {
+            boost::asio::spawn(this->loop, [this, socket](YieldContext yield) -> void {
+                this->do_serve_http(yield, socket);
+            });
+            continue;
+        }
+        boost::asio::spawn(this->loop, [socket](YieldContext yield) -> void {
+            relay(yield, socket, socket);
+        });
+    }
+}
+
+void Backend::Private::do_echo_datagrams(YieldContext yield) {
+    std::vector<uint8_t> datagram(65536);
+    UdpEndPoint sender;
+    ErrorCode ec;
+    while (this->datagrams.is_open()) {
+        auto length = this->datagrams.async_receive_from(boost::asio::buffer(datagram), sender, yield[ec]);
+        if (ec) {
+            continue;
+        }
+        this->datagrams.send_to(boost::asio::buffer(datagram, length), sender, 0, ec);
+    }
+}
+
+// requests carry no body, so the end of the headers ends the request
+void Backend::Private::do_serve_http(YieldContext yield, SocketPtr socket) {
+    boost::asio::streambuf request;
+    ErrorCode ignored;
+    socket->set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+    Chunk body;
+    body.fill(0x5a);
+    ErrorCode ec;
+    while (true) {
+        auto length = boost::asio::async_read_until(*socket, request, "\r\n\r\n", yield[ec]);
+        if (ec) {
+            return;
+        }
+        std::string head(boost::asio::buffers_begin(request.data()), boost::asio::buffers_begin(request.data()) + length);
+        request.consume(length);
+
+        // GET /<bytes> HTTP/1.1
+        std::size_t bytes = 0;
+        auto begin = head.find(" /");
+        auto end = head.find(' ', begin + 2);
+        if (begin != std::string::npos && end != std::string::npos) {
+            try {
+                bytes = boost::lexical_cast<std::size_t>(head.substr(begin + 2, end - begin - 2));
+            } catch (std::exception &) {
+                bytes = 0;
+            }
+        }
+        // fresh for a minute, so a caching proxy may answer the repeats
+        auto header = "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nContent-Length: " + boost::lexical_cast<std::string>(bytes) + "\r\n\r\n";
+        // one write per chunk, or Nagle holds the tail back for a delayed ACK
+        auto n = std::min(bytes, body.size());
+        std::array<boost::asio::const_buffer, 2> first = {
+            boost::asio::buffer(header),
+            boost::asio::buffer(body, n),
+        };
+        boost::asio::async_write(*socket, first, yield[ec]);
+        bytes -= n;
+        while (!ec && bytes > 0) {
+            n = std::min(bytes, body.size());
+            boost::asio::async_write(*socket, boost::asio::buffer(body, n), yield[ec]);
+            bytes -= n;
+        }
+        if (ec) {
+            return;
+        }
+        if (boost::algorithm::ifind_first(head, "\r\nConnection: close\r\n")) {
+            socket->shutdown(Socket::shutdown_send, ec);
+            return;
+        }
+    }
+}
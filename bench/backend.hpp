@@ -0,0 +1,60 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_BENCH_BACKEND_HPP
+#define S5P_BENCH_BACKEND_HPP
+
+#include "common.hpp"
+
+
+namespace s5p {
+namespace bench {
+
+/**
+ * Stands for the HTTP server behind the proxy, echoes everything back.
+ *
+ * In HTTP mode it answers every GET /<bytes> on a keep-alive connection with
+ * that many bytes of body instead, fresh for a minute.
+ *
+ * Datagrams sent to the same port number over UDP are echoed as well.
+ */
+class Backend {
+public:
+    explicit Backend(IOLoop & loop);
+
+    void set_http(bool http);
+    uint16_t listen();
+
+private:
+    Backend(const Backend &);
+    Backend & operator = (const Backend &);
+    Backend(Backend &&);
+    Backend & operator = (Backend &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+}
+
+#endif
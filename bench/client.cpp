@@ -0,0 +1,338 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "client_p.hpp"
+
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+
+
+using s5p::bench::LoadGenerator;
+using s5p::bench::Report;
+using s5p::bench::YieldContext;
+using s5p::bench::Clock;
+using s5p::bench::UdpSocket;
+using s5p::bench::UdpEndPoint;
+
+
+namespace {
+
+// datagrams a flow keeps in flight
+const std::size_t WINDOW = 16;
+// an echo later than this is lost
+const std::chrono::milliseconds LOSS_TIMEOUT(200);
+
+}
+
+
+LoadGenerator::LoadGenerator(IOLoop & loop, uint16_t port)
+    : _(std::make_shared<Private>(loop, port))
+{
+}
+
+void LoadGenerator::set_http(bool http) {
+    _->http = http;
+}
+
+void LoadGenerator::set_reset(bool reset) {
+    _->reset = reset;
+}
+
+void LoadGenerator::set_origin(uint16_t port) {
+    _->origin = port;
+}
+
+Report LoadGenerator::run(std::size_t concurrency, std::size_t total, std::size_t bytes) {
+    namespace ph = std::placeholders;
+
+    _->remaining = total;
+    _->bytes = bytes;
+    _->report = Report();
+    _->report.latencies.reserve(total);
+
+    auto begin = Clock::now();
+    for (std::size_t i = 0; i < concurrency; ++i) {
+        boost::asio::spawn(_->loop, std::bind(&LoadGenerator::Private::do_client, _, ph::_1));
+    }
+    _->loop.restart();
+    _->loop.run();
+    _->report.elapsed = Clock::now() - begin;
+
+    return _->report;
+}
+
+// connections in the report count datagrams, latencies are window round trips
+Report LoadGenerator::run_datagrams(std::size_t flows, std::size_t total, std::size_t bytes) {
+    namespace ph = std::placeholders;
+
+    _->remaining = total;
+    _->bytes = bytes;
+    _->report = Report();
+    _->report.latencies.reserve(total / WINDOW + flows);
+
+    auto begin = Clock::now();
+    for (std::size_t i = 0; i < flows; ++i) {
+        boost::asio::spawn(_->loop, std::bind(&LoadGenerator::Private::do_flow, _, ph::_1));
+    }
+    _->loop.restart();
+    _->loop.run();
+    _->report.elapsed = Clock::now() - begin;
+
+    return _->report;
+}
+
+std::size_t LoadGenerator::hold(std::size_t total) {
+    namespace ph = std::placeholders;
+
+    for (std::size_t i = 0; i < total; ++i) {
+        boost::asio::spawn(_->loop, std::bind(&LoadGenerator::Private::do_hold, _, ph::_1));
+    }
+    _->loop.restart();
+    _->loop.run();
+
+    return _->held.size();
+}
+
+// the ones the proxy has not let in after wait are left waiting
+std::size_t LoadGenerator::hold_for(std::size_t total, Clock::duration wait) {
+    namespace ph = std::placeholders;
+
+    for (std::size_t i = 0; i < total; ++i) {
+        boost::asio::spawn(_->loop, std::bind(&LoadGenerator::Private::do_hold, _, ph::_1));
+    }
+    boost::asio::steady_timer timer(_->loop, wait);
+    timer.async_wait([this](const ErrorCode &) -> void {
+        _->loop.stop();
+    });
+    _->loop.restart();
+    _->loop.run();
+
+    return _->held.size();
+}
+
+void LoadGenerator::release() {
+    ErrorCode ec;
+    for (auto & socket : _->held) {
+        socket->close(ec);
+    }
+    _->held.clear();
+}
+
+LoadGenerator::Private::Private(IOLoop & loop, uint16_t port)
+    : loop(loop)
+    , proxy(AddressV4::loopback(), port)
+    , remaining(0)
+    , bytes(0)
+    , http(false)
+    , reset(false)
+    , origin(0)
+    , report()
+    , held()
+{
+}
+
+void LoadGenerator::Private::do_client(YieldContext yield) {
+    while (this->remaining > 0) {
+        --this->remaining;
+
+        auto begin = Clock::now();
+        bool ok = this->http ? this->do_fetch(yield) : this->do_transfer(yield);
+        ++this->report.connections;
+        if (!ok) {
+            ++this->report.failures;
+            continue;
+        }
+        this->report.bytes += this->bytes;
+        this->report.latencies.push_back(Clock::now() - begin);
+    }
+}
+
+// one byte round trip, so the session is fully set up before it goes idle
+void LoadGenerator::Private::do_hold(YieldContext yield) {
+    auto socket = std::make_shared<Socket>(this->loop);
+    ErrorCode ec;
+    socket->async_connect(this->proxy, yield[ec]);
+    if (ec) {
+        return;
+    }
+    std::array<uint8_t, 1> byte = { 0x5a, };
+    boost::asio::async_write(*socket, boost::asio::buffer(byte), yield[ec]);
+    if (ec) {
+        return;
+    }
+    boost::asio::async_read(*socket, boost::asio::buffer(byte), yield[ec]);
+    if (ec) {
+        return;
+    }
+    this->held.push_back(socket);
+}
+
+bool LoadGenerator::Private::do_transfer(YieldContext yield) {
+    auto socket = std::make_shared<Socket>(this->loop);
+    ErrorCode ec;
+    socket->async_connect(this->proxy, yield[ec]);
+    if (ec) {
+        return false;
+    }
+
+    // the echo keeps sending while we are still writing, so read concurrently
+    auto length = this->bytes;
+    boost::asio::spawn(this->loop, [socket, length](YieldContext yield) -> void {
+        Chunk chunk;
+        chunk.fill(0x5a);
+        ErrorCode ec;
+        std::size_t left = length;
+        while (left > 0) {
+            auto n = std::min(left, chunk.size());
+            boost::asio::async_write(*socket, boost::asio::buffer(chunk, n), yield[ec]);
+            if (ec) {
+                return;
+            }
+            left -= n;
+        }
+    });
+
+    Chunk chunk;
+    std::size_t left = length;
+    while (left > 0) {
+        auto n = socket->async_read_some(boost::asio::buffer(chunk, std::min(left, chunk.size())), yield[ec]);
+        if (ec) {
+            return false;
+        }
+        left -= n;
+        if (this->reset && left <= length / 2) {
+            // a zero linger time makes close() send a RST
+            socket->set_option(boost::asio::socket_base::linger(true, 0), ec);
+            break;
+        }
+    }
+    socket->close(ec);
+    return true;
+}
+
+// one request per connection, the backend answers with exactly bytes of body
+bool LoadGenerator::Private::do_fetch(YieldContext yield) {
+    auto socket = std::make_shared<Socket>(this->loop);
+    ErrorCode ec;
+    socket->async_connect(this->proxy, yield[ec]);
+    if (ec) {
+        return false;
+    }
+
+    auto path = "/" + std::to_string(this->bytes);
+    if (this->origin != 0) {
+        path = "http://127.0.0.1:" + std::to_string(this->origin) + path;
+    }
+    auto request = "GET " + path + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+    boost::asio::async_write(*socket, boost::asio::buffer(request), yield[ec]);
+    if (ec) {
+        return false;
+    }
+
+    boost::asio::streambuf response;
+    auto length = boost::asio::async_read_until(*socket, response, "\r\n\r\n", yield[ec]);
+    if (ec) {
+        return false;
+    }
+    std::size_t left = this->bytes;
+    auto buffered = std::min(left, response.size() - length);
+    left -= buffered;
+
+    Chunk chunk;
+    while (left > 0) {
+        auto n = socket->async_read_some(boost::asio::buffer(chunk, std::min(left, chunk.size())), yield[ec]);
+        if (ec) {
+            return false;
+        }
+        left -= n;
+    }
+
+    if (this->origin != 0) {
+        // the same port under another name, so it would answer if it got this
+        request = "GET http://localhost:" + std::to_string(this->origin) + "/1 HTTP/1.1\r\nHost: bench\r\n\r\n";
+        boost::asio::async_write(*socket, boost::asio::buffer(request), yield[ec]);
+        if (!ec) {
+            socket->async_read_some(boost::asio::buffer(chunk), yield[ec]);
+        }
+        if (!ec) {
+            return false;
+        }
+    }
+    socket->close(ec);
+    return true;
+}
+
+// every flow is one client address, so one association in the proxy
+void LoadGenerator::Private::do_flow(YieldContext yield) {
+    auto socket = std::make_shared<UdpSocket>(this->loop);
+    ErrorCode ec;
+    socket->open(boost::asio::ip::udp::v4(), ec);
+    if (!ec) {
+        socket->connect(UdpEndPoint(this->proxy.address(), this->proxy.port()), ec);
+    }
+    if (ec) {
+        return;
+    }
+
+    std::vector<uint8_t> datagram(std::max<std::size_t>(this->bytes, 1), 0x5a);
+    std::vector<uint8_t> echo(datagram.size() + 1);
+    boost::asio::steady_timer timer(this->loop);
+    while (this->remaining > 0) {
+        auto window = std::min(this->remaining, WINDOW);
+        this->remaining -= window;
+
+        auto begin = Clock::now();
+        for (std::size_t i = 0; i < window; ++i) {
+            socket->send(boost::asio::buffer(datagram, this->bytes), 0, ec);
+        }
+        // the first datagrams wait for the association, the rest may be lost
+        // a late timer must not cancel the next window
+        auto waiting = std::make_shared<bool>(true);
+        timer.expires_after(LOSS_TIMEOUT);
+        timer.async_wait([socket, waiting](const ErrorCode & ec) -> void {
+            if (!ec && *waiting) {
+                ErrorCode ignored;
+                socket->cancel(ignored);
+            }
+        });
+        std::size_t received = 0;
+        while (received < window) {
+            socket->async_receive(boost::asio::buffer(echo), yield[ec]);
+            if (ec) {
+                break;
+            }
+            ++received;
+        }
+        *waiting = false;
+        timer.cancel(ec);
+
+        this->report.connections += window;
+        this->report.failures += window - received;
+        this->report.bytes += received * this->bytes;
+        if (received == window) {
+            this->report.latencies.push_back(Clock::now() - begin);
+        }
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_BENCH_CLIENT_HPP
+#define S5P_BENCH_CLIENT_HPP
+
+#include "common.hpp"
+
+#include <vector>
+
+
+namespace s5p {
+namespace bench {
+
+struct Report {
+    std::size_t connections;
+    std::size_t failures;
+    uint64_t bytes;
+    std::size_t tunnels;
+    Clock::duration elapsed;
+    Clock::duration cpu;
+    std::vector<Clock::duration> latencies;
+};
+
+
+/**
+ * Opens connections to the proxy, pushes bytes through the echo backend and
+ * reads them back.
+ *
+ * In HTTP mode every connection fetches one GET /<bytes> instead, which is
+ * what lets the proxy hand its upstream tunnel to the next connection.
+ *
+ * With an origin set the requests name it in an absolute URI, and every
+ * connection then asks for another host, which the proxy must not pass on
+ * to the first one: only a connection it closes instead counts.
+ *
+ * With reset set every echo is cut short by a RST once half of it is back,
+ * while the proxy is still sending to the connection.
+ *
+ * run_datagrams() has every flow send a window of datagrams of bytes each to
+ * the UDP port and wait for their echoes, a missing echo counts as a failure.
+ */
+class LoadGenerator {
+public:
+    LoadGenerator(IOLoop & loop, uint16_t port);
+
+    void set_http(bool http);
+    void set_reset(bool reset);
+    void set_origin(uint16_t port);
+    Report run(std::size_t concurrency, std::size_t total, std::size_t bytes);
+    Report run_datagrams(std::size_t flows, std::size_t total, std::size_t bytes);
+    std::size_t hold(std::size_t total);
+    std::size_t hold_for(std::size_t total, Clock::duration wait);
+    void release();
+
+private:
+    LoadGenerator(const LoadGenerator &);
+    LoadGenerator & operator = (const LoadGenerator &);
+    LoadGenerator(LoadGenerator &&);
+    LoadGenerator & operator = (LoadGenerator &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_BENCH_CLIENT_HPP_
+#define S5P_BENCH_CLIENT_HPP_
+
+#include "client.hpp"
+
+
+namespace s5p {
+namespace bench {
+
+class LoadGenerator::Private {
+public:
+    Private(IOLoop & loop, uint16_t port);
+
+    void do_client(YieldContext yield);
+    bool do_transfer(YieldContext yield);
+    bool do_fetch(YieldContext yield);
+    void do_flow(YieldContext yield);
+    void do_hold(YieldContext yield);
+
+    IOLoop & loop;
+    EndPoint proxy;
+    std::size_t remaining;
+    std::size_t bytes;
+    bool http;
+    bool reset;
+    uint16_t origin;
+    Report report;
+    std::vector<SocketPtr> held;
+};
+
+}
+}
+
+#endif
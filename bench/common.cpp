@@ -0,0 +1,157 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "common.hpp"
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+
+#include <deque>
+#include <vector>
+
+
+namespace {
+
+typedef s5p::bench::Clock Clock;
+
+// the bytes read but not yet due, shared by the reading and the writing end
+struct DelayLine {
+    explicit DelayLine(s5p::IOLoop & loop)
+        : packets()
+        , queued(0)
+        , closed(false)
+        , readable(loop, Clock::time_point::max())
+        , writable(loop, Clock::time_point::max())
+    {
+    }
+
+    std::deque<std::pair<Clock::time_point, std::vector<uint8_t>>> packets;
+    std::size_t queued;
+    bool closed;
+    boost::asio::steady_timer readable;
+    boost::asio::steady_timer writable;
+};
+
+// enough to keep a full bandwidth-delay product in flight
+const std::size_t DELAY_LINE_SIZE = 4 * 1024 * 1024;
+
+}
+
+
+namespace s5p {
+namespace bench {
+
+uint16_t listen_loopback(Acceptor & acceptor) {
+    EndPoint ep(AddressV4::loopback(), 0);
+    acceptor.open(ep.protocol());
+    acceptor.set_option(Acceptor::reuse_address(true));
+    acceptor.bind(ep);
+    acceptor.listen();
+    return acceptor.local_endpoint().port();
+}
+
+void relay(YieldContext yield, SocketPtr input, SocketPtr output) {
+    Chunk chunk;
+    ErrorCode ec;
+    while (true) {
+        auto length = input->async_read_some(boost::asio::buffer(chunk), yield[ec]);
+        if (ec) {
+            break;
+        }
+        boost::asio::async_write(*output, boost::asio::buffer(chunk, length), yield[ec]);
+        if (ec) {
+            break;
+        }
+    }
+    // forward the half close, the other direction may still be busy
+    output->shutdown(Socket::shutdown_send, ec);
+}
+
+void relay(YieldContext yield, SocketPtr input, SocketPtr output, const LinkShape & shape) {
+    if (shape.latency == Clock::duration::zero() && shape.bandwidth == 0) {
+        relay(yield, input, output);
+        return;
+    }
+
+    auto & loop = static_cast<IOLoop &>(input->get_executor().context());
+    auto line = std::make_shared<DelayLine>(loop);
+
+    // the writing end sleeps until the oldest packet is due
+    boost::asio::spawn(loop, [line, output](YieldContext yield) -> void {
+        ErrorCode ec;
+        while (true) {
+            if (line->packets.empty()) {
+                if (line->closed) {
+                    break;
+                }
+                line->writable.expires_at(Clock::time_point::max());
+                line->writable.async_wait(yield[ec]);
+                continue;
+            }
+            auto & packet = line->packets.front();
+            if (packet.first > Clock::now()) {
+                line->writable.expires_at(packet.first);
+                line->writable.async_wait(yield[ec]);
+                continue;
+            }
+            boost::asio::async_write(*output, boost::asio::buffer(packet.second), yield[ec]);
+            if (ec) {
+                break;
+            }
+            line->queued -= packet.second.size();
+            line->packets.pop_front();
+            line->readable.cancel();
+        }
+        output->shutdown(Socket::shutdown_send, ec);
+        line->closed = true;
+        line->readable.cancel();
+    });
+
+    Chunk chunk;
+    ErrorCode ec;
+    auto released = Clock::now();
+    while (!line->closed) {
+        if (line->queued >= DELAY_LINE_SIZE) {
+            line->readable.expires_at(Clock::time_point::max());
+            line->readable.async_wait(yield[ec]);
+            continue;
+        }
+        auto length = input->async_read_some(boost::asio::buffer(chunk), yield[ec]);
+        if (ec) {
+            break;
+        }
+        // a packet cannot leave before the previous one has been serialized
+        auto now = Clock::now();
+        released = std::max(released, now);
+        if (shape.bandwidth > 0) {
+            released += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(static_cast<double>(length) / shape.bandwidth));
+        }
+        line->packets.emplace_back(released + shape.latency, std::vector<uint8_t>(chunk.begin(), chunk.begin() + length));
+        line->queued += length;
+        line->writable.cancel();
+    }
+    line->closed = true;
+    line->writable.cancel();
+}
+
+}
+}
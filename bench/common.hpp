@@ -0,0 +1,65 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_BENCH_COMMON_HPP
+#define S5P_BENCH_COMMON_HPP
+
+#include "global.hpp"
+
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <chrono>
+#include <memory>
+
+
+namespace s5p {
+namespace bench {
+
+typedef boost::asio::yield_context YieldContext;
+typedef boost::asio::ip::tcp::resolver Resolver;
+typedef std::chrono::steady_clock Clock;
+typedef std::shared_ptr<Socket> SocketPtr;
+typedef boost::asio::ip::address Address;
+typedef boost::asio::ip::udp::socket UdpSocket;
+typedef boost::asio::ip::udp::endpoint UdpEndPoint;
+
+
+/**
+ * Emulates a slower link: every byte leaves no earlier than latency after it
+ * arrived, and no faster than bandwidth bytes per second. Zero disables
+ * either of them.
+ */
+struct LinkShape {
+    Clock::duration latency;
+    std::size_t bandwidth;
+};
+
+
+uint16_t listen_loopback(Acceptor & acceptor);
+void relay(YieldContext yield, SocketPtr input, SocketPtr output);
+void relay(YieldContext yield, SocketPtr input, SocketPtr output, const LinkShape & shape);
+
+}
+}
+
+#endif
@@ -0,0 +1,437 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "backend.hpp"
+#include "client.hpp"
+#include "proxy.hpp"
+#include "standin.hpp"
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+
+namespace {
+
+typedef boost::program_options::options_description Options;
+typedef boost::program_options::variables_map OptionMap;
+
+struct Environment {
+    std::string proxy_path;
+    bool verbose;
+    bool http;
+    bool udp;
+    bool reset;
+    bool retarget;
+    const s5p::bench::Socks5StandIn * socks5;
+    std::vector<std::string> variants;
+    uint16_t socks5_port;
+    uint16_t http_port;
+};
+
+std::vector<std::string> parse_list(const std::string & text) {
+    std::vector<std::string> parts;
+    boost::algorithm::split(parts, text, boost::algorithm::is_any_of(","));
+    return parts;
+}
+
+std::string format_size(std::size_t bytes) {
+    if (bytes >= 1024 * 1024 && bytes % (1024 * 1024) == 0) {
+        return boost::lexical_cast<std::string>(bytes / (1024 * 1024)) + "MiB";
+    }
+    if (bytes >= 1024 && bytes % 1024 == 0) {
+        return boost::lexical_cast<std::string>(bytes / 1024) + "KiB";
+    }
+    return boost::lexical_cast<std::string>(bytes) + "B";
+}
+
+std::vector<std::string> parse_arguments(const std::string & text) {
+    std::vector<std::string> parts;
+    boost::algorithm::split(parts, text, boost::algorithm::is_any_of(" "), boost::algorithm::token_compress_on);
+    parts.erase(std::remove(std::begin(parts), std::end(parts), ""), std::end(parts));
+    return parts;
+}
+
+double percentile_ms(std::vector<s5p::bench::Clock::duration> latencies, double ratio) {
+    using namespace std::chrono;
+    if (latencies.empty()) {
+        return 0.0;
+    }
+    auto index = static_cast<std::size_t>(ratio * (latencies.size() - 1));
+    std::nth_element(std::begin(latencies), std::next(std::begin(latencies), index), std::end(latencies));
+    return duration_cast<duration<double, std::milli>>(latencies[index]).count();
+}
+
+std::vector<std::string> create_proxy_args(const Environment & env, const std::vector<std::string> & args) {
+    std::vector<std::string> proxy_args = {
+        "--socks5-host", "127.0.0.1",
+        "--socks5-port", boost::lexical_cast<std::string>(env.socks5_port),
+        "--http-host", "127.0.0.1",
+        "--http-port", boost::lexical_cast<std::string>(env.http_port),
+    };
+    proxy_args.insert(std::end(proxy_args), std::begin(args), std::end(args));
+    return proxy_args;
+}
+
+s5p::bench::Report run_proxy(const Environment & env,
+                             const std::vector<std::string> & args,
+                             std::size_t concurrency,
+                             std::size_t total,
+                             std::size_t bytes) {
+    auto port = s5p::bench::pick_free_port();
+    s5p::bench::ProxyProcess proxy(env.proxy_path, create_proxy_args(env, args));
+    proxy.set_verbose(env.verbose);
+    proxy.start(port);
+
+    s5p::IOLoop loop;
+    s5p::bench::LoadGenerator generator(loop, port);
+    generator.set_http(env.http);
+    generator.set_reset(env.reset);
+    if (env.retarget) {
+        generator.set_origin(env.http_port);
+    }
+    auto cpu = proxy.cpu_time();
+    auto tunnels = env.socks5->tunnels();
+    auto report = generator.run(concurrency, total, bytes);
+    report.cpu = proxy.cpu_time() - cpu;
+    report.tunnels = env.socks5->tunnels() - tunnels;
+    // a peer that goes away must never take the proxy with it
+    if (!proxy.is_running()) {
+        std::cerr << "the proxy exited during the run" << std::endl;
+        ++report.failures;
+    }
+
+    proxy.stop();
+    return report;
+}
+
+// the proxy relays the UDP port with the same number as its TCP port
+s5p::bench::Report run_datagrams(const Environment & env,
+                                 const std::vector<std::string> & args,
+                                 std::size_t flows,
+                                 std::size_t total,
+                                 std::size_t bytes) {
+    auto port = s5p::bench::pick_free_port();
+    auto udp_args = args;
+    udp_args.push_back("--udp-port");
+    udp_args.push_back(boost::lexical_cast<std::string>(port));
+    s5p::bench::ProxyProcess proxy(env.proxy_path, create_proxy_args(env, udp_args));
+    proxy.set_verbose(env.verbose);
+    proxy.start(port);
+
+    s5p::IOLoop loop;
+    s5p::bench::LoadGenerator generator(loop, port);
+    auto cpu = proxy.cpu_time();
+    auto tunnels = env.socks5->tunnels();
+    auto report = generator.run_datagrams(flows, total, bytes);
+    report.cpu = proxy.cpu_time() - cpu;
+    report.tunnels = env.socks5->tunnels() - tunnels;
+    proxy.dump_metrics();
+
+    proxy.stop();
+    return report;
+}
+
+// opens idle sessions and reports how much memory each of them costs
+void run_idle(const Environment & env,
+              const std::string & label,
+              const std::vector<std::string> & args,
+              std::size_t total) {
+    auto port = s5p::bench::pick_free_port();
+    s5p::bench::ProxyProcess proxy(env.proxy_path, create_proxy_args(env, args));
+    proxy.set_verbose(env.verbose);
+    proxy.start(port);
+    auto before = proxy.resident_size();
+
+    s5p::IOLoop loop;
+    s5p::bench::LoadGenerator generator(loop, port);
+    auto held = generator.hold(total);
+    auto after = proxy.resident_size();
+    proxy.dump_metrics();
+
+    auto per_session = held > 0 ? static_cast<double>(after - std::min(before, after)) / held : 0.0;
+    std::cout << std::left << std::setw(36) << label
+              << std::right << std::fixed << std::setprecision(2)
+              << " idle sessions " << std::setw(8) << held
+              << " rss before " << std::setw(8) << before / (1024.0 * 1024.0) << "MiB"
+              << " rss after " << std::setw(8) << after / (1024.0 * 1024.0) << "MiB"
+              << " per session " << std::setw(8) << per_session / 1024.0 << "KiB"
+              << std::endl;
+
+    generator.release();
+    proxy.stop();
+}
+
+// holds twice the limit in sessions, false if more than the limit got in
+bool run_limit(const Environment & env,
+               const std::string & label,
+               const std::vector<std::string> & args,
+               std::size_t limit) {
+    auto port = s5p::bench::pick_free_port();
+    auto limit_args = args;
+    limit_args.push_back("--max-sessions");
+    limit_args.push_back(boost::lexical_cast<std::string>(limit));
+    limit_args.push_back("--overload");
+    limit_args.push_back("pause");
+    s5p::bench::ProxyProcess proxy(env.proxy_path, create_proxy_args(env, limit_args));
+    proxy.set_verbose(env.verbose);
+    proxy.start(port);
+
+    s5p::IOLoop loop;
+    s5p::bench::LoadGenerator generator(loop, port);
+    auto held = generator.hold_for(limit * 2, std::chrono::seconds(1));
+    std::cout << std::left << std::setw(36) << label
+              << std::right
+              << " max sessions " << std::setw(8) << limit
+              << " let in " << std::setw(8) << held
+              << (held > limit ? " over the limit" : "")
+              << std::endl;
+
+    generator.release();
+    proxy.stop();
+    return held <= limit;
+}
+
+void print_report(const Environment & env, const std::string & label, const s5p::bench::Report & report) {
+    using namespace std::chrono;
+    auto seconds = duration_cast<duration<double>>(report.elapsed).count();
+    auto mib = static_cast<double>(report.bytes) / (1024.0 * 1024.0);
+    // every echoed byte crosses the proxy twice, a response body only once
+    auto gbit = static_cast<double>(report.bytes) * (env.http ? 1.0 : 2.0) * 8.0 / 1e9;
+    auto cpu = duration_cast<duration<double>>(report.cpu).count();
+    std::cout << std::left << std::setw(36) << label
+              << std::right << std::fixed << std::setprecision(2)
+              << " connections " << std::setw(8) << report.connections
+              << " failures " << std::setw(6) << report.failures
+              << " tunnels " << std::setw(8) << report.tunnels
+              << " elapsed " << std::setw(8) << seconds << "s"
+              << " conn/s " << std::setw(10) << report.connections / seconds
+              << " MiB/s " << std::setw(10) << mib / seconds
+              << " p50 " << std::setw(8) << percentile_ms(report.latencies, 0.50) << "ms"
+              << " p99 " << std::setw(8) << percentile_ms(report.latencies, 0.99) << "ms"
+              << " p999 " << std::setw(8) << percentile_ms(report.latencies, 0.999) << "ms"
+              << " cpu/Gbit " << std::setw(6) << (gbit > 0.0 ? cpu / gbit : 0.0) << "s"
+              << std::endl;
+}
+
+void print_datagram_report(const std::string & label, const s5p::bench::Report & report) {
+    using namespace std::chrono;
+    auto seconds = duration_cast<duration<double>>(report.elapsed).count();
+    auto echoed = report.connections - report.failures;
+    auto mib = static_cast<double>(report.bytes) / (1024.0 * 1024.0);
+    auto cpu = duration_cast<duration<double>>(report.cpu).count();
+    // every echoed datagram crosses the proxy twice
+    std::cout << std::left << std::setw(36) << label
+              << std::right << std::fixed << std::setprecision(2)
+              << " datagrams " << std::setw(8) << report.connections
+              << " lost " << std::setw(6) << report.failures
+              << " associations " << std::setw(4) << report.tunnels
+              << " elapsed " << std::setw(8) << seconds << "s"
+              << " pps " << std::setw(10) << 2.0 * echoed / seconds
+              << " MiB/s " << std::setw(10) << mib / seconds
+              << " window p50 " << std::setw(8) << percentile_ms(report.latencies, 0.50) << "ms"
+              << " p99 " << std::setw(8) << percentile_ms(report.latencies, 0.99) << "ms"
+              << " cpu/Mpkt " << std::setw(6) << (echoed > 0 ? cpu * 1e6 / (2.0 * echoed) : 0.0) << "s"
+              << std::endl;
+}
+
+}
+
+
+int main(int argc, char * argv[]) {
+    namespace po = boost::program_options;
+
+    Environment env;
+    std::string threads;
+    std::string relays;
+    std::size_t concurrency = 0;
+    std::size_t total = 0;
+    std::string sizes;
+    std::size_t volume = 0;
+    std::size_t delay = 0;
+    std::size_t latency = 0;
+    std::size_t bandwidth = 0;
+    std::size_t idle = 0;
+    std::size_t datagrams = 0;
+    std::size_t max_sessions = 0;
+
+    Options od("SOCKS5 proxy benchmark");
+    od.add_options()
+        ("help,h", "show this message")
+        ("verbose,v", "show the error output of the proxy")
+        ("proxy", po::value<std::string>(&env.proxy_path)
+            ->value_name("<path>")
+            ->default_value(S5P_PROXY_PATH)
+            , "the proxy executable under test")
+        ("threads", po::value<std::string>(&threads)
+            ->value_name("<list>")
+            ->default_value("1," + boost::lexical_cast<std::string>(std::max(1U, std::thread::hardware_concurrency())))
+            , "comma separated thread counts to compare")
+        ("relay", po::value<std::string>(&relays)
+            ->value_name("<list>")
+            ->default_value("copy")
+            , "comma separated relay modes to compare")
+        ("variant", po::value<std::vector<std::string>>(&env.variants)
+            ->value_name("<args>")
+            ->composing()
+            , "extra proxy arguments to compare, may be repeated")
+        ("socks5-delay", po::value<std::size_t>(&delay)
+            ->value_name("<ms>")
+            ->default_value(0)
+            , "delay every reply of the SOCKS5 stand-in")
+        ("latency", po::value<std::size_t>(&latency)
+            ->value_name("<ms>")
+            ->default_value(0)
+            , "one way latency added to the payload between the proxy and the SOCKS5 stand-in")
+        ("bandwidth", po::value<std::size_t>(&bandwidth)
+            ->value_name("<KiB/s>")
+            ->default_value(0)
+            , "limit every connection between the proxy and the SOCKS5 stand-in, 0 means no limit")
+        ("concurrency", po::value<std::size_t>(&concurrency)
+            ->value_name("<n>")
+            ->default_value(64)
+            , "parallel client connections")
+        ("connections", po::value<std::size_t>(&total)
+            ->value_name("<n>")
+            ->default_value(2000)
+            , "connections per run")
+        ("bytes", po::value<std::string>(&sizes)
+            ->value_name("<list>")
+            ->default_value("1024,65536,104857600")
+            , "comma separated bytes echoed per connection")
+        ("volume", po::value<std::size_t>(&volume)
+            ->value_name("<MiB>")
+            ->default_value(1024)
+            , "make fewer connections when they would echo more than this in one run")
+        ("idle", po::value<std::size_t>(&idle)
+            ->value_name("<n>")
+            ->default_value(1000)
+            , "also measure the memory of this many idle sessions, 0 skips it")
+        ("http", "fetch bytes with one HTTP request per connection instead of echoing them")
+        ("reset", "reset every connection halfway through its echo, a proxy that does not survive fails the run")
+        ("retarget", "with --http, run the proxy with --target http and ask for another host on every connection, a request that reaches the first host fails the run")
+        ("max-sessions", po::value<std::size_t>(&max_sessions)
+            ->value_name("<n>")
+            ->default_value(0)
+            , "also open twice this many idle sessions against --max-sessions <n> --overload pause, more than n let in fails the run")
+        ("udp", "echo datagrams of bytes each through the UDP port instead, concurrency is the number of flows")
+        ("datagrams", po::value<std::size_t>(&datagrams)
+            ->value_name("<n>")
+            ->default_value(200000)
+            , "datagrams per run with --udp")
+    ;
+
+    OptionMap vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, od), vm);
+        po::notify(vm);
+    } catch (std::exception & e) {
+        std::cerr << "invalid argument (what: " << e.what() << ")" << std::endl;
+        return 1;
+    }
+    if (vm.count("help") >= 1) {
+        std::cout << od << std::endl;
+        return 0;
+    }
+    env.verbose = vm.count("verbose") >= 1;
+    env.http = vm.count("http") >= 1;
+    env.udp = vm.count("udp") >= 1;
+    env.reset = vm.count("reset") >= 1;
+    env.retarget = vm.count("retarget") >= 1;
+    if (env.retarget && !env.http) {
+        std::cerr << "--retarget needs --http" << std::endl;
+        return 1;
+    }
+
+    // the stand-ins live on their own thread, away from the load generator
+    s5p::IOLoop loop;
+    s5p::bench::Socks5StandIn socks5(loop);
+    s5p::bench::Backend backend(loop);
+    socks5.set_delay(std::chrono::milliseconds(delay));
+    socks5.set_link({std::chrono::milliseconds(latency), bandwidth * 1024});
+    env.socks5_port = socks5.listen();
+    backend.set_http(env.http);
+    env.http_port = backend.listen();
+    env.socks5 = &socks5;
+    std::thread standin([&loop]() -> void {
+        loop.run();
+    });
+
+    if (env.variants.empty()) {
+        env.variants.push_back("");
+    }
+    int status = 0;
+    for (auto & n : parse_list(threads)) {
+        for (auto & relay : parse_list(relays)) {
+            for (auto & variant : env.variants) {
+                std::vector<std::string> args = {
+                    "--threads", n,
+                    "--relay", relay,
+                };
+                auto extra = parse_arguments(variant);
+                args.insert(std::end(args), std::begin(extra), std::end(extra));
+                if (env.retarget) {
+                    args.push_back("--target");
+                    args.push_back("http");
+                }
+
+                auto label = "threads=" + n + " relay=" + relay;
+                if (!variant.empty()) {
+                    label += " " + variant;
+                }
+                for (auto & size : parse_list(sizes)) {
+                    auto bytes = boost::lexical_cast<std::size_t>(size);
+                    if (env.udp) {
+                        // the proxy takes no larger datagram
+                        if (bytes <= 8192) {
+                            auto report = run_datagrams(env, args, concurrency, datagrams, bytes);
+                            print_datagram_report(label + " bytes=" + format_size(bytes), report);
+                        }
+                        continue;
+                    }
+                    auto connections = std::max<std::size_t>(1, std::min(total, volume * 1024 * 1024 / std::max<std::size_t>(1, bytes)));
+                    auto report = run_proxy(env, args, std::min(concurrency, connections), connections, bytes);
+                    print_report(env, label + " bytes=" + format_size(bytes), report);
+                    if ((env.reset || env.retarget) && report.failures > 0) {
+                        status = 1;
+                    }
+                }
+                if (idle > 0) {
+                    run_idle(env, label, args, idle);
+                }
+                if (max_sessions > 0 && !run_limit(env, label, args, max_sessions)) {
+                    status = 1;
+                }
+            }
+        }
+    }
+
+    loop.stop();
+    standin.join();
+    return status;
+}
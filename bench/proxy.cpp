@@ -0,0 +1,189 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "proxy_p.hpp"
+
+#include <boost/lexical_cast.hpp>
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+using s5p::bench::ProxyProcess;
+using s5p::bench::Clock;
+
+
+ProxyProcess::ProxyProcess(const std::string & path, const std::vector<std::string> & args)
+    : _(std::make_shared<Private>(path, args))
+{
+}
+
+ProxyProcess::~ProxyProcess() {
+    this->stop();
+}
+
+void ProxyProcess::set_verbose(bool verbose) {
+    _->verbose = verbose;
+}
+
+void ProxyProcess::start(uint16_t port) {
+    _->do_spawn(port);
+    _->do_wait_ready(port);
+}
+
+void ProxyProcess::stop() {
+    if (_->pid <= 0) {
+        return;
+    }
+    ::kill(_->pid, SIGTERM);
+    int status = 0;
+    ::waitpid(_->pid, &status, 0);
+    _->pid = -1;
+}
+
+bool ProxyProcess::is_running() const {
+    if (_->pid <= 0) {
+        return false;
+    }
+    int status = 0;
+    return ::waitpid(_->pid, &status, WNOHANG) == 0;
+}
+
+std::size_t ProxyProcess::resident_size() const {
+    std::ifstream fin("/proc/" + boost::lexical_cast<std::string>(_->pid) + "/status");
+    std::string line;
+    while (std::getline(fin, line)) {
+        // VmRSS:     1234 kB
+        if (line.compare(0, 6, "VmRSS:") != 0) {
+            continue;
+        }
+        std::istringstream sin(line.substr(6));
+        std::size_t kib = 0;
+        sin >> kib;
+        return kib * 1024;
+    }
+    return 0;
+}
+
+// user and system time, so far
+Clock::duration ProxyProcess::cpu_time() const {
+    std::ifstream fin("/proc/" + boost::lexical_cast<std::string>(_->pid) + "/stat");
+    std::string line;
+    std::getline(fin, line);
+    // the command may contain spaces, the fields start after its parenthesis
+    auto paren = line.rfind(')');
+    if (paren == std::string::npos) {
+        return Clock::duration::zero();
+    }
+    std::istringstream sin(line.substr(paren + 2));
+    std::string field;
+    // state is the third field, utime and stime are the 14th and 15th
+    for (int i = 3; i < 14; ++i) {
+        sin >> field;
+    }
+    uint64_t utime = 0;
+    uint64_t stime = 0;
+    sin >> utime >> stime;
+    auto ticks = static_cast<double>(utime + stime) / ::sysconf(_SC_CLK_TCK);
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(ticks));
+}
+
+void ProxyProcess::dump_metrics() {
+    if (_->pid <= 0) {
+        return;
+    }
+    ::kill(_->pid, SIGUSR1);
+    // let the proxy finish printing before we do
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+ProxyProcess::Private::Private(const std::string & path, const std::vector<std::string> & args)
+    : path(path)
+    , args(args)
+    , verbose(false)
+    , pid(-1)
+{
+}
+
+void ProxyProcess::Private::do_spawn(uint16_t port) {
+    std::vector<std::string> args = {
+        this->path,
+        "--port",
+        boost::lexical_cast<std::string>(port),
+    };
+    args.insert(std::end(args), std::begin(this->args), std::end(this->args));
+
+    std::vector<char *> argv;
+    for (auto & arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+
+    this->pid = ::fork();
+    if (this->pid < 0) {
+        throw std::runtime_error("cannot fork the proxy");
+    }
+    if (this->pid == 0) {
+        if (!this->verbose) {
+            // per connection errors would drown the report
+            int null = ::open("/dev/null", O_WRONLY);
+            ::dup2(null, STDERR_FILENO);
+        }
+        ::execv(argv[0], argv.data());
+        ::_exit(127);
+    }
+}
+
+void ProxyProcess::Private::do_wait_ready(uint16_t port) {
+    IOLoop loop;
+    EndPoint ep(AddressV4::loopback(), port);
+    for (int i = 0; i < 500; ++i) {
+        Socket socket(loop);
+        ErrorCode ec;
+        socket.connect(ep, ec);
+        if (!ec) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    throw std::runtime_error("the proxy did not start listening");
+}
+
+
+namespace s5p {
+namespace bench {
+
+uint16_t pick_free_port() {
+    IOLoop loop;
+    Acceptor acceptor(loop);
+    return listen_loopback(acceptor);
+}
+
+}
+}
@@ -0,0 +1,67 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_BENCH_PROXY_HPP
+#define S5P_BENCH_PROXY_HPP
+
+#include "common.hpp"
+
+#include <string>
+#include <vector>
+
+
+namespace s5p {
+namespace bench {
+
+/**
+ * Runs the proxy under test as a child process.
+ */
+class ProxyProcess {
+public:
+    ProxyProcess(const std::string & path, const std::vector<std::string> & args);
+    ~ProxyProcess();
+
+    void set_verbose(bool verbose);
+    void start(uint16_t port);
+    void stop();
+    bool is_running() const;
+    std::size_t resident_size() const;
+    Clock::duration cpu_time() const;
+    void dump_metrics();
+
+private:
+    ProxyProcess(const ProxyProcess &);
+    ProxyProcess & operator = (const ProxyProcess &);
+    ProxyProcess(ProxyProcess &&);
+    ProxyProcess & operator = (ProxyProcess &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+
+uint16_t pick_free_port();
+
+}
+}
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "standin_p.hpp"
+
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+using s5p::bench::Socks5StandIn;
+using s5p::bench::YieldContext;
+using s5p::bench::SocketPtr;
+using s5p::bench::Resolver;
+using s5p::bench::UdpSocket;
+using s5p::bench::UdpEndPoint;
+using s5p::EndPoint;
+
+
+Socks5StandIn::Socks5StandIn(IOLoop & loop)
+    : _(std::make_shared<Private>(loop))
+{
+}
+
+void Socks5StandIn::set_delay(Clock::duration delay) {
+    _->delay = delay;
+}
+
+void Socks5StandIn::set_link(const LinkShape & shape) {
+    _->link = shape;
+}
+
+uint16_t Socks5StandIn::listen() {
+    namespace ph = std::placeholders;
+    auto port = listen_loopback(_->acceptor);
+    boost::asio::spawn(_->loop, std::bind(&Socks5StandIn::Private::do_accept, _, ph::_1));
+    return port;
+}
+
+// CONNECTs answered so far, read from the load generator's thread
+std::size_t Socks5StandIn::tunnels() const {
+    return _->tunnels;
+}
+
+Socks5StandIn::Private::Private(IOLoop & loop)
+    : loop(loop)
+    , acceptor(loop)
+    , delay(Clock::duration::zero())
+    , link({Clock::duration::zero(), 0})
+    , tunnels(0)
+{
+}
+
+void Socks5StandIn::Private::do_accept(YieldContext yield) {
+    namespace ph = std::placeholders;
+    ErrorCode ec;
+    while (this->acceptor.is_open()) {
+        auto socket = std::make_shared<Socket>(this->loop);
+        this->acceptor.async_accept(*socket, yield[ec]);
+        if (ec) {
+            continue;
+        }
+        boost::asio::spawn(this->loop, std::bind(&Socks5StandIn::Private::do_serve, this, ph::_1, socket));
+    }
+}
+
+void Socks5StandIn::Private::do_serve(YieldContext yield, SocketPtr client) {
+    auto upstream = std::make_shared<Socket>(this->loop);
+    try {
+        auto arrived = Clock::now();
+        uint8_t command = 0;
+        auto ep = this->do_read_request(yield, *client, arrived, command);
+        if (command == 0x03) {
+            this->do_associate(yield, client, arrived);
+            return;
+        }
+        upstream->async_connect(ep, yield);
+        this->do_delay(yield, arrived);
+
+        // VER REP RSV ATYP BND.ADDR BND.PORT
+        std::array<uint8_t, 10> reply = { 0x05, 0x00, 0x00, 0x01, };
+        boost::asio::async_write(*client, boost::asio::buffer(reply), yield);
+    } catch (std::exception & e) {
+        return;
+    }
+    ++this->tunnels;
+
+    auto link = this->link;
+    boost::asio::spawn(this->loop, [client, upstream, link](YieldContext yield) -> void {
+        relay(yield, upstream, client, link);
+    });
+    relay(yield, client, upstream, link);
+}
+
+EndPoint Socks5StandIn::Private::do_read_request(YieldContext yield, Socket & client, Clock::time_point & arrived, uint8_t & command) {
+    Chunk chunk;
+
+    // VER NMETHODS METHODS
+    boost::asio::async_read(client, boost::asio::buffer(chunk, 2), yield);
+    boost::asio::async_read(client, boost::asio::buffer(chunk, chunk[1]), yield);
+    arrived = Clock::now();
+    // a pipelining client has sent the request in the same flight
+    bool pipelined = client.available() > 0;
+    chunk[0] = 0x05;
+    chunk[1] = 0x00;
+    this->do_delay(yield, arrived);
+    boost::asio::async_write(client, boost::asio::buffer(chunk, 2), yield);
+
+    // VER CMD RSV ATYP
+    boost::asio::async_read(client, boost::asio::buffer(chunk, 4), yield);
+    if (!pipelined) {
+        arrived = Clock::now();
+    }
+    command = chunk[1];
+    if (command != 0x01 && command != 0x03) {
+        throw std::runtime_error("unsupported command");
+    }
+
+    Address address;
+    switch (chunk[3]) {
+    case 0x01: {
+        AddressV4::bytes_type bytes;
+        boost::asio::async_read(client, boost::asio::buffer(bytes), yield);
+        address = AddressV4(bytes);
+        break;
+    }
+    case 0x04: {
+        AddressV6::bytes_type bytes;
+        boost::asio::async_read(client, boost::asio::buffer(bytes), yield);
+        address = AddressV6(bytes);
+        break;
+    }
+    case 0x03: {
+        boost::asio::async_read(client, boost::asio::buffer(chunk, 1), yield);
+        std::string host(chunk[0], '\0');
+        boost::asio::async_read(client, boost::asio::buffer(&host[0], host.size()), yield);
+        Resolver resolver(this->loop);
+        auto it = resolver.async_resolve({host, "0"}, yield);
+        address = it->endpoint().address();
+        break;
+    }
+    default:
+        throw std::runtime_error("unknown address type");
+    }
+
+    // DST.PORT
+    boost::asio::async_read(client, boost::asio::buffer(chunk, 2), yield);
+    uint16_t port = static_cast<uint16_t>((chunk[0] << 8) | chunk[1]);
+
+    return EndPoint(address, port);
+}
+
+// the first sender on the relay socket is the client, everyone else answers it
+void Socks5StandIn::Private::do_associate(YieldContext yield, SocketPtr client, Clock::time_point arrived) {
+    auto relay = std::make_shared<UdpSocket>(this->loop, UdpEndPoint(AddressV4::loopback(), 0));
+    this->do_delay(yield, arrived);
+
+    // VER REP RSV ATYP BND.ADDR BND.PORT
+    auto bound = relay->local_endpoint();
+    std::array<uint8_t, 10> reply = {
+        0x05, 0x00, 0x00, 0x01, 127, 0, 0, 1,
+        static_cast<uint8_t>(bound.port() >> 8), static_cast<uint8_t>(bound.port() & 0xff),
+    };
+    boost::asio::async_write(*client, boost::asio::buffer(reply), yield);
+    ++this->tunnels;
+
+    boost::asio::spawn(this->loop, [relay](YieldContext yield) -> void {
+        std::vector<uint8_t> datagram(65536);
+        UdpEndPoint associated;
+        UdpEndPoint sender;
+        ErrorCode ec;
+        while (true) {
+            auto length = relay->async_receive_from(boost::asio::buffer(datagram, datagram.size() - 10), sender, yield[ec]);
+            if (ec == boost::asio::error::operation_aborted || !relay->is_open()) {
+                return;
+            }
+            if (ec) {
+                continue;
+            }
+            if (associated == UdpEndPoint()) {
+                associated = sender;
+            }
+            if (sender != associated) {
+                // RSV FRAG ATYP DST.ADDR DST.PORT, IPv4 is all the backend has
+                auto bytes = sender.address().to_v4().to_bytes();
+                std::array<uint8_t, 10> header = {
+                    0x00, 0x00, 0x00, 0x01, bytes[0], bytes[1], bytes[2], bytes[3],
+                    static_cast<uint8_t>(sender.port() >> 8), static_cast<uint8_t>(sender.port() & 0xff),
+                };
+                std::array<boost::asio::const_buffer, 2> buffers = {
+                    boost::asio::buffer(header),
+                    boost::asio::buffer(datagram, length),
+                };
+                relay->send_to(buffers, associated, 0, ec);
+                continue;
+            }
+            if (length < 10 || datagram[2] != 0x00 || datagram[3] != 0x01) {
+                continue;
+            }
+            AddressV4::bytes_type bytes = { datagram[4], datagram[5], datagram[6], datagram[7], };
+            UdpEndPoint target(AddressV4(bytes), static_cast<uint16_t>((datagram[8] << 8) | datagram[9]));
+            relay->send_to(boost::asio::buffer(&datagram[10], length - 10), target, 0, ec);
+        }
+    });
+
+    // nothing more is expected on the control connection
+    std::array<uint8_t, 1> byte;
+    ErrorCode ec;
+    boost::asio::async_read(*client, boost::asio::buffer(byte), yield[ec]);
+    relay->close(ec);
+}
+
+// simulates the round trip to a remote SOCKS5 server, a reply leaves no
+// earlier than one delay after its request arrived
+void Socks5StandIn::Private::do_delay(YieldContext yield, Clock::time_point arrived) {
+    if (this->delay == Clock::duration::zero()) {
+        return;
+    }
+    boost::asio::steady_timer timer(this->loop, arrived + this->delay);
+    timer.async_wait(yield);
+}
@@ -0,0 +1,61 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_BENCH_STANDIN_HPP
+#define S5P_BENCH_STANDIN_HPP
+
+#include "common.hpp"
+
+
+namespace s5p {
+namespace bench {
+
+/**
+ * A minimal SOCKS5 server, supports the "no auth" method, CONNECT and UDP
+ * ASSOCIATE. An association lives until its control connection closes.
+ *
+ * The link shape applies to the relayed TCP payload in both directions, as if
+ * the server were far away or behind a slow line.
+ */
+class Socks5StandIn {
+public:
+    explicit Socks5StandIn(IOLoop & loop);
+
+    void set_delay(Clock::duration delay);
+    void set_link(const LinkShape & shape);
+    uint16_t listen();
+    std::size_t tunnels() const;
+
+private:
+    Socks5StandIn(const Socks5StandIn &);
+    Socks5StandIn & operator = (const Socks5StandIn &);
+    Socks5StandIn(Socks5StandIn &&);
+    Socks5StandIn & operator = (Socks5StandIn &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+}
+
+#endif
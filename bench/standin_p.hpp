@@ -0,0 +1,54 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_BENCH_STANDIN_HPP_
+#define S5P_BENCH_STANDIN_HPP_
+
+#include "standin.hpp"
+
+#include <atomic>
+
+
+namespace s5p {
+namespace bench {
+
+class Socks5StandIn::Private {
+public:
+    explicit Private(IOLoop & loop);
+
+    void do_accept(YieldContext yield);
+    void do_serve(YieldContext yield, SocketPtr client);
+    EndPoint do_read_request(YieldContext yield, Socket & client, Clock::time_point & arrived, uint8_t & command);
+    void do_associate(YieldContext yield, SocketPtr client, Clock::time_point arrived);
+    void do_delay(YieldContext yield, Clock::time_point arrived);
+
+    IOLoop & loop;
+    Acceptor acceptor;
+    Clock::duration delay;
+    LinkShape link;
+    std::atomic<std::size_t> tunnels;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "admin_server_p.hpp"
+
+#include "metrics.hpp"
+
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+
+#include <sstream>
+
+
+using s5p::AdminServer;
+using s5p::YieldContext;
+using s5p::Socket;
+using s5p::ErrorCode;
+
+
+namespace {
+
+// a request line and a few headers, anything bigger is not for us
+const std::size_t MAX_REQUEST_SIZE = 8192;
+const std::chrono::milliseconds RETRY_DELAY(100);
+// out of descriptors, accepting again at once would only spin
+const std::chrono::milliseconds ACCEPT_BACKOFF(100);
+// a scrape is one small request, a client that takes longer is dropped
+const std::chrono::seconds REQUEST_TIMEOUT(5);
+
+std::string make_response(const std::string & status, const std::string & type, const std::string & body) {
+    std::ostringstream sout;
+    sout << "HTTP/1.1 " << status << "\r\n"
+         << "Content-Type: " << type << "\r\n"
+         << "Content-Length: " << body.size() << "\r\n"
+         << "Connection: close\r\n"
+         << "\r\n"
+         << body;
+    return sout.str();
+}
+
+}
+
+
+AdminServer::AdminServer(IOLoop & loop)
+    : _(std::make_shared<Private>(loop))
+{
+}
+
+void AdminServer::listen(const std::string & host, uint16_t port) {
+    _->endpoint = EndPoint(boost::asio::ip::make_address(host), port);
+    ErrorCode ec;
+    _->do_listen(ec);
+    if (!ec) {
+        return;
+    }
+    if (ec != boost::asio::error::address_in_use || Application::instance().get_handover_path().empty()) {
+        throw boost::system::system_error(ec, "admin listen");
+    }
+    report_warning("admin port in use, retry until the previous process lets go of it", {
+        {"port", std::to_string(port)},
+    });
+    _->do_retry();
+}
+
+// the drain hands the port to the process that takes over
+void AdminServer::stop() {
+    auto self = _;
+    boost::asio::post(_->loop, [self]() -> void {
+        ErrorCode ec;
+        self->retry.cancel(ec);
+        self->acceptor.close(ec);
+    });
+}
+
+AdminServer::Private::Private(IOLoop & loop)
+    : enable_shared_from_this()
+    , loop(loop)
+    , endpoint()
+    , acceptor(loop)
+    , retry(loop)
+{
+}
+
+void AdminServer::Private::do_listen(ErrorCode & ec) {
+    namespace ph = std::placeholders;
+    this->acceptor.open(this->endpoint.protocol(), ec);
+    if (!ec) {
+        this->acceptor.set_option(Acceptor::reuse_address(true), ec);
+    }
+    if (!ec) {
+        this->acceptor.bind(this->endpoint, ec);
+    }
+    if (!ec) {
+        this->acceptor.listen(Acceptor::max_listen_connections, ec);
+    }
+    if (ec) {
+        ErrorCode ignored;
+        this->acceptor.close(ignored);
+        return;
+    }
+    boost::asio::spawn(this->loop, std::bind(&AdminServer::Private::do_accept, this->shared_from_this(), ph::_1), coroutine_attributes());
+}
+
+void AdminServer::Private::do_retry() {
+    auto self = this->shared_from_this();
+    this->retry.expires_after(RETRY_DELAY);
+    this->retry.async_wait([self](const ErrorCode & ec) -> void {
+        if (ec) {
+            return;
+        }
+        ErrorCode failed;
+        self->do_listen(failed);
+        if (failed == boost::asio::error::address_in_use) {
+            self->do_retry();
+        } else if (failed) {
+            report_error("admin listen", failed);
+        }
+    });
+}
+
+void AdminServer::Private::do_accept(YieldContext yield) {
+    namespace ph = std::placeholders;
+    ErrorCode ec;
+    while (this->acceptor.is_open()) {
+        auto socket = std::make_shared<Socket>(this->loop);
+        this->acceptor.async_accept(*socket, yield[ec]);
+        if (ec == boost::asio::error::operation_aborted) {
+            return;
+        }
+        if (ec) {
+            report_error("admin accept", ec);
+            this->retry.expires_after(ACCEPT_BACKOFF);
+            this->retry.async_wait(yield[ec]);
+            continue;
+        }
+        boost::asio::spawn(this->loop, std::bind(&AdminServer::Private::do_serve, this->shared_from_this(), ph::_1, socket), coroutine_attributes());
+    }
+}
+
+void AdminServer::Private::do_serve(YieldContext yield, std::shared_ptr<Socket> socket) {
+    // closing the socket ends whatever read or write is waiting
+    SteadyTimer deadline(this->loop);
+    deadline.expires_after(REQUEST_TIMEOUT);
+    deadline.async_wait([socket](const ErrorCode & ec) -> void {
+        if (ec) {
+            return;
+        }
+        ErrorCode ignored;
+        socket->close(ignored);
+    });
+
+    ErrorCode ec;
+    boost::asio::streambuf request(MAX_REQUEST_SIZE);
+    boost::asio::async_read_until(*socket, request, "\r\n\r\n", yield[ec]);
+    if (ec) {
+        return;
+    }
+
+    // GET /metrics HTTP/1.1
+    std::istream sin(&request);
+    std::string method;
+    std::string target;
+    sin >> method >> target;
+    // scrapers may add a query, /metrics has no parameters
+    auto path = target.substr(0, target.find('?'));
+
+    std::string response;
+    if (method != "GET") {
+        response = make_response("405 Method Not Allowed", "text/plain", "method not allowed\n");
+    } else if (path != "/metrics") {
+        response = make_response("404 Not Found", "text/plain", "not found\n");
+    } else {
+        std::ostringstream body;
+        report_prometheus(body);
+        response = make_response("200 OK", "text/plain; version=0.0.4", body.str());
+    }
+
+    boost::asio::async_write(*socket, boost::asio::buffer(response), yield[ec]);
+    socket->shutdown(Socket::shutdown_both, ec);
+    socket->close(ec);
+}
@@ -0,0 +1,59 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_ADMIN_SERVER_HPP
+#define S5P_ADMIN_SERVER_HPP
+
+#include "global.hpp"
+
+#include <memory>
+
+
+namespace s5p {
+
+/**
+ * A minimal HTTP listener for operators, serves the metrics in the
+ * Prometheus text format at /metrics.
+ *
+ * With a handover the process being replaced holds the port until it
+ * drains, so a busy port is retried instead of failing the start.
+ */
+class AdminServer {
+public:
+    explicit AdminServer(IOLoop & loop);
+
+    void listen(const std::string & host, uint16_t port);
+    void stop();
+
+private:
+    AdminServer(const AdminServer &);
+    AdminServer & operator = (const AdminServer &);
+    AdminServer(AdminServer &&);
+    AdminServer & operator = (AdminServer &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
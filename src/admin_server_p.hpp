@@ -0,0 +1,48 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_ADMIN_SERVER_HPP_
+#define S5P_ADMIN_SERVER_HPP_
+
+#include "admin_server.hpp"
+
+
+namespace s5p {
+
+class AdminServer::Private : public std::enable_shared_from_this<AdminServer::Private> {
+public:
+    explicit Private(IOLoop & loop);
+
+    void do_listen(ErrorCode & ec);
+    void do_retry();
+    void do_accept(YieldContext yield);
+    void do_serve(YieldContext yield, std::shared_ptr<Socket> socket);
+
+    IOLoop & loop;
+    EndPoint endpoint;
+    Acceptor acceptor;
+    SteadyTimer retry;
+};
+
+}
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "admission_p.hpp"
+#include "metrics.hpp"
+
+
+using s5p::Admission;
+using s5p::Counter;
+using s5p::Gauge;
+
+
+namespace {
+
+// zero means no limit
+bool below(std::size_t value, std::size_t limit) {
+    return limit == 0 || value < limit;
+}
+
+std::size_t low_water(std::size_t limit) {
+    return limit - limit / 10;
+}
+
+}
+
+
+Admission & Admission::instance() {
+    static Admission admission;
+    return admission;
+}
+
+Admission::Admission()
+    : _(std::make_shared<Private>())
+{
+}
+
+// counts the connection in, or tells the caller to shed it
+bool Admission::admit() {
+    auto reason = Counter::SHED_OVERLOADED;
+    if (_->do_enter(reason)) {
+        return true;
+    }
+    count(reason);
+    return false;
+}
+
+// the same for a connection which is not shed but waits for room
+bool Admission::try_enter() {
+    auto reason = Counter::SHED_OVERLOADED;
+    return _->do_enter(reason);
+}
+
+bool Admission::has_room() {
+    if (!_->do_check_room()) {
+        return false;
+    }
+    auto & application = Application::instance();
+    if (!below(_->sessions, application.get_max_sessions()) || !below(_->handshakes, application.get_max_handshakes())) {
+        _->overloaded = true;
+        return false;
+    }
+    return true;
+}
+
+void Admission::end_handshake() {
+    _->handshakes.fetch_sub(1);
+    adjust(Gauge::HANDSHAKES_ACTIVE, -1);
+}
+
+void Admission::leave(bool handshaking) {
+    if (handshaking) {
+        this->end_handshake();
+    }
+    _->sessions.fetch_sub(1);
+}
+
+Admission::Private::Private()
+    : sessions(0)
+    , handshakes(0)
+    , overloaded(false)
+{
+}
+
+// takes a slot of both limits at once, so no thread overshoots them; reason
+// tells which limit is hit otherwise
+bool Admission::Private::do_enter(Counter & reason) {
+    auto & application = Application::instance();
+    auto max_sessions = application.get_max_sessions();
+    auto max_handshakes = application.get_max_handshakes();
+
+    if (!this->do_check_room()) {
+        reason = Counter::SHED_OVERLOADED;
+        return false;
+    }
+    auto sessions = this->sessions.fetch_add(1) + 1;
+    auto handshakes = this->handshakes.fetch_add(1) + 1;
+    if (!below(sessions - 1, max_sessions) || !below(handshakes - 1, max_handshakes)) {
+        reason = below(sessions - 1, max_sessions) ? Counter::SHED_HANDSHAKES : Counter::SHED_SESSIONS;
+        this->sessions.fetch_sub(1);
+        this->handshakes.fetch_sub(1);
+        this->overloaded = true;
+        return false;
+    }
+    adjust(Gauge::HANDSHAKES_ACTIVE, 1);
+    return true;
+}
+
+// leaves the overloaded state only below the low water marks
+bool Admission::Private::do_check_room() {
+    if (!this->overloaded.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    auto & application = Application::instance();
+    auto max_sessions = application.get_max_sessions();
+    auto max_handshakes = application.get_max_handshakes();
+    if ((max_sessions > 0 && this->sessions > low_water(max_sessions))
+        || (max_handshakes > 0 && this->handshakes > low_water(max_handshakes))) {
+        return false;
+    }
+    this->overloaded = false;
+    return true;
+}
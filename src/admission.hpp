@@ -0,0 +1,66 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_ADMISSION_HPP
+#define S5P_ADMISSION_HPP
+
+#include "global.hpp"
+
+#include <memory>
+
+
+namespace s5p {
+
+/**
+ * Limits the sessions and the handshakes in progress, over all threads.
+ *
+ * Once a limit is hit, new connections are shed until both counts fall back
+ * below nine tenths of their limits, so the proxy does not flap at the edge.
+ * A listener which pauses instead of shedding holds on to what it has
+ * accepted until try_enter() takes it, and checks has_room() before
+ * accepting more.
+ */
+class Admission {
+public:
+    static Admission & instance();
+
+    Admission();
+
+    bool admit();
+    bool try_enter();
+    bool has_room();
+    void end_handshake();
+    void leave(bool handshaking);
+
+private:
+    Admission(const Admission &);
+    Admission & operator = (const Admission &);
+    Admission(Admission &&);
+    Admission & operator = (Admission &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "balancer_p.hpp"
+
+#include "exception.hpp"
+#include "metrics.hpp"
+#include "tunnel.hpp"
+
+
+using s5p::Balancer;
+using s5p::BalancePolicy;
+using s5p::RoundRobinPolicy;
+using s5p::LeastActivePolicy;
+using s5p::LatencyPolicy;
+using s5p::Upstream;
+using s5p::UpstreamList;
+using s5p::Tunnel;
+using s5p::ErrorCode;
+using s5p::YieldContext;
+using s5p::BalanceMode;
+using s5p::TargetMode;
+using s5p::Counter;
+
+
+Balancer & Balancer::instance() {
+    static Balancer balancer;
+    return balancer;
+}
+
+Balancer::Balancer()
+    : _(std::make_shared<Balancer::Private>())
+{
+}
+
+void Balancer::start(IOLoop & loop) {
+    auto & application = Application::instance();
+
+    for (auto & address : application.get_upstreams()) {
+        _->upstreams.push_back(std::make_shared<Upstream>(address.first, address.second));
+    }
+
+    switch (application.get_balance_mode()) {
+    case BalanceMode::LEAST_ACTIVE:
+        _->policy.reset(new LeastActivePolicy);
+        break;
+    case BalanceMode::LATENCY:
+        _->policy.reset(new LatencyPolicy);
+        break;
+    default:
+        _->policy.reset(new RoundRobinPolicy);
+        break;
+    }
+
+    // there is no alternative to switch to with a single upstream
+    if (_->upstreams.size() > 1 && application.get_health_interval() > 0) {
+        _->loop = &loop;
+        _->timer.reset(new SteadyTimer(loop));
+        _->do_schedule();
+    }
+}
+
+std::shared_ptr<Upstream> Balancer::pick() {
+    if (_->upstreams.size() == 1) {
+        return _->upstreams.front();
+    }
+
+    UpstreamList candidates;
+    for (auto & upstream : _->upstreams) {
+        if (upstream->is_healthy()) {
+            candidates.push_back(upstream);
+        }
+    }
+    // everything is down, keep trying rather than refuse everyone
+    if (candidates.empty()) {
+        return _->policy->pick(_->upstreams);
+    }
+    return _->policy->pick(candidates);
+}
+
+Balancer::Private::Private()
+    : loop(nullptr)
+    , timer()
+    , policy()
+    , upstreams()
+{
+}
+
+void Balancer::Private::do_schedule() {
+    namespace ph = std::placeholders;
+
+    auto interval = std::chrono::seconds(Application::instance().get_health_interval());
+    this->timer->expires_after(interval);
+    this->timer->async_wait(std::bind(&Balancer::Private::on_schedule, this, ph::_1));
+}
+
+void Balancer::Private::on_schedule(const ErrorCode & ec) {
+    namespace ph = std::placeholders;
+
+    if (ec) {
+        return;
+    }
+    for (auto & upstream : this->upstreams) {
+        boost::asio::spawn(*this->loop, std::bind(&Balancer::Private::do_probe, this, ph::_1, upstream), coroutine_attributes());
+    }
+    this->do_schedule();
+}
+
+void Balancer::Private::do_probe(YieldContext yield, std::shared_ptr<Upstream> upstream) {
+    // a full handshake, the tunnel reports the outcome to the upstream;
+    // without a fixed target there is nothing to CONNECT to
+    auto & application = Application::instance();
+    auto tunnel = std::make_shared<Tunnel>(*this->loop, upstream);
+    bool fixed = application.get_target_mode() == TargetMode::FIXED;
+
+    LogFields fields = {
+        {"phase", "probe"},
+        {"upstream", upstream->host() + ":" + std::to_string(upstream->port())},
+    };
+
+    // one deadline for both phases, a cancelled tunnel reports a failure
+    SteadyTimer deadline(*this->loop);
+    auto timed_out = std::make_shared<bool>(false);
+    if (application.get_connect_timeout() > 0 && application.get_handshake_timeout() > 0) {
+        std::weak_ptr<Tunnel> victim = tunnel;
+        deadline.expires_after(std::chrono::seconds(application.get_connect_timeout() + application.get_handshake_timeout()));
+        deadline.async_wait([victim, timed_out](const ErrorCode & ec) -> void {
+            auto tunnel = victim.lock();
+            if (!ec && tunnel) {
+                *timed_out = true;
+                tunnel->cancel();
+            }
+        });
+    }
+
+    ErrorCode ec;
+    try {
+        if (!tunnel->connect(yield)) {
+            count(Counter::ERRORS_CONNECTION);
+            report_error(*timed_out ? "socks5 probe timed out" : "socks5 probe cannot connect", fields);
+        } else if (!(fixed ? tunnel->handshake(yield, ec) : tunnel->greet(yield, ec))) {
+            count(Counter::ERRORS_CONNECTION);
+            if (*timed_out) {
+                report_error("socks5 probe timed out", fields);
+            } else {
+                report_error("socks5 probe failed", ec, fields);
+            }
+        }
+    } catch (ResolutionError & e) {
+        count(Counter::ERRORS_RESOLUTION);
+        report_error("cannot resolve the domain", e, fields);
+    } catch (Socks5Error & e) {
+        count(Counter::ERRORS_SOCKS5);
+        report_error("socks5 probe refused", e, fields);
+    }
+    deadline.cancel(ec);
+    tunnel->socket().close(ec);
+}
+
+
+BalancePolicy::~BalancePolicy() {
+}
+
+RoundRobinPolicy::RoundRobinPolicy()
+    : next_(0)
+{
+}
+
+std::shared_ptr<Upstream> RoundRobinPolicy::pick(const UpstreamList & candidates) {
+    auto index = this->next_.fetch_add(1, std::memory_order_relaxed);
+    return candidates[index % candidates.size()];
+}
+
+std::shared_ptr<Upstream> LeastActivePolicy::pick(const UpstreamList & candidates) {
+    auto rv = candidates.front();
+    for (auto & upstream : candidates) {
+        if (upstream->active_sessions() < rv->active_sessions()) {
+            rv = upstream;
+        }
+    }
+    return rv;
+}
+
+std::shared_ptr<Upstream> LatencyPolicy::pick(const UpstreamList & candidates) {
+    // weigh the latency by the load, otherwise the fastest upstream would
+    // take every session until its latency degrades
+    auto score = [](const std::shared_ptr<Upstream> & upstream) -> double {
+        return upstream->latency() * (upstream->active_sessions() + 1);
+    };
+
+    auto rv = candidates.front();
+    auto best = score(rv);
+    for (auto & upstream : candidates) {
+        auto value = score(upstream);
+        if (value < best) {
+            rv = upstream;
+            best = value;
+        }
+    }
+    return rv;
+}
@@ -0,0 +1,58 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_BALANCER_HPP
+#define S5P_BALANCER_HPP
+
+#include "upstream.hpp"
+
+#include <memory>
+
+
+namespace s5p {
+
+/**
+ * Chooses the upstream SOCKS5 server of each tunnel, and probes them to keep
+ * slow or dead ones out of the rotation.
+ */
+class Balancer {
+public:
+    static Balancer & instance();
+
+    Balancer();
+
+    void start(IOLoop & loop);
+    std::shared_ptr<Upstream> pick();
+
+private:
+    Balancer(const Balancer &);
+    Balancer & operator = (const Balancer &);
+    Balancer(Balancer &&);
+    Balancer & operator = (Balancer &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_BALANCER_HPP_
+#define S5P_BALANCER_HPP_
+
+#include "balancer.hpp"
+
+#include <atomic>
+#include <vector>
+
+
+namespace s5p {
+
+typedef std::vector<std::shared_ptr<Upstream>> UpstreamList;
+
+
+class BalancePolicy {
+public:
+    virtual ~BalancePolicy();
+
+    virtual std::shared_ptr<Upstream> pick(const UpstreamList & candidates) = 0;
+};
+
+
+class RoundRobinPolicy : public BalancePolicy {
+public:
+    RoundRobinPolicy();
+
+    virtual std::shared_ptr<Upstream> pick(const UpstreamList & candidates);
+
+private:
+    std::atomic<std::size_t> next_;
+};
+
+
+class LeastActivePolicy : public BalancePolicy {
+public:
+    virtual std::shared_ptr<Upstream> pick(const UpstreamList & candidates);
+};
+
+
+class LatencyPolicy : public BalancePolicy {
+public:
+    virtual std::shared_ptr<Upstream> pick(const UpstreamList & candidates);
+};
+
+
+class Balancer::Private {
+public:
+    Private();
+
+    void do_schedule();
+    void on_schedule(const ErrorCode & ec);
+    void do_probe(YieldContext yield, std::shared_ptr<Upstream> upstream);
+
+    IOLoop * loop;
+    std::unique_ptr<SteadyTimer> timer;
+    std::unique_ptr<BalancePolicy> policy;
+    UpstreamList upstreams;
+};
+
+}
+
+#endif
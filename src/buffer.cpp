@@ -0,0 +1,153 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "buffer.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+
+using s5p::Buffer;
+using s5p::Gauge;
+using s5p::Counter;
+
+
+namespace {
+
+const std::size_t SMALLEST_SIZE = 4 * 1024;
+// idle memory one thread keeps for each size class
+const std::size_t IDLE_BYTES_PER_CLASS = 1024 * 1024;
+
+class FreeList {
+public:
+    FreeList();
+    ~FreeList();
+
+    uint8_t * take(std::size_t size_class);
+    void give(uint8_t * data, std::size_t size_class);
+
+private:
+    std::array<std::vector<uint8_t *>, Buffer::CLASSES> lists_;
+};
+
+FreeList & free_list() {
+    // sessions never leave their shard, so each thread owns its buffers
+    thread_local FreeList list;
+    return list;
+}
+
+}
+
+
+Buffer::Buffer(std::size_t size_class)
+    : data_(nullptr)
+    , size_class_(std::min(size_class, CLASSES - 1))
+{
+    this->data_ = free_list().take(this->size_class_);
+    s5p::adjust(Gauge::BUFFERS_IN_USE, 1);
+    s5p::adjust(Gauge::BUFFER_BYTES_IN_USE, this->size());
+}
+
+Buffer::~Buffer() {
+    s5p::adjust(Gauge::BUFFERS_IN_USE, -1);
+    s5p::adjust(Gauge::BUFFER_BYTES_IN_USE, -static_cast<int64_t>(this->size()));
+    free_list().give(this->data_, this->size_class_);
+}
+
+uint8_t * Buffer::data() {
+    return this->data_;
+}
+
+std::size_t Buffer::size() const {
+    return class_size(this->size_class_);
+}
+
+std::size_t Buffer::size_class() const {
+    return this->size_class_;
+}
+
+boost::asio::mutable_buffer Buffer::buffer() {
+    return boost::asio::buffer(this->data_, this->size());
+}
+
+boost::asio::const_buffer Buffer::buffer(std::size_t length) const {
+    return boost::asio::buffer(this->data_, length);
+}
+
+std::size_t Buffer::class_size(std::size_t size_class) {
+    // 4 KiB, 16 KiB, 64 KiB, 256 KiB
+    return SMALLEST_SIZE << (2 * size_class);
+}
+
+std::size_t Buffer::next_class(std::size_t size_class, std::size_t length) {
+    // a full read means more is waiting, fewer but bigger syscalls
+    if (length >= class_size(size_class)) {
+        return std::min(size_class + 1, CLASSES - 1);
+    }
+    if (size_class > 0 && length <= class_size(size_class - 1) / 2) {
+        return size_class - 1;
+    }
+    return size_class;
+}
+
+
+FreeList::FreeList()
+    : lists_()
+{
+}
+
+// runs at thread exit, when the thread's metrics slot may be gone already,
+// so the idle gauge is left alone
+FreeList::~FreeList() {
+    for (auto & list : this->lists_) {
+        for (auto data : list) {
+            delete [] data;
+        }
+    }
+}
+
+uint8_t * FreeList::take(std::size_t size_class) {
+    auto & list = this->lists_[size_class];
+    auto size = Buffer::class_size(size_class);
+    if (list.empty()) {
+        s5p::count(Counter::BUFFERS_ALLOCATED);
+        return new uint8_t[size];
+    }
+    // the most recently returned buffer is the most likely to be cached
+    auto data = list.back();
+    list.pop_back();
+    s5p::adjust(Gauge::BUFFER_BYTES_IDLE, -static_cast<int64_t>(size));
+    return data;
+}
+
+void FreeList::give(uint8_t * data, std::size_t size_class) {
+    auto & list = this->lists_[size_class];
+    auto size = Buffer::class_size(size_class);
+    if (list.size() * size >= IDLE_BYTES_PER_CLASS) {
+        delete [] data;
+        return;
+    }
+    list.push_back(data);
+    s5p::adjust(Gauge::BUFFER_BYTES_IDLE, size);
+}
@@ -0,0 +1,68 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_BUFFER_HPP
+#define S5P_BUFFER_HPP
+
+#include <boost/asio/buffer.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace s5p {
+
+/**
+ * A relay buffer borrowed from a per-thread pool.
+ *
+ * Buffers come in a few size classes, from 4 KiB to 256 KiB. The memory goes
+ * back to the pool of the current thread when the buffer is destroyed.
+ */
+class Buffer {
+public:
+    static const std::size_t CLASSES = 4;
+
+    explicit Buffer(std::size_t size_class);
+    ~Buffer();
+
+    uint8_t * data();
+    std::size_t size() const;
+    std::size_t size_class() const;
+    boost::asio::mutable_buffer buffer();
+    boost::asio::const_buffer buffer(std::size_t length) const;
+
+    static std::size_t class_size(std::size_t size_class);
+    static std::size_t next_class(std::size_t size_class, std::size_t length);
+
+private:
+    Buffer(const Buffer &);
+    Buffer & operator = (const Buffer &);
+    Buffer(Buffer &&);
+    Buffer & operator = (Buffer &&);
+
+    uint8_t * data_;
+    std::size_t size_class_;
+};
+
+}
+
+#endif
@@ -29,6 +29,7 @@ using s5p::ResolutionError;
 using s5p::ConnectionError;
 using s5p::BasicPlainError;
 using s5p::Socks5Error;
+using s5p::RequestError;
 
 
 BasicError::BasicError()
@@ -39,7 +40,7 @@ BasicBoostError::BasicBoostError(boost::system::system_error && e)
     : e_(e)
 {}
 
-const boost::system::error_code & BasicBoostError::code() const {
+boost::system::error_code BasicBoostError::code() const {
     return this->e_.code();
 }
 
@@ -64,6 +65,20 @@ const char * BasicPlainError::what() const noexcept {
     return this->msg_.c_str();
 }
 
-Socks5Error::Socks5Error(const std::string & msg)
+Socks5Error::Socks5Error(const std::string & msg, uint8_t reply)
     : BasicPlainError(msg)
+    , reply_(reply)
 {}
+
+uint8_t Socks5Error::reply() const {
+    return this->reply_;
+}
+
+RequestError::RequestError(const std::string & msg, uint8_t reply)
+    : BasicPlainError(msg)
+    , reply_(reply)
+{}
+
+uint8_t RequestError::reply() const {
+    return this->reply_;
+}
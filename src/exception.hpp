@@ -25,6 +25,7 @@
 
 #include <boost/system/system_error.hpp>
 
+#include <cstdint>
 #include <exception>
 
 
@@ -41,7 +42,7 @@ class BasicBoostError : public BasicError {
 public:
     explicit BasicBoostError(boost::system::system_error && e);
 
-    const boost::system::error_code & code() const;
+    boost::system::error_code code() const;
 
     virtual const char * what() const noexcept;
 
@@ -73,9 +74,27 @@ private:
 };
 
 
+// reply is the REP field of SOCKS5, what went wrong in its terms
 class Socks5Error : public BasicPlainError {
 public:
-    explicit Socks5Error(const std::string & msg);
+    explicit Socks5Error(const std::string & msg, uint8_t reply = 0x01);
+
+    uint8_t reply() const;
+
+private:
+    uint8_t reply_;
+};
+
+
+// a client asked for its target in a way the proxy does not understand
+class RequestError : public BasicPlainError {
+public:
+    explicit RequestError(const std::string & msg, uint8_t reply = 0x01);
+
+    uint8_t reply() const;
+
+private:
+    uint8_t reply_;
 };
 
 
@@ -0,0 +1,409 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "frontend_p.hpp"
+
+#include "exception.hpp"
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/asio/read.hpp>
+
+#include <algorithm>
+#include <cctype>
+
+
+using s5p::Frontend;
+using s5p::Target;
+using s5p::Counter;
+using s5p::RequestError;
+using s5p::AddressType;
+using s5p::TargetMode;
+
+
+namespace {
+
+// an HTTP request the proxy cannot make sense of, the client gets a 400
+const uint8_t REPLY_BAD_REQUEST = 0x07;
+
+// proxy-only headers and the ones about this connection, never passed on
+// to the target
+const char * const DROPPED_HEADERS[] = {
+    "Proxy-Connection", "Proxy-Authorization", "Connection", "Keep-Alive",
+};
+
+bool parse_port(const std::string & text, uint16_t & port) {
+    if (text.empty() || text.size() > 5) {
+        return false;
+    }
+    uint32_t value = 0;
+    for (auto c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + static_cast<uint32_t>(c - '0');
+    }
+    if (value == 0 || value > 65535) {
+        return false;
+    }
+    port = static_cast<uint16_t>(value);
+    return true;
+}
+
+bool is_host_name(const std::string & host) {
+    return std::all_of(std::begin(host), std::end(host), [](char c) -> bool {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '.' || c == '_';
+    });
+}
+
+// host, host:port, [v6] or [v6]:port
+Target parse_authority(const std::string & authority, uint16_t default_port) {
+    std::string host;
+    std::string port;
+    bool bracketed = !authority.empty() && authority[0] == '[';
+    if (bracketed) {
+        auto close = authority.find(']');
+        if (close == std::string::npos) {
+            return Target();
+        }
+        host = authority.substr(1, close - 1);
+        auto rest = authority.substr(close + 1);
+        if (!rest.empty() && (rest[0] != ':' || rest.size() == 1)) {
+            return Target();
+        }
+        port = rest.empty() ? rest : rest.substr(1);
+    } else {
+        auto colon = authority.rfind(':');
+        host = authority.substr(0, colon);
+        if (colon != std::string::npos) {
+            port = authority.substr(colon + 1);
+        }
+    }
+
+    uint16_t number = default_port;
+    if (!port.empty() && !parse_port(port, number)) {
+        return Target();
+    }
+    if (number == 0) {
+        return Target();
+    }
+    auto target = s5p::make_target(host, number);
+    if (bracketed ? target.type != AddressType::IPV6 : (target.type == AddressType::IPV6 || !is_host_name(host))) {
+        return Target();
+    }
+    return target;
+}
+
+const char * http_status(uint8_t reply) {
+    switch (reply) {
+    case 0x02:
+        return "403 Forbidden";
+    case 0x06:
+        return "504 Gateway Timeout";
+    case 0x07:
+    case 0x08:
+        return "400 Bad Request";
+    default:
+        return "502 Bad Gateway";
+    }
+}
+
+}
+
+
+Frontend::Frontend(Socket & socket)
+    : _(std::make_shared<Private>(socket))
+{
+}
+
+// false if the client went away first
+bool Frontend::read_request(YieldContext yield, ErrorCode & ec) {
+    auto mode = Application::instance().get_target_mode();
+    if (mode == TargetMode::AUTO) {
+        // a SOCKS5 greeting starts with its version, no request line does
+        std::array<uint8_t, 1> first;
+        _->socket.async_receive(boost::asio::buffer(first), Socket::message_peek, yield[ec]);
+        if (ec) {
+            return false;
+        }
+        mode = first[0] == 0x05 ? TargetMode::SOCKS5 : TargetMode::HTTP;
+    }
+    if (mode == TargetMode::SOCKS5) {
+        return _->do_read_socks5(yield, ec);
+    }
+    return _->do_read_http(yield, ec);
+}
+
+const Target & Frontend::target() const {
+    return _->target;
+}
+
+// what the target gets before anything else the client sends
+const std::string & Frontend::early_data() const {
+    return _->early;
+}
+
+// which counter the request goes to
+Counter Frontend::kind() const {
+    return _->kind;
+}
+
+// the tunnel is up, bound is what the SOCKS5 server reported
+void Frontend::accept(YieldContext yield, const EndPoint & bound, ErrorCode & ec) {
+    auto answer = _->answer;
+    _->answer = Private::Answer::NONE;
+    if (answer == Private::Answer::HTTP_CONNECT) {
+        static const std::string established = "HTTP/1.1 200 Connection Established\r\n\r\n";
+        write_buffer(yield, _->socket, boost::asio::buffer(established), ec);
+        return;
+    }
+    if (answer != Private::Answer::SOCKS5) {
+        return;
+    }
+
+    // VER REP RSV ATYP BND.ADDR BND.PORT
+    Chunk chunk;
+    chunk[0] = 0x05;
+    chunk[1] = 0x00;
+    chunk[2] = 0x00;
+    std::size_t length = 4;
+    if (bound.address().is_v6()) {
+        chunk[3] = 0x04;
+        auto bytes = bound.address().to_v6().to_bytes();
+        std::copy(std::begin(bytes), std::end(bytes), std::next(std::begin(chunk), length));
+        length += bytes.size();
+    } else {
+        chunk[3] = 0x01;
+        auto bytes = bound.address().to_v4().to_bytes();
+        std::copy(std::begin(bytes), std::end(bytes), std::next(std::begin(chunk), length));
+        length += bytes.size();
+    }
+    put_big_endian(&chunk[length], bound.port());
+    length += 2;
+    write_chunk(yield, _->socket, chunk, length, ec);
+}
+
+// best effort, the session is over anyway
+void Frontend::refuse(YieldContext yield, uint8_t reply) {
+    auto answer = _->answer;
+    _->answer = Private::Answer::NONE;
+    ErrorCode ignored;
+    if (answer == Private::Answer::SOCKS5) {
+        std::array<uint8_t, 10> chunk = { 0x05, reply, 0x00, 0x01, };
+        write_buffer(yield, _->socket, boost::asio::buffer(chunk), ignored);
+        return;
+    }
+    if (answer == Private::Answer::HTTP_CONNECT || answer == Private::Answer::HTTP_REQUEST) {
+        auto response = std::string("HTTP/1.1 ") + http_status(reply) + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        write_buffer(yield, _->socket, boost::asio::buffer(response), ignored);
+    }
+}
+
+Frontend::Private::Private(Socket & socket)
+    : socket(socket)
+    , target()
+    , early()
+    , kind(Counter::TARGETS_HOST)
+    , answer(Answer::NONE)
+{
+}
+
+bool Frontend::Private::do_read_http(YieldContext yield, ErrorCode & ec) {
+    this->answer = Answer::HTTP_REQUEST;
+
+    // the head must fit in one chunk, it may be sent on as early data
+    Chunk chunk;
+    std::string head;
+    auto end = std::string::npos;
+    while (end == std::string::npos) {
+        if (head.size() >= chunk.size()) {
+            throw RequestError("request head too long", REPLY_BAD_REQUEST);
+        }
+        auto length = read_buffer(yield, this->socket, boost::asio::buffer(chunk, chunk.size() - head.size()), ec);
+        if (ec) {
+            return false;
+        }
+        auto from = head.size() < 3 ? 0 : head.size() - 3;
+        head.append(reinterpret_cast<const char *>(chunk.data()), length);
+        end = head.find("\r\n\r\n", from);
+    }
+    auto rest = head.substr(end + 4);
+    head.resize(end + 2);
+
+    // METHOD SP request-target SP HTTP-version
+    std::vector<std::string> lines;
+    for (std::size_t begin = 0; begin < head.size();) {
+        auto eol = head.find("\r\n", begin);
+        lines.push_back(head.substr(begin, eol - begin));
+        begin = eol + 2;
+    }
+    auto & start_line = lines.front();
+    auto first = start_line.find(' ');
+    auto last = start_line.rfind(' ');
+    if (first == std::string::npos || last == first) {
+        throw RequestError("malformed request line", REPLY_BAD_REQUEST);
+    }
+    auto method = start_line.substr(0, first);
+    auto request_target = start_line.substr(first + 1, last - first - 1);
+    auto version = start_line.substr(last + 1);
+
+    if (method == "CONNECT") {
+        this->answer = Answer::HTTP_CONNECT;
+        this->target = parse_authority(request_target, 0);
+        if (this->target.type == AddressType::UNKNOWN) {
+            throw RequestError("invalid CONNECT target", REPLY_BAD_REQUEST);
+        }
+        this->kind = Counter::TARGETS_CONNECT;
+        this->early = rest;
+        return true;
+    }
+
+    // an absolute URI wins over the Host header, the target gets the path
+    std::string authority;
+    auto path = request_target;
+    if (boost::algorithm::istarts_with(request_target, "http://")) {
+        auto slash = request_target.find('/', 7);
+        authority = request_target.substr(7, slash == std::string::npos ? std::string::npos : slash - 7);
+        path = slash == std::string::npos ? "/" : request_target.substr(slash);
+        auto at = authority.rfind('@');
+        if (at != std::string::npos) {
+            authority = authority.substr(at + 1);
+        }
+    } else if (request_target.find("://") != std::string::npos) {
+        throw RequestError("only http is forwarded without CONNECT", REPLY_BAD_REQUEST);
+    }
+
+    std::string forwarded = method + " " + path + " " + version + "\r\n";
+    for (std::size_t i = 1; i < lines.size(); ++i) {
+        auto colon = lines[i].find(':');
+        auto name = boost::algorithm::trim_copy(lines[i].substr(0, colon));
+        if (authority.empty() && colon != std::string::npos && boost::algorithm::iequals(name, "Host")) {
+            authority = boost::algorithm::trim_copy(lines[i].substr(colon + 1));
+        }
+        bool dropped = std::any_of(std::begin(DROPPED_HEADERS), std::end(DROPPED_HEADERS), [&name](const char * header) -> bool {
+            return boost::algorithm::iequals(name, header);
+        });
+        if (!dropped) {
+            forwarded += lines[i] + "\r\n";
+        }
+    }
+    // the target closes after its response, which ends the session, so the
+    // next request comes on a new connection and is parsed for its own target
+    forwarded += "Connection: close\r\n\r\n";
+    if (forwarded.size() + rest.size() > chunk.size()) {
+        throw RequestError("request head too long", REPLY_BAD_REQUEST);
+    }
+
+    this->target = parse_authority(authority, 80);
+    if (this->target.type == AddressType::UNKNOWN) {
+        throw RequestError(authority.empty() ? "missing Host header" : "invalid Host header", REPLY_BAD_REQUEST);
+    }
+    this->kind = Counter::TARGETS_HOST;
+    this->early = forwarded + rest;
+    return true;
+}
+
+bool Frontend::Private::do_read_socks5(YieldContext yield, ErrorCode & ec) {
+    Chunk chunk;
+
+    // VER NMETHODS METHODS
+    boost::asio::async_read(this->socket, boost::asio::buffer(chunk, 2), yield[ec]);
+    if (ec) {
+        return false;
+    }
+    if (chunk[0] != 0x05) {
+        throw RequestError("not a SOCKS5 greeting");
+    }
+    auto methods = chunk[1];
+    boost::asio::async_read(this->socket, boost::asio::buffer(chunk, methods), yield[ec]);
+    if (ec) {
+        return false;
+    }
+    bool no_auth = std::find(std::begin(chunk), std::next(std::begin(chunk), methods), 0x00) != std::next(std::begin(chunk), methods);
+    chunk[0] = 0x05;
+    chunk[1] = no_auth ? 0x00 : 0xff;
+    write_chunk(yield, this->socket, chunk, 2, ec);
+    if (ec) {
+        return false;
+    }
+    if (!no_auth) {
+        throw RequestError("no acceptable auth method");
+    }
+    this->answer = Answer::SOCKS5;
+
+    // VER CMD RSV ATYP
+    boost::asio::async_read(this->socket, boost::asio::buffer(chunk, 4), yield[ec]);
+    if (ec) {
+        return false;
+    }
+    if (chunk[0] != 0x05) {
+        throw RequestError("wrong SOCKS5 version");
+    }
+    if (chunk[1] != 0x01) {
+        throw RequestError("only CONNECT is supported", 0x07);
+    }
+
+    // DST.ADDR
+    switch (chunk[3]) {
+    case 0x01: {
+        AddressV4::bytes_type bytes;
+        boost::asio::async_read(this->socket, boost::asio::buffer(bytes), yield[ec]);
+        this->target.type = AddressType::IPV4;
+        this->target.ipv4 = AddressV4(bytes);
+        break;
+    }
+    case 0x04: {
+        AddressV6::bytes_type bytes;
+        boost::asio::async_read(this->socket, boost::asio::buffer(bytes), yield[ec]);
+        this->target.type = AddressType::IPV6;
+        this->target.ipv6 = AddressV6(bytes);
+        break;
+    }
+    case 0x03: {
+        boost::asio::async_read(this->socket, boost::asio::buffer(chunk, 1), yield[ec]);
+        if (ec) {
+            return false;
+        }
+        std::string host(chunk[0], '\0');
+        boost::asio::async_read(this->socket, boost::asio::buffer(&host[0], host.size()), yield[ec]);
+        this->target = make_target(host, 0);
+        if (!ec && this->target.type == AddressType::UNKNOWN) {
+            throw RequestError("empty domain name", 0x08);
+        }
+        break;
+    }
+    default:
+        throw RequestError("unknown address type", 0x08);
+    }
+    if (ec) {
+        return false;
+    }
+
+    // DST.PORT
+    boost::asio::async_read(this->socket, boost::asio::buffer(chunk, 2), yield[ec]);
+    if (ec) {
+        return false;
+    }
+    this->target.port = get_big_endian(chunk.data());
+    this->kind = Counter::TARGETS_SOCKS5;
+    return true;
+}
@@ -0,0 +1,70 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_FRONTEND_HPP
+#define S5P_FRONTEND_HPP
+
+#include "global.hpp"
+#include "metrics.hpp"
+
+#include <memory>
+
+
+namespace s5p {
+
+/**
+ * The client side of a dynamic target: reads which target the client asks
+ * for, and answers once the tunnel to it is up or has failed.
+ *
+ * An HTTP client names it with CONNECT, or with the Host header or the
+ * absolute URI of a request, which is then passed on as early data with
+ * Connection: close, so every such request gets a connection of its own. A
+ * SOCKS5 client names it in a CONNECT request, without authentication.
+ *
+ * Failures are given as SOCKS5 reply codes, an HTTP client gets the closest
+ * status instead. Only a malformed request throws.
+ */
+class Frontend {
+public:
+    explicit Frontend(Socket & socket);
+
+    bool read_request(YieldContext yield, ErrorCode & ec);
+    const Target & target() const;
+    const std::string & early_data() const;
+    Counter kind() const;
+
+    void accept(YieldContext yield, const EndPoint & bound, ErrorCode & ec);
+    void refuse(YieldContext yield, uint8_t reply);
+
+private:
+    Frontend(const Frontend &);
+    Frontend & operator = (const Frontend &);
+    Frontend(Frontend &&);
+    Frontend & operator = (Frontend &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_FRONTEND_HPP_
+#define S5P_FRONTEND_HPP_
+
+#include "frontend.hpp"
+
+
+namespace s5p {
+
+class Frontend::Private {
+public:
+    // what the client waits to hear back
+    enum class Answer : uint8_t {
+        NONE,
+        HTTP_CONNECT,
+        HTTP_REQUEST,
+        SOCKS5,
+    };
+
+    explicit Private(Socket & socket);
+
+    bool do_read_http(YieldContext yield, ErrorCode & ec);
+    bool do_read_socks5(YieldContext yield, ErrorCode & ec);
+
+    Socket & socket;
+    Target target;
+    std::string early;
+    Counter kind;
+    Answer answer;
+};
+
+}
+
+#endif
@@ -22,10 +22,18 @@
  */
 #include "global_p.hpp"
 
+#include "logger.hpp"
+#include "metrics.hpp"
+
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/lexical_cast.hpp>
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
 #include <sstream>
+#include <thread>
 #include <cassert>
 #include <csignal>
 
@@ -40,6 +48,7 @@ namespace s5p {
 
 typedef boost::asio::signal_set SignalHandler;
 typedef boost::asio::ip::address Address;
+typedef boost::coroutines::stack_traits StackTraits;
 
 }
 
@@ -51,6 +60,15 @@ using s5p::ErrorCode;
 using s5p::AddressType;
 using s5p::AddressV4;
 using s5p::AddressV6;
+using s5p::RelayMode;
+using s5p::TargetMode;
+using s5p::Target;
+using s5p::BalanceMode;
+using s5p::IOEngine;
+using s5p::OverloadMode;
+using s5p::LogLevel;
+using s5p::Logger;
+using s5p::Gauge;
 
 
 static Application * singleton = nullptr;
@@ -84,38 +102,131 @@ int Application::prepare() {
     }
 
     std::ostringstream sout;
+#ifndef SO_REUSEPORT
+    if (this->get_threads() > 1) {
+        sout << "<threads> requires SO_REUSEPORT" << std::endl;
+    }
+#endif
     if (this->get_port() == 0) {
         sout << "missing <port>" << std::endl;
     }
-    if (this->get_socks5_host().empty()) {
+    if (this->get_socks5_host().empty() && this->get_upstreams().empty()) {
         sout << "missing <socks5_host>" << std::endl;
     }
-    if (this->get_socks5_port() == 0) {
+    if (!this->get_socks5_host().empty() && this->get_socks5_port() == 0) {
         sout << "missing <socks5_port>" << std::endl;
     }
-    if (this->get_http_port() == 0) {
-        sout << "missing <http_port>" << std::endl;
+    if (!_->upstreams_valid) {
+        sout << "invalid <upstream>" << std::endl;
+    }
+    if (this->get_balance_mode() == BalanceMode::UNKNOWN) {
+        sout << "invalid <balance>" << std::endl;
+    }
+    if (this->get_target_mode() == TargetMode::UNKNOWN) {
+        sout << "invalid <target>" << std::endl;
+    }
+    if (this->get_target_mode() == TargetMode::FIXED) {
+        if (this->get_http_target().port == 0) {
+            sout << "missing <http_port>" << std::endl;
+        }
+        if (this->get_http_target().type == AddressType::UNKNOWN) {
+            sout << "invalid <http_host>" << std::endl;
+        }
+    } else if (this->get_target_mode() != TargetMode::UNKNOWN) {
+        // pooled tunnels, reused tunnels and cached responses all belong to
+        // the one target
+        if (_->pool_min > 0 || _->pool_max > 0) {
+            sout << "the tunnel pool needs a fixed <target>" << std::endl;
+        }
+        if (this->get_http_keep_alive()) {
+            sout << "--http-keep-alive needs a fixed <target>" << std::endl;
+        }
+        if (this->get_http_cache_size() > 0) {
+            sout << "--http-cache needs a fixed <target>" << std::endl;
+        }
+        if (this->get_udp_port() != 0) {
+            sout << "<udp_port> needs a fixed <target>" << std::endl;
+        }
+    }
+    if (this->get_relay_mode() == RelayMode::UNKNOWN) {
+        sout << "invalid <relay>" << std::endl;
+    }
+    if (this->get_io_engine() == IOEngine::UNKNOWN) {
+        sout << "invalid <engine>" << std::endl;
+    }
+    if (this->get_pool_max() < this->get_pool_min()) {
+        sout << "<pool_max> must not be less than <pool_min>" << std::endl;
+    }
+    if (this->get_admin_port() != 0) {
+        ErrorCode ec;
+        Address::from_string(this->get_admin_host(), ec);
+        if (ec) {
+            sout << "invalid <admin_host>" << std::endl;
+        }
+    }
+    if (this->get_backlog() <= 0) {
+        sout << "<backlog> must be positive" << std::endl;
+    }
+    if (this->get_pending_accepts() == 0) {
+        sout << "<accepts> must be positive" << std::endl;
+    }
+    if (this->get_overload_mode() == OverloadMode::UNKNOWN) {
+        sout << "invalid <overload>" << std::endl;
+    }
+    if (this->get_log_level() == LogLevel::UNKNOWN) {
+        sout << "invalid <log_level>" << std::endl;
+    }
+    if (this->get_stack_size() != 0 && this->get_stack_size() < StackTraits::minimum_size()) {
+        sout << "<stack_size> must be at least " << StackTraits::minimum_size() / 1024 << " KiB" << std::endl;
+    }
+#ifndef __linux__
+    if (this->get_relay_mode() == RelayMode::SPLICE) {
+        sout << "splice relay is only available on Linux" << std::endl;
     }
-    if (this->get_http_host_type() == AddressType::UNKNOWN) {
-        sout << "invalid <http_host>" << std::endl;
+    if (this->get_io_engine() == IOEngine::URING) {
+        sout << "io_uring engine is only available on Linux" << std::endl;
     }
+#endif
     auto error_string = sout.str();
     if (!error_string.empty()) {
+        error_string.pop_back();
         report_error(error_string);
         return 1;
     }
 
+    // --socks5-host is the first upstream
+    if (!this->get_socks5_host().empty()) {
+        _->upstreams.insert(std::begin(_->upstreams), {this->get_socks5_host(), this->get_socks5_port()});
+    }
+
+    // one io_service per shard, every shard accepts and serves on its own
+    for (std::size_t i = 0; i < this->get_threads(); ++i) {
+        _->loops.push_back(std::make_shared<IOLoop>(1));
+    }
+
     return 0;
 }
 
 IOLoop & Application::ioloop() const {
-    return _->loop;
+    return this->ioloop(0);
+}
+
+IOLoop & Application::ioloop(std::size_t shard) const {
+    return *_->loops.at(shard);
+}
+
+std::size_t Application::get_threads() const {
+    return _->threads;
 }
 
 uint16_t Application::get_port() const {
     return _->port;
 }
 
+uint16_t Application::get_udp_port() const {
+    return _->udp_port;
+}
+
 const std::string & Application::get_socks5_host() const {
     return _->socks5_host;
 }
@@ -124,46 +235,303 @@ uint16_t Application::get_socks5_port() const {
     return _->socks5_port;
 }
 
-uint16_t Application::get_http_port() const {
-    return _->http_port;
+const std::vector<s5p::HostAndPort> & Application::get_upstreams() const {
+    return _->upstreams;
+}
+
+BalanceMode Application::get_balance_mode() const {
+    return _->balance_mode;
+}
+
+std::size_t Application::get_health_interval() const {
+    return _->health_interval;
+}
+
+std::size_t Application::get_health_max_latency() const {
+    return _->health_max_latency;
+}
+
+TargetMode Application::get_target_mode() const {
+    return _->target_mode;
+}
+
+const Target & Application::get_http_target() const {
+    return _->http_target;
+}
+
+RelayMode Application::get_relay_mode() const {
+    return _->relay_mode;
+}
+
+IOEngine Application::get_io_engine() const {
+    return _->io_engine;
+}
+
+std::size_t Application::get_pool_min() const {
+    return _->pool_min;
+}
+
+bool Application::get_pipelined_handshake() const {
+    return _->pipelined_handshake;
+}
+
+bool Application::get_http_keep_alive() const {
+    return _->http_keep_alive;
+}
+
+std::size_t Application::get_http_cache_size() const {
+    return _->http_cache_size;
+}
+
+std::size_t Application::get_resolve_ttl() const {
+    return _->resolve_ttl;
+}
+
+std::size_t Application::get_connect_delay() const {
+    return _->connect_delay;
+}
+
+bool Application::get_stackless_relay() const {
+    return _->stackless_relay;
+}
+
+std::size_t Application::get_stack_size() const {
+    return _->stack_size;
+}
+
+std::size_t Application::get_connect_timeout() const {
+    return _->connect_timeout;
+}
+
+std::size_t Application::get_handshake_timeout() const {
+    return _->handshake_timeout;
+}
+
+std::size_t Application::get_idle_timeout() const {
+    return _->idle_timeout;
+}
+
+const std::string & Application::get_admin_host() const {
+    return _->admin_host;
+}
+
+uint16_t Application::get_admin_port() const {
+    return _->admin_port;
+}
+
+LogLevel Application::get_log_level() const {
+    return _->log_level;
+}
+
+std::size_t Application::get_log_rate() const {
+    return _->log_rate;
+}
+
+int Application::get_backlog() const {
+    return _->backlog;
+}
+
+std::size_t Application::get_pending_accepts() const {
+    return _->pending_accepts;
+}
+
+std::size_t Application::get_max_sessions() const {
+    return _->max_sessions;
+}
+
+std::size_t Application::get_max_handshakes() const {
+    return _->max_handshakes;
+}
+
+OverloadMode Application::get_overload_mode() const {
+    return _->overload_mode;
+}
+
+bool Application::get_no_delay() const {
+    return _->no_delay;
+}
+
+std::size_t Application::get_send_buffer() const {
+    return _->send_buffer;
+}
+
+std::size_t Application::get_receive_buffer() const {
+    return _->receive_buffer;
+}
+
+std::size_t Application::get_not_sent_low_water() const {
+    return _->not_sent_low_water;
+}
+
+std::size_t Application::get_keepalive() const {
+    return _->keepalive;
+}
+
+std::size_t Application::get_fast_open() const {
+    return _->fast_open;
+}
+
+// bytes per second, 0 means no limit
+std::size_t Application::get_upload_rate() const {
+    return _->upload_rate;
+}
+
+std::size_t Application::get_download_rate() const {
+    return _->download_rate;
+}
+
+std::size_t Application::get_session_upload_rate() const {
+    return _->session_upload_rate;
+}
+
+std::size_t Application::get_session_download_rate() const {
+    return _->session_download_rate;
+}
+
+std::size_t Application::get_drain_timeout() const {
+    return _->drain_timeout;
 }
 
-AddressType Application::get_http_host_type() const {
-    return _->http_host_type;
+const std::string & Application::get_handover_path() const {
+    return _->handover_path;
 }
 
-const AddressV4 & Application::get_http_host_as_ipv4() const {
-    return _->http_host_ipv4;
+// callbacks which stop accepting, they run on the main loop when draining
+// starts
+void Application::on_drain(std::function<void ()> callback) {
+    _->drain_callbacks.push_back(std::move(callback));
 }
 
-const AddressV6 & Application::get_http_host_as_ipv6() const {
-    return _->http_host_ipv6;
+// stops accepting and lets the open sessions finish, then stops the loops;
+// must run on the main loop
+void Application::drain() {
+    if (_->draining) {
+        return;
+    }
+    _->draining = true;
+    for (auto & callback : _->drain_callbacks) {
+        callback();
+    }
+    auto sessions = get_gauge(Gauge::SESSIONS_ACTIVE);
+    report_info("draining", {
+        {"sessions", std::to_string(sessions)},
+        {"timeout_s", std::to_string(_->drain_timeout)},
+    });
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(_->drain_timeout);
+    _->do_wait_sessions(std::make_shared<SteadyTimer>(this->ioloop()), deadline);
 }
 
-const std::string & Application::get_http_host_as_fqdn() const {
-    return _->http_host_fqdn;
+std::size_t Application::get_pool_max() const {
+    // zero means not set, the pool stays at its minimum size
+    if (_->pool_max > 0) {
+        return _->pool_max;
+    }
+    // reused tunnels need a pool to go back to
+    return _->http_keep_alive ? std::max<std::size_t>(_->pool_min, 16) : _->pool_min;
 }
 
 int Application::exec() {
-    namespace ph = std::placeholders;
+    auto & logger = Logger::instance();
+    logger.start(this->get_log_level(), this->get_log_rate());
+
+    // a reset peer fails a fixed write or a splice with EPIPE, which must
+    // not take the whole process down
+    std::signal(SIGPIPE, SIG_IGN);
 
-    s5p::SignalHandler signals(_->loop, SIGINT, SIGTERM);
-    signals.async_wait(std::bind(&Application::Private::on_system_signal, _, ph::_1, ph::_2));
+    // the first signal drains, a second one stops at once
+    s5p::SignalHandler signals(this->ioloop(), SIGINT, SIGTERM);
+    std::function<void (const ErrorCode &, int)> on_signal;
+    on_signal = [this, &signals, &on_signal](const ErrorCode & ec, int signal_number) -> void {
+        _->on_system_signal(ec, signal_number);
+        if (!ec) {
+            signals.async_wait(on_signal);
+        }
+    };
+    signals.async_wait(on_signal);
+
+    // SIGUSR1 prints the metrics and keeps running
+    s5p::SignalHandler dump(this->ioloop(), SIGUSR1);
+    std::function<void (const ErrorCode &, int)> on_dump;
+    on_dump = [&dump, &on_dump](const ErrorCode & ec, int) -> void {
+        if (ec) {
+            return;
+        }
+        report_metrics(std::cout);
+        dump.async_wait(on_dump);
+    };
+    dump.async_wait(on_dump);
+
+    // the first shard runs on the main thread
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < _->loops.size(); ++i) {
+        auto loop = _->loops[i];
+        workers.emplace_back([loop]() -> void {
+            loop->run();
+        });
+    }
+    this->ioloop().run();
+    for (auto & worker : workers) {
+        worker.join();
+    }
+    logger.stop();
 
-    _->loop.run();
+    report_metrics(std::cout);
     return 0;
 }
 
 Application::Private::Private(int argc, char ** argv)
-    : loop()
+    : loops()
     , argc(argc)
     , argv(argv)
+    , threads(1)
     , port(0)
+    , udp_port(0)
     , socks5_host()
     , socks5_port(0)
-    , http_port(0)
-    , http_host_type(AddressType::UNKNOWN)
-    , http_host_fqdn()
+    , upstreams()
+    , upstreams_valid(true)
+    , balance_mode(BalanceMode::ROUND_ROBIN)
+    , health_interval(5)
+    , health_max_latency(0)
+    , target_mode(TargetMode::FIXED)
+    , http_target()
+    , relay_mode(RelayMode::COPY)
+    , io_engine(IOEngine::REACTOR)
+    , pool_min(0)
+    , pool_max(0)
+    , pipelined_handshake(false)
+    , http_keep_alive(false)
+    , http_cache_size(0)
+    , resolve_ttl(60)
+    , connect_delay(250)
+    , stackless_relay(false)
+    , stack_size(0)
+    , connect_timeout(10)
+    , handshake_timeout(10)
+    , idle_timeout(300)
+    , admin_host("127.0.0.1")
+    , admin_port(0)
+    , log_level(LogLevel::INFO)
+    , log_rate(10)
+    , backlog(Acceptor::max_listen_connections)
+    , pending_accepts(4)
+    , max_sessions(0)
+    , max_handshakes(0)
+    , overload_mode(OverloadMode::RESET)
+    , no_delay(false)
+    , send_buffer(0)
+    , receive_buffer(0)
+    , not_sent_low_water(0)
+    , keepalive(0)
+    , fast_open(0)
+    , upload_rate(0)
+    , download_rate(0)
+    , session_upload_rate(0)
+    , session_download_rate(0)
+    , drain_timeout(30)
+    , handover_path()
+    , drain_callbacks()
+    , draining(false)
 {
 }
 
@@ -174,10 +542,18 @@ Options Application::Private::create_options() {
     Options od("SOCKS5 proxy");
     od.add_options()
         ("help,h", "show this message")
+        ("threads,t", po::value<std::size_t>()
+            ->value_name("<threads>")
+            ->notifier(std::bind(&Application::Private::set_threads, this, ph::_1)),
+            "number of io threads, each with its own listeners (0 means one per core, default 1)")
         ("port,p", po::value<uint16_t>()
             ->value_name("<port>")
             ->notifier(std::bind(&Application::Private::set_port, this, ph::_1)),
             "listen to the port")
+        ("udp-port", po::value<uint16_t>()
+            ->value_name("<udp_port>")
+            ->notifier(std::bind(&Application::Private::set_udp_port, this, ph::_1))
+            , "also forward the datagrams sent to this UDP port to the target, through SOCKS5 UDP ASSOCIATE (default 0, disabled)")
         ("socks5-host", po::value<std::string>()
             ->value_name("<socks5_host>")
             ->notifier(std::bind(&Application::Private::set_socks5_host, this, ph::_1))
@@ -186,14 +562,171 @@ Options Application::Private::create_options() {
             ->value_name("<socks5_port>")
             ->notifier(std::bind(&Application::Private::set_socks5_port, this, ph::_1))
             , "SOCKS5 port")
+        ("upstream", po::value<std::vector<std::string>>()
+            ->value_name("<upstream>")
+            ->composing()
+            ->notifier(std::bind(&Application::Private::set_upstreams, this, ph::_1))
+            , "additional SOCKS5 server as host:port, may be repeated")
+        ("balance", po::value<std::string>()
+            ->value_name("<balance>")
+            ->notifier(std::bind(&Application::Private::set_balance_mode, this, ph::_1))
+            , "how to choose an upstream: round-robin (default), least-active or latency")
+        ("health-interval", po::value<std::size_t>()
+            ->value_name("<seconds>")
+            ->notifier(std::bind(&Application::Private::set_health_interval, this, ph::_1))
+            , "probe every upstream this often, 0 disables probing (default 5)")
+        ("health-max-latency", po::value<std::size_t>()
+            ->value_name("<milliseconds>")
+            ->notifier(std::bind(&Application::Private::set_health_max_latency, this, ph::_1))
+            , "take upstreams slower than this out of the rotation, 0 means no limit (default 0)")
+        ("target", po::value<std::string>()
+            ->value_name("<target>")
+            ->notifier(std::bind(&Application::Private::set_target_mode, this, ph::_1))
+            , "where to connect to: fixed (default, <http_host> and <http_port>), http (CONNECT or the Host header of the first request), socks5 (the request of a SOCKS5 client) or auto (socks5 or http, told by the first byte)")
         ("http-host", po::value<std::string>()
             ->value_name("<http_host>")
             ->notifier(std::bind(&Application::Private::set_http_host, this, ph::_1))
-            , "forward to this host")
+            , "forward to this host, with the fixed <target>")
         ("http-port", po::value<uint16_t>()
             ->value_name("<http_port>")
             ->notifier(std::bind(&Application::Private::set_http_port, this, ph::_1))
-            , "forward to this port")
+            , "forward to this port, with the fixed <target>")
+        ("relay", po::value<std::string>()
+            ->value_name("<relay>")
+            ->notifier(std::bind(&Application::Private::set_relay_mode, this, ph::_1))
+            , "how to move payload between sockets: copy (default), overlap (read ahead while writing) or splice (Linux only)")
+        ("engine", po::value<std::string>()
+            ->value_name("<engine>")
+            ->notifier(std::bind(&Application::Private::set_io_engine, this, ph::_1))
+            , "how to accept and relay: reactor (default) or uring (io_uring, Linux only, replaces <relay>)")
+        ("pool-min", po::value<std::size_t>()
+            ->value_name("<pool_min>")
+            ->notifier(std::bind(&Application::Private::set_pool_min, this, ph::_1))
+            , "keep at least this many connected SOCKS5 tunnels ready per thread (default 0, disabled)")
+        ("pool-max", po::value<std::size_t>()
+            ->value_name("<pool_max>")
+            ->notifier(std::bind(&Application::Private::set_pool_max, this, ph::_1))
+            , "grow the tunnel pool up to this size under load (default <pool_min>, or 16 with --http-keep-alive)")
+        ("pipeline", po::bool_switch()
+            ->notifier(std::bind(&Application::Private::set_pipelined_handshake, this, ph::_1))
+            , "send the SOCKS5 greeting and CONNECT in one write, along with the client data already received")
+        ("http-keep-alive", po::bool_switch()
+            ->notifier(std::bind(&Application::Private::set_http_keep_alive, this, ph::_1))
+            , "follow the HTTP/1.1 messages, and when a client leaves between two requests, put its tunnel back in the pool for the next client")
+        ("http-cache", po::value<std::size_t>()
+            ->value_name("<MiB>")
+            ->notifier(std::bind(&Application::Private::set_http_cache_size, this, ph::_1))
+            , "answer repeated GET requests from a shared in-memory cache of this size, as long as the responses say they are fresh, 0 disables it (default 0)")
+        ("resolve-ttl", po::value<std::size_t>()
+            ->value_name("<seconds>")
+            ->notifier(std::bind(&Application::Private::set_resolve_ttl, this, ph::_1))
+            , "cache the resolved <socks5_host> for this long, 0 resolves for every session (default 60)")
+        ("connect-delay", po::value<std::size_t>()
+            ->value_name("<milliseconds>")
+            ->notifier(std::bind(&Application::Private::set_connect_delay, this, ph::_1))
+            , "start connecting to the next resolved address if the current one has not answered in time (default 250)")
+        ("stackless", po::bool_switch()
+            ->notifier(std::bind(&Application::Private::set_stackless_relay, this, ph::_1))
+            , "relay the copy mode with completion handlers instead of coroutines, an idle session owns no stack")
+        ("stack-size", po::value<std::size_t>()
+            ->value_name("<KiB>")
+            ->notifier(std::bind(&Application::Private::set_stack_size, this, ph::_1))
+            , "stack size of each coroutine (default 0, the Boost.Coroutine default)")
+        ("connect-timeout", po::value<std::size_t>()
+            ->value_name("<seconds>")
+            ->notifier(std::bind(&Application::Private::set_connect_timeout, this, ph::_1))
+            , "give up resolving and connecting to the SOCKS5 server after this long, 0 waits forever (default 10)")
+        ("handshake-timeout", po::value<std::size_t>()
+            ->value_name("<seconds>")
+            ->notifier(std::bind(&Application::Private::set_handshake_timeout, this, ph::_1))
+            , "give up the SOCKS5 handshake after this long, 0 waits forever (default 10)")
+        ("idle-timeout", po::value<std::size_t>()
+            ->value_name("<seconds>")
+            ->notifier(std::bind(&Application::Private::set_idle_timeout, this, ph::_1))
+            , "close a session which moved no data in either direction for this long, 0 keeps it forever (default 300)")
+        ("admin-host", po::value<std::string>()
+            ->value_name("<admin_host>")
+            ->notifier(std::bind(&Application::Private::set_admin_host, this, ph::_1))
+            , "listen for the admin HTTP endpoint on this address (default 127.0.0.1)")
+        ("admin-port", po::value<uint16_t>()
+            ->value_name("<admin_port>")
+            ->notifier(std::bind(&Application::Private::set_admin_port, this, ph::_1))
+            , "serve Prometheus metrics at http://<admin_host>:<admin_port>/metrics (default 0, disabled)")
+        ("log-level", po::value<std::string>()
+            ->value_name("<log_level>")
+            ->notifier(std::bind(&Application::Private::set_log_level, this, ph::_1))
+            , "debug, info, warning or error (default info)")
+        ("log-rate", po::value<std::size_t>()
+            ->value_name("<messages>")
+            ->notifier(std::bind(&Application::Private::set_log_rate, this, ph::_1))
+            , "log the same message at most this many times per second per thread and count the rest, 0 logs everything (default 10)")
+        ("backlog", po::value<int>()
+            ->value_name("<n>")
+            ->notifier(std::bind(&Application::Private::set_backlog, this, ph::_1))
+            , "listen backlog, capped by net.core.somaxconn (default SOMAXCONN)")
+        ("accepts", po::value<std::size_t>()
+            ->value_name("<n>")
+            ->notifier(std::bind(&Application::Private::set_pending_accepts, this, ph::_1))
+            , "accepts kept pending on every listener (default 4)")
+        ("max-sessions", po::value<std::size_t>()
+            ->value_name("<n>")
+            ->notifier(std::bind(&Application::Private::set_max_sessions, this, ph::_1))
+            , "shed new connections while this many sessions are open, 0 means no limit (default 0)")
+        ("max-handshakes", po::value<std::size_t>()
+            ->value_name("<n>")
+            ->notifier(std::bind(&Application::Private::set_max_handshakes, this, ph::_1))
+            , "shed new connections while this many sessions are still connecting upstream, 0 means no limit (default 0)")
+        ("overload", po::value<std::string>()
+            ->value_name("<overload>")
+            ->notifier(std::bind(&Application::Private::set_overload_mode, this, ph::_1))
+            , "how to shed: reset (default, accept and reset at once) or pause (stop accepting and let the backlog absorb the burst)")
+        ("nodelay", po::bool_switch()
+            ->notifier(std::bind(&Application::Private::set_no_delay, this, ph::_1))
+            , "disable Nagle's algorithm on client and upstream sockets, for interactive traffic")
+        ("sndbuf", po::value<std::size_t>()
+            ->value_name("<bytes>")
+            ->notifier(std::bind(&Application::Private::set_send_buffer, this, ph::_1))
+            , "socket send buffer size, 0 leaves it to the kernel's autotuning (default 0)")
+        ("rcvbuf", po::value<std::size_t>()
+            ->value_name("<bytes>")
+            ->notifier(std::bind(&Application::Private::set_receive_buffer, this, ph::_1))
+            , "socket receive buffer size, also set on the listeners, 0 leaves it to the kernel's autotuning (default 0)")
+        ("notsent-lowat", po::value<std::size_t>()
+            ->value_name("<bytes>")
+            ->notifier(std::bind(&Application::Private::set_not_sent_low_water, this, ph::_1))
+            , "report a socket writable only while less than this is unsent, 0 keeps the kernel default (default 0)")
+        ("keepalive", po::value<std::size_t>()
+            ->value_name("<seconds>")
+            ->notifier(std::bind(&Application::Private::set_keepalive, this, ph::_1))
+            , "send TCP keepalive probes after this long without traffic, 0 disables them (default 0)")
+        ("fastopen", po::value<std::size_t>()
+            ->value_name("<queue>")
+            ->notifier(std::bind(&Application::Private::set_fast_open, this, ph::_1))
+            , "accept TCP Fast Open with this many pending requests and use it towards the SOCKS5 server, 0 disables it (default 0)")
+        ("upload-rate", po::value<std::size_t>()
+            ->value_name("<KiB/s>")
+            ->notifier(std::bind(&Application::Private::set_upload_rate, this, ph::_1))
+            , "limit the traffic from all clients to their upstreams, 0 means no limit (default 0)")
+        ("download-rate", po::value<std::size_t>()
+            ->value_name("<KiB/s>")
+            ->notifier(std::bind(&Application::Private::set_download_rate, this, ph::_1))
+            , "limit the traffic from all upstreams back to their clients, 0 means no limit (default 0)")
+        ("session-upload-rate", po::value<std::size_t>()
+            ->value_name("<KiB/s>")
+            ->notifier(std::bind(&Application::Private::set_session_upload_rate, this, ph::_1))
+            , "limit the traffic from each client to its upstream, 0 means no limit (default 0)")
+        ("session-download-rate", po::value<std::size_t>()
+            ->value_name("<KiB/s>")
+            ->notifier(std::bind(&Application::Private::set_session_download_rate, this, ph::_1))
+            , "limit the traffic from each upstream back to its client, 0 means no limit (default 0)")
+        ("drain-timeout", po::value<std::size_t>()
+            ->value_name("<seconds>")
+            ->notifier(std::bind(&Application::Private::set_drain_timeout, this, ph::_1))
+            , "on SIGINT or SIGTERM stop accepting and let open sessions finish for this long, 0 stops at once (default 30)")
+        ("handover", po::value<std::string>()
+            ->value_name("<path>")
+            ->notifier(std::bind(&Application::Private::set_handover_path, this, ph::_1))
+            , "Unix socket for restarts: a new process given the same path takes the listening sockets over, and the old one drains")
     ;
     return std::move(od);
 }
@@ -215,13 +748,57 @@ void Application::Private::on_system_signal(const ErrorCode & ec, int signal_num
         report_error("signal", ec);
     }
     std::cout << "received " << signal_number << std::endl;
-    this->loop.stop();
+    if (this->draining || this->drain_timeout == 0) {
+        this->do_stop();
+        return;
+    }
+    Application::instance().drain();
+}
+
+void Application::Private::do_wait_sessions(std::shared_ptr<SteadyTimer> timer, std::chrono::steady_clock::time_point deadline) {
+    auto sessions = get_gauge(Gauge::SESSIONS_ACTIVE);
+    if (sessions <= 0) {
+        report_info("drained");
+        this->do_stop();
+        return;
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+        report_warning("drain timed out, closing open sessions", {
+            {"sessions", std::to_string(sessions)},
+        });
+        this->do_stop();
+        return;
+    }
+    timer->expires_after(std::chrono::milliseconds(100));
+    timer->async_wait([this, timer, deadline](const ErrorCode & ec) -> void {
+        if (ec) {
+            return;
+        }
+        this->do_wait_sessions(timer, deadline);
+    });
+}
+
+void Application::Private::do_stop() {
+    for (auto & loop : this->loops) {
+        loop->stop();
+    }
+}
+
+void Application::Private::set_threads(std::size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    this->threads = threads;
 }
 
 void Application::Private::set_port(uint16_t port) {
     this->port = port;
 }
 
+void Application::Private::set_udp_port(uint16_t port) {
+    this->udp_port = port;
+}
+
 void Application::Private::set_socks5_host(const std::string & socks5_host) {
     this->socks5_host = socks5_host;
 }
@@ -230,25 +807,236 @@ void Application::Private::set_socks5_port(uint16_t socks5_port) {
     this->socks5_port = socks5_port;
 }
 
-void Application::Private::set_http_host(const std::string & http_host) {
-    ErrorCode ec;
-    auto address = Address::from_string(http_host, ec);
-    if (ec) {
-        this->http_host_type = AddressType::FQDN;
-        this->http_host_fqdn = http_host;
-    } else if (address.is_v4()) {
-        this->http_host_type = AddressType::IPV4;
-        this->http_host_ipv4 = address.to_v4();
-    } else if (address.is_v6()) {
-        this->http_host_type = AddressType::IPV6;
-        this->http_host_ipv6 = address.to_v6();
+void Application::Private::set_upstreams(const std::vector<std::string> & upstreams) {
+    for (auto & upstream : upstreams) {
+        // the port follows the last colon, so bracketed IPv6 also works
+        auto colon = upstream.rfind(':');
+        uint16_t port = 0;
+        if (colon != std::string::npos && colon > 0) {
+            port = boost::lexical_cast<uint16_t>(upstream.substr(colon + 1));
+        }
+        if (port == 0) {
+            this->upstreams_valid = false;
+            continue;
+        }
+        auto host = upstream.substr(0, colon);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        this->upstreams.push_back({host, port});
+    }
+}
+
+void Application::Private::set_balance_mode(const std::string & mode) {
+    if (mode == "round-robin") {
+        this->balance_mode = BalanceMode::ROUND_ROBIN;
+    } else if (mode == "least-active") {
+        this->balance_mode = BalanceMode::LEAST_ACTIVE;
+    } else if (mode == "latency") {
+        this->balance_mode = BalanceMode::LATENCY;
+    } else {
+        this->balance_mode = BalanceMode::UNKNOWN;
+    }
+}
+
+void Application::Private::set_health_interval(std::size_t seconds) {
+    this->health_interval = seconds;
+}
+
+void Application::Private::set_health_max_latency(std::size_t milliseconds) {
+    this->health_max_latency = milliseconds;
+}
+
+void Application::Private::set_target_mode(const std::string & mode) {
+    if (mode == "fixed") {
+        this->target_mode = TargetMode::FIXED;
+    } else if (mode == "http") {
+        this->target_mode = TargetMode::HTTP;
+    } else if (mode == "socks5") {
+        this->target_mode = TargetMode::SOCKS5;
+    } else if (mode == "auto") {
+        this->target_mode = TargetMode::AUTO;
     } else {
-        this->http_host_type = AddressType::UNKNOWN;
+        this->target_mode = TargetMode::UNKNOWN;
     }
 }
 
+void Application::Private::set_http_host(const std::string & http_host) {
+    this->http_target = make_target(http_host, this->http_target.port);
+}
+
 void Application::Private::set_http_port(uint16_t http_port) {
-    this->http_port = http_port;
+    this->http_target.port = http_port;
+}
+
+void Application::Private::set_relay_mode(const std::string & mode) {
+    if (mode == "copy") {
+        this->relay_mode = RelayMode::COPY;
+    } else if (mode == "splice") {
+        this->relay_mode = RelayMode::SPLICE;
+    } else if (mode == "overlap") {
+        this->relay_mode = RelayMode::OVERLAP;
+    } else {
+        this->relay_mode = RelayMode::UNKNOWN;
+    }
+}
+
+void Application::Private::set_io_engine(const std::string & engine) {
+    if (engine == "reactor") {
+        this->io_engine = IOEngine::REACTOR;
+    } else if (engine == "uring") {
+        this->io_engine = IOEngine::URING;
+    } else {
+        this->io_engine = IOEngine::UNKNOWN;
+    }
+}
+
+void Application::Private::set_pool_min(std::size_t size) {
+    this->pool_min = size;
+}
+
+void Application::Private::set_pool_max(std::size_t size) {
+    this->pool_max = size;
+}
+
+void Application::Private::set_pipelined_handshake(bool pipelined) {
+    this->pipelined_handshake = pipelined;
+}
+
+void Application::Private::set_http_keep_alive(bool keep_alive) {
+    this->http_keep_alive = keep_alive;
+}
+
+void Application::Private::set_http_cache_size(std::size_t mib) {
+    this->http_cache_size = mib * 1024 * 1024;
+}
+
+void Application::Private::set_resolve_ttl(std::size_t seconds) {
+    this->resolve_ttl = seconds;
+}
+
+void Application::Private::set_connect_delay(std::size_t milliseconds) {
+    this->connect_delay = milliseconds;
+}
+
+void Application::Private::set_stackless_relay(bool stackless) {
+    this->stackless_relay = stackless;
+}
+
+void Application::Private::set_stack_size(std::size_t kib) {
+    this->stack_size = kib * 1024;
+}
+
+void Application::Private::set_connect_timeout(std::size_t seconds) {
+    this->connect_timeout = seconds;
+}
+
+void Application::Private::set_handshake_timeout(std::size_t seconds) {
+    this->handshake_timeout = seconds;
+}
+
+void Application::Private::set_idle_timeout(std::size_t seconds) {
+    this->idle_timeout = seconds;
+}
+
+void Application::Private::set_admin_host(const std::string & host) {
+    this->admin_host = host;
+}
+
+void Application::Private::set_admin_port(uint16_t port) {
+    this->admin_port = port;
+}
+
+void Application::Private::set_log_level(const std::string & level) {
+    if (level == "debug") {
+        this->log_level = LogLevel::DEBUG;
+    } else if (level == "info") {
+        this->log_level = LogLevel::INFO;
+    } else if (level == "warning") {
+        this->log_level = LogLevel::WARNING;
+    } else if (level == "error") {
+        this->log_level = LogLevel::ERROR;
+    } else {
+        this->log_level = LogLevel::UNKNOWN;
+    }
+}
+
+void Application::Private::set_log_rate(std::size_t rate) {
+    this->log_rate = rate;
+}
+
+void Application::Private::set_backlog(int backlog) {
+    this->backlog = backlog;
+}
+
+void Application::Private::set_pending_accepts(std::size_t accepts) {
+    this->pending_accepts = accepts;
+}
+
+void Application::Private::set_max_sessions(std::size_t sessions) {
+    this->max_sessions = sessions;
+}
+
+void Application::Private::set_max_handshakes(std::size_t handshakes) {
+    this->max_handshakes = handshakes;
+}
+
+void Application::Private::set_overload_mode(const std::string & mode) {
+    if (mode == "reset") {
+        this->overload_mode = OverloadMode::RESET;
+    } else if (mode == "pause") {
+        this->overload_mode = OverloadMode::PAUSE;
+    } else {
+        this->overload_mode = OverloadMode::UNKNOWN;
+    }
+}
+
+void Application::Private::set_no_delay(bool no_delay) {
+    this->no_delay = no_delay;
+}
+
+void Application::Private::set_send_buffer(std::size_t bytes) {
+    this->send_buffer = bytes;
+}
+
+void Application::Private::set_receive_buffer(std::size_t bytes) {
+    this->receive_buffer = bytes;
+}
+
+void Application::Private::set_not_sent_low_water(std::size_t bytes) {
+    this->not_sent_low_water = bytes;
+}
+
+void Application::Private::set_keepalive(std::size_t seconds) {
+    this->keepalive = seconds;
+}
+
+void Application::Private::set_fast_open(std::size_t queue) {
+    this->fast_open = queue;
+}
+
+void Application::Private::set_upload_rate(std::size_t kib) {
+    this->upload_rate = kib * 1024;
+}
+
+void Application::Private::set_download_rate(std::size_t kib) {
+    this->download_rate = kib * 1024;
+}
+
+void Application::Private::set_session_upload_rate(std::size_t kib) {
+    this->session_upload_rate = kib * 1024;
+}
+
+void Application::Private::set_session_download_rate(std::size_t kib) {
+    this->session_download_rate = kib * 1024;
+}
+
+void Application::Private::set_drain_timeout(std::size_t seconds) {
+    this->drain_timeout = seconds;
+}
+
+void Application::Private::set_handover_path(const std::string & path) {
+    this->handover_path = path;
 }
 
 
@@ -258,6 +1046,14 @@ Chunk create_chunk() {
     return std::move(Chunk());
 }
 
+boost::coroutines::attributes coroutine_attributes() {
+    auto size = Application::instance().get_stack_size();
+    if (size == 0) {
+        return boost::coroutines::attributes();
+    }
+    return boost::coroutines::attributes(size);
+}
+
 void put_big_endian(uint8_t * dst, uint16_t native) {
     uint16_t * view = reinterpret_cast<uint16_t *>(dst);
 #if !defined(__APPLE__) && !defined(_WIN32)
@@ -267,20 +1063,108 @@ void put_big_endian(uint8_t * dst, uint16_t native) {
 #endif
 }
 
-void report_error(const std::string & msg) {
-    std::cerr << msg << std::endl;
+uint16_t get_big_endian(const uint8_t * src) {
+    const uint16_t * view = reinterpret_cast<const uint16_t *>(src);
+#if !defined(__APPLE__) && !defined(_WIN32)
+    return be16toh(*view);
+#else
+    return boost::endian::big_to_native(*view);
+#endif
+}
+
+Target::Target()
+    : type(AddressType::UNKNOWN)
+    , ipv4()
+    , ipv6()
+    , fqdn()
+    , port(0)
+{
+}
+
+// an address literal or a name, which must fit in DST.ADDR
+Target make_target(const std::string & host, uint16_t port) {
+    Target target;
+    target.port = port;
+    ErrorCode ec;
+    auto address = Address::from_string(host, ec);
+    if (ec) {
+        if (!host.empty() && host.size() <= 255) {
+            target.type = AddressType::FQDN;
+            target.fqdn = host;
+        }
+    } else if (address.is_v4()) {
+        target.type = AddressType::IPV4;
+        target.ipv4 = address.to_v4();
+    } else if (address.is_v6()) {
+        target.type = AddressType::IPV6;
+        target.ipv6 = address.to_v6();
+    }
+    return target;
+}
+
+std::size_t read_chunk(YieldContext yield, Socket & socket, Chunk & chunk, ErrorCode & ec) {
+    return read_buffer(yield, socket, boost::asio::buffer(chunk), ec);
+}
+
+void write_chunk(YieldContext yield, Socket & socket, const Chunk & chunk, std::size_t length, ErrorCode & ec) {
+    write_buffer(yield, socket, boost::asio::buffer(chunk, length), ec);
+}
+
+std::size_t read_buffer(YieldContext yield, Socket & socket, const boost::asio::mutable_buffer & buffer, ErrorCode & ec) {
+    return socket.async_read_some(buffer, yield[ec]);
+}
+
+void write_buffer(YieldContext yield, Socket & socket, const boost::asio::const_buffer & buffer, ErrorCode & ec) {
+    boost::asio::async_write(socket, buffer, yield[ec]);
+}
+
+void report_error(const std::string & msg, const LogFields & fields) {
+    Logger::instance().write(LogLevel::ERROR, msg, fields);
+}
+
+void report_error(const std::string & msg, const boost::system::error_code & ec, const LogFields & fields) {
+    // rate limit before formatting, an outage must not cost more than a
+    // map lookup per message
+    auto & logger = Logger::instance();
+    std::size_t suppressed = 0;
+    if (!logger.admit(LogLevel::ERROR, msg, suppressed)) {
+        return;
+    }
+    LogFields all = fields;
+    all.emplace_back("code", boost::lexical_cast<std::string>(ec));
+    all.emplace_back("what", ec.message());
+    logger.push(LogLevel::ERROR, msg, std::move(all), suppressed);
+}
+
+void report_error(const std::string & msg, const BasicBoostError & e, const LogFields & fields) {
+    auto & logger = Logger::instance();
+    std::size_t suppressed = 0;
+    if (!logger.admit(LogLevel::ERROR, msg, suppressed)) {
+        return;
+    }
+    LogFields all = fields;
+    all.emplace_back("code", boost::lexical_cast<std::string>(e.code()));
+    all.emplace_back("what", e.what());
+    logger.push(LogLevel::ERROR, msg, std::move(all), suppressed);
 }
 
-void report_error(const std::string & msg, const boost::system::error_code & ec) {
-    std::cerr << msg << " (code: " << ec << ", what: " << ec.message() << ")" << std::endl;
+void report_error(const std::string & msg, const std::exception & e, const LogFields & fields) {
+    auto & logger = Logger::instance();
+    std::size_t suppressed = 0;
+    if (!logger.admit(LogLevel::ERROR, msg, suppressed)) {
+        return;
+    }
+    LogFields all = fields;
+    all.emplace_back("what", e.what());
+    logger.push(LogLevel::ERROR, msg, std::move(all), suppressed);
 }
 
-void report_error(const std::string & msg, const BasicBoostError & e) {
-    std::cerr << msg << " (code: " << e.code() << ", what: " << e.what() << ")" << std::endl;
+void report_warning(const std::string & msg, const LogFields & fields) {
+    Logger::instance().write(LogLevel::WARNING, msg, fields);
 }
 
-void report_error(const std::string & msg, const std::exception & e) {
-    std::cerr << msg << " (what: " << e.what() << ")" << std::endl;
+void report_info(const std::string & msg, const LogFields & fields) {
+    Logger::instance().write(LogLevel::INFO, msg, fields);
 }
 
 }
@@ -27,6 +27,11 @@
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <functional>
+#include <vector>
 
 
 namespace s5p {
@@ -39,6 +44,10 @@ typedef boost::asio::ip::tcp::acceptor Acceptor;
 typedef boost::asio::ip::tcp::endpoint EndPoint;
 typedef boost::asio::ip::tcp::socket Socket;
 typedef boost::system::error_code ErrorCode;
+typedef boost::asio::yield_context YieldContext;
+typedef boost::asio::steady_timer SteadyTimer;
+typedef std::pair<std::string, uint16_t> HostAndPort;
+typedef std::vector<std::pair<std::string, std::string>> LogFields;
 
 
 enum class AddressType : uint8_t {
@@ -49,6 +58,75 @@ enum class AddressType : uint8_t {
 };
 
 
+enum class TargetMode : uint8_t {
+    FIXED,
+    HTTP,
+    SOCKS5,
+    AUTO,
+    UNKNOWN,
+};
+
+
+enum class Socks5Command : uint8_t {
+    CONNECT,
+    UDP_ASSOCIATE,
+};
+
+
+enum class RelayMode : uint8_t {
+    COPY,
+    SPLICE,
+    OVERLAP,
+    UNKNOWN,
+};
+
+
+enum class IOEngine : uint8_t {
+    REACTOR,
+    URING,
+    UNKNOWN,
+};
+
+
+enum class OverloadMode : uint8_t {
+    RESET,
+    PAUSE,
+    UNKNOWN,
+};
+
+
+enum class BalanceMode : uint8_t {
+    ROUND_ROBIN,
+    LEAST_ACTIVE,
+    LATENCY,
+    UNKNOWN,
+};
+
+
+enum class LogLevel : uint8_t {
+    DEBUG,
+    INFO,
+    WARNING,
+    ERROR,
+    UNKNOWN,
+};
+
+
+/**
+ * Where the SOCKS5 server is asked to connect to: the HTTP target given on
+ * the command line, or the one a client asked for.
+ */
+struct Target {
+    Target();
+
+    AddressType type;
+    AddressV4 ipv4;
+    AddressV6 ipv6;
+    std::string fqdn;
+    uint16_t port;
+};
+
+
 class Application {
 public:
     static Application & instance();
@@ -58,15 +136,56 @@ public:
     int prepare();
 
     IOLoop & ioloop() const;
+    IOLoop & ioloop(std::size_t shard) const;
+    std::size_t get_threads() const;
     uint16_t get_port() const;
+    uint16_t get_udp_port() const;
     const std::string & get_socks5_host() const;
     uint16_t get_socks5_port() const;
-    const AddressV4 & get_http_host_as_ipv4() const;
-    const AddressV6 & get_http_host_as_ipv6() const;
-    const std::string & get_http_host_as_fqdn() const;
-    uint16_t get_http_port() const;
-    AddressType get_http_host_type() const;
-
+    const std::vector<HostAndPort> & get_upstreams() const;
+    BalanceMode get_balance_mode() const;
+    std::size_t get_health_interval() const;
+    std::size_t get_health_max_latency() const;
+    TargetMode get_target_mode() const;
+    const Target & get_http_target() const;
+    RelayMode get_relay_mode() const;
+    IOEngine get_io_engine() const;
+    std::size_t get_pool_min() const;
+    std::size_t get_pool_max() const;
+    bool get_pipelined_handshake() const;
+    bool get_http_keep_alive() const;
+    std::size_t get_http_cache_size() const;
+    std::size_t get_resolve_ttl() const;
+    std::size_t get_connect_delay() const;
+    bool get_stackless_relay() const;
+    std::size_t get_stack_size() const;
+    std::size_t get_connect_timeout() const;
+    std::size_t get_handshake_timeout() const;
+    std::size_t get_idle_timeout() const;
+    const std::string & get_admin_host() const;
+    uint16_t get_admin_port() const;
+    LogLevel get_log_level() const;
+    std::size_t get_log_rate() const;
+    int get_backlog() const;
+    std::size_t get_pending_accepts() const;
+    std::size_t get_max_sessions() const;
+    std::size_t get_max_handshakes() const;
+    OverloadMode get_overload_mode() const;
+    bool get_no_delay() const;
+    std::size_t get_send_buffer() const;
+    std::size_t get_receive_buffer() const;
+    std::size_t get_not_sent_low_water() const;
+    std::size_t get_keepalive() const;
+    std::size_t get_fast_open() const;
+    std::size_t get_upload_rate() const;
+    std::size_t get_download_rate() const;
+    std::size_t get_session_upload_rate() const;
+    std::size_t get_session_download_rate() const;
+    std::size_t get_drain_timeout() const;
+    const std::string & get_handover_path() const;
+
+    void on_drain(std::function<void ()> callback);
+    void drain();
     int exec();
 
 private:
@@ -81,11 +200,20 @@ private:
 
 
 Chunk create_chunk();
+boost::coroutines::attributes coroutine_attributes();
 void put_big_endian(uint8_t * dst, uint16_t native);
-void report_error(const std::string & msg);
-void report_error(const std::string & msg, const boost::system::error_code & ec);
-void report_error(const std::string & msg, const s5p::BasicBoostError & e);
-void report_error(const std::string & msg, const std::exception & e);
+uint16_t get_big_endian(const uint8_t * src);
+Target make_target(const std::string & host, uint16_t port);
+std::size_t read_chunk(YieldContext yield, Socket & socket, Chunk & chunk, ErrorCode & ec);
+void write_chunk(YieldContext yield, Socket & socket, const Chunk & chunk, std::size_t length, ErrorCode & ec);
+std::size_t read_buffer(YieldContext yield, Socket & socket, const boost::asio::mutable_buffer & buffer, ErrorCode & ec);
+void write_buffer(YieldContext yield, Socket & socket, const boost::asio::const_buffer & buffer, ErrorCode & ec);
+void report_error(const std::string & msg, const LogFields & fields = LogFields());
+void report_error(const std::string & msg, const boost::system::error_code & ec, const LogFields & fields = LogFields());
+void report_error(const std::string & msg, const s5p::BasicBoostError & e, const LogFields & fields = LogFields());
+void report_error(const std::string & msg, const std::exception & e, const LogFields & fields = LogFields());
+void report_warning(const std::string & msg, const LogFields & fields = LogFields());
+void report_info(const std::string & msg, const LogFields & fields = LogFields());
 
 }
 
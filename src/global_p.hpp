@@ -28,6 +28,8 @@
 
 #include <boost/program_options.hpp>
 
+#include <vector>
+
 
 namespace s5p {
 
@@ -42,23 +44,108 @@ public:
     Options create_options();
     OptionMap parse_options(const Options & options) const;
     void on_system_signal(const ErrorCode & ec, int signal_number);
+    void do_wait_sessions(std::shared_ptr<SteadyTimer> timer, std::chrono::steady_clock::time_point deadline);
+    void do_stop();
+    void set_threads(std::size_t threads);
     void set_port(uint16_t port);
+    void set_udp_port(uint16_t port);
     void set_socks5_host(const std::string & host);
     void set_socks5_port(uint16_t port);
+    void set_upstreams(const std::vector<std::string> & upstreams);
+    void set_balance_mode(const std::string & mode);
+    void set_health_interval(std::size_t seconds);
+    void set_health_max_latency(std::size_t milliseconds);
+    void set_target_mode(const std::string & mode);
     void set_http_host(const std::string & host);
     void set_http_port(uint16_t port);
+    void set_relay_mode(const std::string & mode);
+    void set_io_engine(const std::string & engine);
+    void set_pool_min(std::size_t size);
+    void set_pool_max(std::size_t size);
+    void set_pipelined_handshake(bool pipelined);
+    void set_http_keep_alive(bool keep_alive);
+    void set_http_cache_size(std::size_t mib);
+    void set_resolve_ttl(std::size_t seconds);
+    void set_connect_delay(std::size_t milliseconds);
+    void set_stackless_relay(bool stackless);
+    void set_stack_size(std::size_t kib);
+    void set_connect_timeout(std::size_t seconds);
+    void set_handshake_timeout(std::size_t seconds);
+    void set_idle_timeout(std::size_t seconds);
+    void set_admin_host(const std::string & host);
+    void set_admin_port(uint16_t port);
+    void set_log_level(const std::string & level);
+    void set_log_rate(std::size_t rate);
+    void set_backlog(int backlog);
+    void set_pending_accepts(std::size_t accepts);
+    void set_max_sessions(std::size_t sessions);
+    void set_max_handshakes(std::size_t handshakes);
+    void set_overload_mode(const std::string & mode);
+    void set_no_delay(bool no_delay);
+    void set_send_buffer(std::size_t bytes);
+    void set_receive_buffer(std::size_t bytes);
+    void set_not_sent_low_water(std::size_t bytes);
+    void set_keepalive(std::size_t seconds);
+    void set_fast_open(std::size_t queue);
+    void set_upload_rate(std::size_t kib);
+    void set_download_rate(std::size_t kib);
+    void set_session_upload_rate(std::size_t kib);
+    void set_session_download_rate(std::size_t kib);
+    void set_drain_timeout(std::size_t seconds);
+    void set_handover_path(const std::string & path);
 
-    IOLoop loop;
+    std::vector<std::shared_ptr<IOLoop>> loops;
     int argc;
     char ** argv;
+    std::size_t threads;
     uint16_t port;
+    uint16_t udp_port;
     std::string socks5_host;
     uint16_t socks5_port;
-    uint16_t http_port;
-    AddressType http_host_type;
-    AddressV4 http_host_ipv4;
-    AddressV6 http_host_ipv6;
-    std::string http_host_fqdn;
+    std::vector<HostAndPort> upstreams;
+    bool upstreams_valid;
+    BalanceMode balance_mode;
+    std::size_t health_interval;
+    std::size_t health_max_latency;
+    TargetMode target_mode;
+    Target http_target;
+    RelayMode relay_mode;
+    IOEngine io_engine;
+    std::size_t pool_min;
+    std::size_t pool_max;
+    bool pipelined_handshake;
+    bool http_keep_alive;
+    std::size_t http_cache_size;
+    std::size_t resolve_ttl;
+    std::size_t connect_delay;
+    bool stackless_relay;
+    std::size_t stack_size;
+    std::size_t connect_timeout;
+    std::size_t handshake_timeout;
+    std::size_t idle_timeout;
+    std::string admin_host;
+    uint16_t admin_port;
+    LogLevel log_level;
+    std::size_t log_rate;
+    int backlog;
+    std::size_t pending_accepts;
+    std::size_t max_sessions;
+    std::size_t max_handshakes;
+    OverloadMode overload_mode;
+    bool no_delay;
+    std::size_t send_buffer;
+    std::size_t receive_buffer;
+    std::size_t not_sent_low_water;
+    std::size_t keepalive;
+    std::size_t fast_open;
+    std::size_t upload_rate;
+    std::size_t download_rate;
+    std::size_t session_upload_rate;
+    std::size_t session_download_rate;
+    std::size_t drain_timeout;
+    std::string handover_path;
+    std::vector<std::function<void ()>> drain_callbacks;
+    bool draining;
 };
 
 }
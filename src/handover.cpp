@@ -0,0 +1,346 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "handover_p.hpp"
+#include "metrics.hpp"
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+
+using s5p::Handover;
+using s5p::Application;
+using s5p::ErrorCode;
+using s5p::Gauge;
+using s5p::LocalSocket;
+using s5p::SteadyTimer;
+
+
+namespace {
+
+// descriptors passed in one message, well below SCM_MAX_FD
+const std::size_t BATCH = 64;
+// the new process sends this once it can take the load
+const uint8_t READY = 'R';
+// a wedged old process must not hold the start up forever
+const time_t RECEIVE_TIMEOUT = 5;
+// how long a new process waits for its pools before taking over anyway
+const std::chrono::seconds WARM_UP_LIMIT(10);
+const std::chrono::milliseconds WARM_UP_POLL(50);
+
+void close_all(std::deque<int> & fds) {
+    for (auto fd : fds) {
+        ::close(fd);
+    }
+    fds.clear();
+}
+
+int take_front(std::deque<int> & fds) {
+    if (fds.empty()) {
+        return -1;
+    }
+    auto fd = fds.front();
+    fds.pop_front();
+    return fd;
+}
+
+}
+
+
+Handover::Handover(IOLoop & loop, const std::string & path)
+    : _(std::make_shared<Private>(loop, path))
+{
+}
+
+// blocks at start up; false means there is no running process to take over
+// from, or it failed, and this process binds its own listeners
+bool Handover::take_over() {
+    ErrorCode ec;
+    _->previous.connect(boost::asio::local::stream_protocol::endpoint(_->path), ec);
+    if (ec) {
+        // nobody serves the path, or a crashed process left it behind
+        _->previous.close(ec);
+        return false;
+    }
+    _->do_receive(ec);
+    if (ec) {
+        report_error("cannot take the listeners over", ec);
+        close_all(_->v4);
+        close_all(_->v6);
+        _->previous.close(ec);
+        return false;
+    }
+    report_info("took the listeners over", {
+        {"ipv4", std::to_string(_->v4.size())},
+        {"ipv6", std::to_string(_->v6.size())},
+    });
+    return true;
+}
+
+// the next inherited listener for a shard, -1 if there is none left
+int Handover::take_v4() {
+    return take_front(_->v4);
+}
+
+int Handover::take_v6() {
+    return take_front(_->v6);
+}
+
+// every shard has its listeners; the previous process is told to drain once
+// the pools are warm, and this one starts serving the path
+void Handover::ready(std::vector<int> listeners) {
+    // the previous process had more shards, their share of connections would
+    // wait in listeners nobody accepts from
+    if (!_->v4.empty() || !_->v6.empty()) {
+        report_warning("closing listeners of shards this process does not have", {
+            {"sockets", std::to_string(_->v4.size() + _->v6.size())},
+        });
+        close_all(_->v4);
+        close_all(_->v6);
+    }
+    _->listeners = std::move(listeners);
+    if (!_->previous.is_open()) {
+        _->do_serve();
+        return;
+    }
+    _->do_warm_up(std::make_shared<SteadyTimer>(_->loop), std::chrono::steady_clock::now() + WARM_UP_LIMIT);
+}
+
+// the path is left in place, the next process may already own it
+void Handover::stop() {
+    auto self = _;
+    boost::asio::post(_->loop, [self]() -> void {
+        ErrorCode ec;
+        self->acceptor.close(ec);
+    });
+}
+
+Handover::Private::Private(IOLoop & loop, const std::string & path)
+    : loop(loop)
+    , path(path)
+    , previous(loop)
+    , acceptor(loop)
+    , v4()
+    , v6()
+    , listeners()
+{
+}
+
+void Handover::Private::do_receive(ErrorCode & ec) {
+    auto fd = this->previous.native_handle();
+    struct timeval timeout = { RECEIVE_TIMEOUT, 0 };
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // every message carries a count and that many descriptors, an empty one
+    // ends the list
+    while (true) {
+        uint8_t count = 0;
+        struct iovec iov = { &count, sizeof(count) };
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * BATCH)];
+        struct msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        auto rv = ::recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ec.assign(errno, boost::system::system_category());
+            return;
+        }
+        if (rv == 0) {
+            ec = boost::asio::error::eof;
+            return;
+        }
+        for (auto header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            auto fds = reinterpret_cast<int *>(CMSG_DATA(header));
+            auto n = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (std::size_t i = 0; i < n; ++i) {
+                struct sockaddr_storage address;
+                socklen_t length = sizeof(address);
+                if (::getsockname(fds[i], reinterpret_cast<struct sockaddr *>(&address), &length) != 0) {
+                    ::close(fds[i]);
+                } else if (address.ss_family == AF_INET) {
+                    this->v4.push_back(fds[i]);
+                } else if (address.ss_family == AF_INET6) {
+                    this->v6.push_back(fds[i]);
+                } else {
+                    ::close(fds[i]);
+                }
+            }
+        }
+        if (message.msg_flags & MSG_CTRUNC) {
+            ec = boost::asio::error::message_size;
+            return;
+        }
+        if (count == 0) {
+            return;
+        }
+    }
+}
+
+// both processes accept meanwhile, the new one takes over once its tunnel
+// pools are full, so the first sessions after a deploy find them warm
+void Handover::Private::do_warm_up(std::shared_ptr<SteadyTimer> timer, std::chrono::steady_clock::time_point deadline) {
+    auto & application = Application::instance();
+    auto target = static_cast<int64_t>(application.get_pool_min() * application.get_threads());
+    auto idle = get_gauge(Gauge::POOL_IDLE);
+    if (idle < target && std::chrono::steady_clock::now() < deadline) {
+        auto self = this->shared_from_this();
+        timer->expires_after(WARM_UP_POLL);
+        timer->async_wait([self, timer, deadline](const ErrorCode & ec) -> void {
+            if (ec) {
+                return;
+            }
+            self->do_warm_up(timer, deadline);
+        });
+        return;
+    }
+
+    ErrorCode ec;
+    boost::asio::write(this->previous, boost::asio::buffer(&READY, sizeof(READY)), ec);
+    if (ec) {
+        report_error("cannot tell the previous process to drain", ec);
+    } else {
+        report_info("taking over, the previous process drains", {
+            {"pooled", std::to_string(idle)},
+        });
+    }
+    this->previous.close(ec);
+    this->do_serve();
+}
+
+void Handover::Private::do_serve() {
+    ErrorCode ec;
+    // the previous process still has the old file open, which is fine
+    ::unlink(this->path.c_str());
+    boost::asio::local::stream_protocol::endpoint endpoint(this->path);
+    this->acceptor.open(endpoint.protocol(), ec);
+    if (!ec) {
+        this->acceptor.bind(endpoint, ec);
+    }
+    if (!ec) {
+        this->acceptor.listen(1, ec);
+    }
+    if (ec) {
+        report_error("cannot serve the handover path, restarts will rebind", ec, {
+            {"path", this->path},
+        });
+        return;
+    }
+    this->do_accept();
+}
+
+void Handover::Private::do_accept() {
+    auto self = this->shared_from_this();
+    auto socket = std::make_shared<LocalSocket>(this->loop);
+    this->acceptor.async_accept(*socket, [self, socket](const ErrorCode & ec) -> void {
+        self->on_accepted(socket, ec);
+    });
+}
+
+// one new process at a time, the next one is accepted only if this one
+// goes away without taking over
+void Handover::Private::on_accepted(std::shared_ptr<LocalSocket> socket, const ErrorCode & ec) {
+    if (ec == boost::asio::error::operation_aborted) {
+        return;
+    }
+    if (ec) {
+        report_error("handover accept", ec);
+        this->do_accept();
+        return;
+    }
+
+    ErrorCode sent;
+    this->do_send(*socket, sent);
+    if (sent) {
+        report_error("cannot hand the listeners over", sent);
+        this->do_accept();
+        return;
+    }
+    report_info("handed the listeners over, waiting for the new process", {
+        {"sockets", std::to_string(this->listeners.size())},
+    });
+
+    auto self = this->shared_from_this();
+    auto answer = std::make_shared<uint8_t>(0);
+    boost::asio::async_read(*socket, boost::asio::buffer(answer.get(), 1), [self, socket, answer](const ErrorCode & ec, std::size_t) -> void {
+        if (ec || *answer != READY) {
+            report_warning("the new process went away, keep serving");
+            self->do_accept();
+            return;
+        }
+        ErrorCode ignored;
+        self->acceptor.close(ignored);
+        Application::instance().drain();
+    });
+}
+
+void Handover::Private::do_send(LocalSocket & socket, ErrorCode & ec) {
+    std::size_t offset = 0;
+    while (true) {
+        auto n = std::min(BATCH, this->listeners.size() - offset);
+        uint8_t count = static_cast<uint8_t>(n);
+        struct iovec iov = { &count, sizeof(count) };
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * BATCH)];
+        struct msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        if (n > 0) {
+            message.msg_control = control;
+            message.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+            auto header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int) * n);
+            std::memcpy(CMSG_DATA(header), this->listeners.data() + offset, sizeof(int) * n);
+        }
+
+        if (::sendmsg(socket.native_handle(), &message, MSG_NOSIGNAL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ec.assign(errno, boost::system::system_category());
+            return;
+        }
+        if (n == 0) {
+            return;
+        }
+        offset += n;
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_HANDOVER_HPP
+#define S5P_HANDOVER_HPP
+
+#include "global.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace s5p {
+
+/**
+ * Passes the listening sockets from a running process to its replacement.
+ *
+ * The running process serves a Unix socket. A new process connects to it at
+ * start up and receives every listener with SCM_RIGHTS, so both accept from
+ * the same sockets for a while and no connection is refused. Once its pools
+ * are warm the new process says so, and the old one drains and exits.
+ */
+class Handover {
+public:
+    Handover(IOLoop & loop, const std::string & path);
+
+    bool take_over();
+    int take_v4();
+    int take_v6();
+    void ready(std::vector<int> listeners);
+    void stop();
+
+private:
+    Handover(const Handover &);
+    Handover & operator = (const Handover &);
+    Handover(Handover &&);
+    Handover & operator = (Handover &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_HANDOVER_HPP_
+#define S5P_HANDOVER_HPP_
+
+#include "handover.hpp"
+
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include <chrono>
+#include <deque>
+
+
+namespace s5p {
+
+typedef boost::asio::local::stream_protocol::socket LocalSocket;
+typedef boost::asio::local::stream_protocol::acceptor LocalAcceptor;
+
+
+class Handover::Private : public std::enable_shared_from_this<Handover::Private> {
+public:
+    Private(IOLoop & loop, const std::string & path);
+
+    void do_receive(ErrorCode & ec);
+    void do_warm_up(std::shared_ptr<SteadyTimer> timer, std::chrono::steady_clock::time_point deadline);
+    void do_serve();
+    void do_accept();
+    void on_accepted(std::shared_ptr<LocalSocket> socket, const ErrorCode & ec);
+    void do_send(LocalSocket & socket, ErrorCode & ec);
+
+    IOLoop & loop;
+    std::string path;
+    LocalSocket previous;
+    LocalAcceptor acceptor;
+    std::deque<int> v4;
+    std::deque<int> v6;
+    std::vector<int> listeners;
+};
+
+}
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "http_cache_p.hpp"
+#include "global.hpp"
+#include "metrics.hpp"
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+
+#include <algorithm>
+#include <ctime>
+
+
+using s5p::HttpCache;
+using s5p::HttpMessage;
+using s5p::Counter;
+using s5p::Gauge;
+using s5p::SteadyClock;
+
+
+namespace {
+
+// one response may take at most this share of the cache
+const std::size_t OBJECT_SHARE = 8;
+
+// the codes a cache may keep when the response says how long it is fresh
+const int CACHEABLE[] = { 200, 203, 300, 301, 404, 410, };
+
+// never replayed, a cached response is served on its own connection
+const char * const HOP_BY_HOP[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "Content-Length", "Age",
+};
+
+template<typename F>
+void for_each_token(const std::string & value, F f) {
+    std::size_t begin = 0;
+    while (begin < value.size()) {
+        auto end = value.find(',', begin);
+        if (end == std::string::npos) {
+            end = value.size();
+        }
+        auto token = boost::algorithm::trim_copy(value.substr(begin, end - begin));
+        if (!token.empty()) {
+            f(token);
+        }
+        begin = end + 1;
+    }
+}
+
+bool parse_seconds(const std::string & text, uint64_t & seconds) {
+    if (text.empty() || text.size() > 10) {
+        return false;
+    }
+    seconds = 0;
+    for (auto c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        seconds = seconds * 10 + static_cast<uint64_t>(c - '0');
+    }
+    return true;
+}
+
+// Cache-Control: has the directive, and its value if it carries one
+bool find_directive(const std::string & cache_control, const char * name, std::string * value = nullptr) {
+    bool found = false;
+    for_each_token(cache_control, [&](const std::string & token) -> void {
+        auto equal = token.find('=');
+        auto key = boost::algorithm::trim_copy(token.substr(0, equal));
+        if (found || !boost::algorithm::iequals(key, name)) {
+            return;
+        }
+        found = true;
+        if (value && equal != std::string::npos) {
+            *value = boost::algorithm::trim_copy(token.substr(equal + 1));
+            boost::algorithm::trim_if(*value, boost::algorithm::is_any_of("\""));
+        }
+    });
+    return found;
+}
+
+bool find_seconds(const std::string & cache_control, const char * name, uint64_t & seconds) {
+    std::string value;
+    return find_directive(cache_control, name, &value) && parse_seconds(value, seconds);
+}
+
+// only the IMF-fixdate form, the others are obsolete
+bool parse_date(const std::string & text, std::time_t & time) {
+    std::tm tm = {};
+    auto end = strptime(text.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
+        return false;
+    }
+    time = timegm(&tm);
+    return true;
+}
+
+bool split_request_line(const HttpMessage & request, std::string & method, std::string & target) {
+    auto first = request.start_line.find(' ');
+    auto last = request.start_line.rfind(' ');
+    if (first == std::string::npos || last == first) {
+        return false;
+    }
+    method = request.start_line.substr(0, first);
+    target = request.start_line.substr(first + 1, last - first - 1);
+    return true;
+}
+
+// a plain GET without credentials, identified by its host and target
+bool primary_key(const HttpMessage & request, std::string & key) {
+    std::string method;
+    std::string target;
+    if (!split_request_line(request, method, target) || method != "GET") {
+        return false;
+    }
+    if (!request.header("Authorization").empty()) {
+        return false;
+    }
+    if (!request.header("Transfer-Encoding").empty()) {
+        return false;
+    }
+    auto length = request.header("Content-Length");
+    if (!length.empty() && length != "0") {
+        return false;
+    }
+    key = boost::algorithm::to_lower_copy(request.header("Host")) + " " + target;
+    return true;
+}
+
+std::string variant_key(const std::string & primary, const std::vector<std::string> & names, const HttpMessage & request) {
+    auto key = primary;
+    for (auto & name : names) {
+        key += "\n" + name + ": " + request.header(name);
+    }
+    return key;
+}
+
+int status_of(const HttpMessage & response) {
+    auto first = response.start_line.find(' ');
+    uint64_t status = 0;
+    if (first == std::string::npos || !parse_seconds(response.start_line.substr(first + 1, 3), status)) {
+        return 0;
+    }
+    return static_cast<int>(status);
+}
+
+// how long the response is fresh for, in seconds since it was generated
+bool freshness_lifetime(const HttpMessage & response, uint64_t & lifetime) {
+    auto cache_control = response.header("Cache-Control");
+    if (find_seconds(cache_control, "s-maxage", lifetime) || find_seconds(cache_control, "max-age", lifetime)) {
+        return true;
+    }
+    auto expires_text = response.header("Expires");
+    if (expires_text.empty()) {
+        return false;
+    }
+    std::time_t expires = 0;
+    if (!parse_date(expires_text, expires)) {
+        // an invalid date means already expired
+        return false;
+    }
+    std::time_t date = std::time(nullptr);
+    parse_date(response.header("Date"), date);
+    if (expires <= date) {
+        return false;
+    }
+    lifetime = static_cast<uint64_t>(expires - date);
+    return true;
+}
+
+bool is_hop_by_hop(const std::string & name, const std::string & connection) {
+    for (auto field : HOP_BY_HOP) {
+        if (boost::algorithm::iequals(name, field)) {
+            return true;
+        }
+    }
+    return find_directive(connection, name.c_str());
+}
+
+}
+
+
+HttpCache & HttpCache::instance() {
+    static HttpCache cache;
+    return cache;
+}
+
+HttpCache::HttpCache()
+    : _(std::make_shared<Private>())
+{
+}
+
+// the largest body worth capturing for store()
+std::size_t HttpCache::object_limit() const {
+    return _->capacity / OBJECT_SHARE;
+}
+
+// the complete response, if a fresh one is cached for this request
+bool HttpCache::lookup(const HttpMessage & request, std::string & response) {
+    std::string primary;
+    if (_->capacity == 0 || !primary_key(request, primary)) {
+        return false;
+    }
+    // the client insists on a fresh answer from the server
+    auto cache_control = request.header("Cache-Control");
+    uint64_t max_age = 0;
+    if (find_directive(cache_control, "no-cache") || find_directive(cache_control, "no-store")
+        || (find_seconds(cache_control, "max-age", max_age) && max_age == 0)
+        || find_directive(request.header("Pragma"), "no-cache")) {
+        count(Counter::HTTP_CACHE_MISSES);
+        return false;
+    }
+
+    auto now = SteadyClock::now();
+    std::unique_lock<std::mutex> lock(_->mutex);
+    auto variants = _->variants.find(primary);
+    if (variants == _->variants.end()) {
+        lock.unlock();
+        count(Counter::HTTP_CACHE_MISSES);
+        return false;
+    }
+    auto it = _->index.find(variant_key(primary, variants->second.names, request));
+    if (it == _->index.end() || it->second->expire_at <= now) {
+        if (it != _->index.end()) {
+            _->do_evict(it->second);
+        }
+        lock.unlock();
+        count(Counter::HTTP_CACHE_MISSES);
+        return false;
+    }
+    auto entry = it->second;
+    _->entries.splice(_->entries.begin(), _->entries, entry);
+
+    auto age = entry->age + std::chrono::duration_cast<std::chrono::seconds>(now - entry->stored_at).count();
+    response.reserve(entry->head.size() + entry->body.size() + 32);
+    response = entry->head;
+    response += "Age: " + std::to_string(age) + "\r\n\r\n";
+    response += entry->body;
+    lock.unlock();
+
+    count(Counter::HTTP_CACHE_HITS);
+    count(Counter::HTTP_CACHE_BYTES_SAVED, response.size());
+    return true;
+}
+
+// keeps the response if it may be shared and says how long it is fresh
+void HttpCache::store(const HttpMessage & request, const HttpMessage & response) {
+    std::string primary;
+    if (_->capacity == 0 || response.truncated || !primary_key(request, primary)) {
+        return;
+    }
+    if (find_directive(request.header("Cache-Control"), "no-store")) {
+        return;
+    }
+    auto status = status_of(response);
+    if (std::find(std::begin(CACHEABLE), std::end(CACHEABLE), status) == std::end(CACHEABLE)) {
+        return;
+    }
+    auto cache_control = response.header("Cache-Control");
+    if (find_directive(cache_control, "no-store") || find_directive(cache_control, "private")
+        || find_directive(cache_control, "no-cache")) {
+        return;
+    }
+    // a cookie belongs to one client
+    if (!response.header("Set-Cookie").empty()) {
+        return;
+    }
+    std::vector<std::string> names;
+    bool everything = false;
+    for_each_token(response.header("Vary"), [&names, &everything](const std::string & token) -> void {
+        everything = everything || token == "*";
+        names.push_back(boost::algorithm::to_lower_copy(token));
+    });
+    if (everything) {
+        return;
+    }
+    uint64_t lifetime = 0;
+    uint64_t age = 0;
+    parse_seconds(response.header("Age"), age);
+    if (!freshness_lifetime(response, lifetime) || lifetime <= age) {
+        return;
+    }
+
+    Private::Entry entry;
+    entry.primary = primary;
+    entry.key = variant_key(primary, names, request);
+    // a chunked body was unframed by the parser, it goes out with a length
+    auto connection = response.header("Connection");
+    entry.head = response.start_line + "\r\n";
+    for (auto & field : response.headers) {
+        if (!is_hop_by_hop(field.first, connection)) {
+            entry.head += field.first + ": " + field.second + "\r\n";
+        }
+    }
+    entry.head += "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+    entry.body = response.body;
+    entry.stored_at = SteadyClock::now();
+    entry.expire_at = entry.stored_at + std::chrono::seconds(lifetime - age);
+    entry.age = age;
+    auto size = entry.key.size() + entry.head.size() + entry.body.size();
+    if (size > this->object_limit()) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_->mutex);
+    auto it = _->index.find(entry.key);
+    if (it != _->index.end()) {
+        _->do_evict(it->second);
+    }
+    auto & variants = _->variants[primary];
+    variants.names = names;
+    ++variants.entries;
+
+    _->entries.push_front(std::move(entry));
+    _->index.emplace(_->entries.front().key, _->entries.begin());
+    _->size += size;
+    adjust(Gauge::HTTP_CACHE_ENTRIES, 1);
+    adjust(Gauge::HTTP_CACHE_BYTES, static_cast<int64_t>(size));
+    while (_->size > _->capacity) {
+        _->do_evict(std::prev(_->entries.end()));
+    }
+}
+
+HttpCache::Private::Private()
+    : mutex()
+    , capacity(Application::instance().get_http_cache_size())
+    , size(0)
+    , entries()
+    , index()
+    , variants()
+{
+}
+
+void HttpCache::Private::do_evict(EntryIterator entry) {
+    auto size = entry->key.size() + entry->head.size() + entry->body.size();
+    auto variants = this->variants.find(entry->primary);
+    if (variants != this->variants.end() && --variants->second.entries == 0) {
+        this->variants.erase(variants);
+    }
+    this->index.erase(entry->key);
+    this->entries.erase(entry);
+    this->size -= size;
+    adjust(Gauge::HTTP_CACHE_ENTRIES, -1);
+    adjust(Gauge::HTTP_CACHE_BYTES, -static_cast<int64_t>(size));
+}
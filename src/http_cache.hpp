@@ -0,0 +1,63 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_HTTP_CACHE_HPP
+#define S5P_HTTP_CACHE_HPP
+
+#include "http_parser.hpp"
+
+#include <memory>
+
+
+namespace s5p {
+
+/**
+ * Process-wide cache of the responses to GET requests for the HTTP target,
+ * bounded in bytes and evicting the least recently used entry first.
+ *
+ * Only responses with an explicit freshness lifetime are kept, as a shared
+ * cache would, and a hit is served until that lifetime runs out. Responses
+ * which Vary are kept once for every combination of the named headers.
+ */
+class HttpCache {
+public:
+    static HttpCache & instance();
+
+    HttpCache();
+
+    std::size_t object_limit() const;
+    bool lookup(const HttpMessage & request, std::string & response);
+    void store(const HttpMessage & request, const HttpMessage & response);
+
+private:
+    HttpCache(const HttpCache &);
+    HttpCache & operator = (const HttpCache &);
+    HttpCache(HttpCache &&);
+    HttpCache & operator = (HttpCache &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_HTTP_CACHE_HPP_
+#define S5P_HTTP_CACHE_HPP_
+
+#include "http_cache.hpp"
+
+#include <chrono>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+
+namespace s5p {
+
+typedef std::chrono::steady_clock SteadyClock;
+
+class HttpCache::Private {
+public:
+    struct Entry {
+        std::string key;
+        std::string primary;
+        // the status line and headers, without the final empty line
+        std::string head;
+        std::string body;
+        SteadyClock::time_point stored_at;
+        SteadyClock::time_point expire_at;
+        // seconds, as the response arrived
+        uint64_t age;
+    };
+
+    typedef std::list<Entry>::iterator EntryIterator;
+
+    // the Vary of the latest response for a URL, and how many entries it has
+    struct Variants {
+        std::vector<std::string> names;
+        std::size_t entries;
+    };
+
+    Private();
+
+    void do_evict(EntryIterator entry);
+
+    std::mutex mutex;
+    std::size_t capacity;
+    std::size_t size;
+    // the most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<std::string, EntryIterator> index;
+    std::map<std::string, Variants> variants;
+};
+
+}
+
+#endif
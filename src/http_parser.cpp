@@ -0,0 +1,469 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "http_parser.hpp"
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+
+#include <cstring>
+
+
+using s5p::HttpParser;
+using s5p::HttpMessage;
+
+
+namespace {
+
+// a longer line or header block is not worth following, the connection is
+// just not reused
+const std::size_t MAX_LINE = 16 * 1024;
+const std::size_t MAX_HEADERS = 64 * 1024;
+
+// calls f with every comma separated token of value, trimmed
+template<typename F>
+void for_each_token(const std::string & value, F f) {
+    std::size_t begin = 0;
+    while (begin <= value.size()) {
+        auto end = value.find(',', begin);
+        if (end == std::string::npos) {
+            end = value.size();
+        }
+        f(boost::algorithm::trim_copy(value.substr(begin, end - begin)));
+        begin = end + 1;
+    }
+}
+
+bool parse_decimal(const std::string & text, uint64_t & value) {
+    if (text.empty() || text.size() > 19) {
+        return false;
+    }
+    value = 0;
+    for (auto c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + static_cast<uint64_t>(c - '0');
+    }
+    return true;
+}
+
+}
+
+
+HttpMessage::HttpMessage()
+    : start_line()
+    , headers()
+    , body()
+    , truncated(false)
+{
+}
+
+// repeated fields are joined the way a list header would be
+std::string HttpMessage::header(const std::string & name) const {
+    std::string value;
+    for (auto & field : this->headers) {
+        if (!boost::algorithm::iequals(field.first, name)) {
+            continue;
+        }
+        if (!value.empty()) {
+            value += ", ";
+        }
+        value += field.second;
+    }
+    return value;
+}
+
+
+HttpParser::HttpParser(Kind kind, HttpParser * responses)
+    : kind_(kind)
+    , responses_(responses)
+    , state_(State::START_LINE)
+    , line_()
+    , header_bytes_(0)
+    , remaining_(0)
+    , content_length_(0)
+    , has_length_(false)
+    , chunked_(false)
+    , close_(false)
+    , keep_alive_(false)
+    , http10_(false)
+    , head_(false)
+    , tunnel_(false)
+    , status_(0)
+    , reusable_(true)
+    , messages_(0)
+    , expected_()
+    , capturing_(false)
+    , body_limit_(0)
+    , message_()
+    , request_()
+{
+}
+
+// keeps every message from now on, bodies up to body_limit bytes
+void HttpParser::capture(std::size_t body_limit) {
+    this->capturing_ = true;
+    this->body_limit_ = body_limit;
+}
+
+void HttpParser::feed(const uint8_t * data, std::size_t length) {
+    while (length > 0) {
+        auto used = this->feed_message(data, length);
+        data += used;
+        length -= used;
+    }
+}
+
+// stops right after the end of a message, returns how much it took
+std::size_t HttpParser::feed_message(const uint8_t * data, std::size_t length) {
+    if (this->state_ == State::OPAQUE) {
+        return length;
+    }
+    auto messages = this->messages_;
+    std::size_t total = 0;
+    while (total < length && this->state_ != State::OPAQUE && this->messages_ == messages) {
+        std::size_t used = 0;
+        if (this->state_ == State::BODY || this->state_ == State::CHUNK_DATA) {
+            used = static_cast<std::size_t>(std::min<uint64_t>(length - total, this->remaining_));
+            this->do_keep_body(data, used);
+            this->remaining_ -= used;
+            if (this->remaining_ == 0) {
+                if (this->state_ == State::BODY) {
+                    this->on_message_end();
+                } else {
+                    this->state_ = State::CHUNK_END;
+                }
+            }
+        } else {
+            used = this->do_line(data, length - total);
+        }
+        data += used;
+        total += used;
+    }
+    // the rest of an opaque stream is taken as it is
+    return this->state_ == State::OPAQUE ? length : total;
+}
+
+// the response parser learns of every request, and whether it was a HEAD
+void HttpParser::expect(bool head, const HttpMessage & request) {
+    Expectation expectation = { head, this->capturing_ ? request : HttpMessage() };
+    this->expected_.push_back(std::move(expectation));
+}
+
+// the last request was answered without asking the server
+void HttpParser::retract() {
+    this->expected_.pop_back();
+}
+
+// between two messages
+bool HttpParser::idle() const {
+    return this->state_ == State::START_LINE && this->line_.empty();
+}
+
+bool HttpParser::opaque() const {
+    return this->state_ == State::OPAQUE;
+}
+
+bool HttpParser::reusable() const {
+    return this->reusable_;
+}
+
+// every request seen so far has its complete response
+bool HttpParser::answered() const {
+    return this->expected_.empty() && this->idle();
+}
+
+// requests still waiting for their responses
+std::size_t HttpParser::pending() const {
+    return this->expected_.size();
+}
+
+// complete messages so far
+uint64_t HttpParser::messages() const {
+    return this->messages_;
+}
+
+const HttpMessage & HttpParser::message() const {
+    return this->message_;
+}
+
+const HttpMessage & HttpParser::request() const {
+    return this->request_;
+}
+
+std::size_t HttpParser::do_line(const uint8_t * data, std::size_t length) {
+    auto end = static_cast<const uint8_t *>(std::memchr(data, '\n', length));
+    auto used = end ? static_cast<std::size_t>(end - data) + 1 : length;
+    this->line_.append(reinterpret_cast<const char *>(data), end ? used - 1 : used);
+    if (this->line_.size() > MAX_LINE) {
+        this->do_fail();
+        return used;
+    }
+    if (!end) {
+        return used;
+    }
+    if (!this->line_.empty() && this->line_.back() == '\r') {
+        this->line_.pop_back();
+    }
+    this->on_line();
+    this->line_.clear();
+    return used;
+}
+
+void HttpParser::on_line() {
+    switch (this->state_) {
+    case State::START_LINE:
+        // stray empty lines between messages are allowed
+        if (!this->line_.empty()) {
+            this->on_start_line();
+        }
+        break;
+    case State::HEADERS:
+        this->header_bytes_ += this->line_.size();
+        if (this->header_bytes_ > MAX_HEADERS) {
+            this->do_fail();
+        } else if (this->line_.empty()) {
+            this->on_headers_end();
+        } else {
+            this->on_header();
+        }
+        break;
+    case State::CHUNK_SIZE:
+        this->on_chunk_size();
+        break;
+    case State::CHUNK_END:
+        if (!this->line_.empty()) {
+            this->do_fail();
+        } else {
+            this->state_ = State::CHUNK_SIZE;
+        }
+        break;
+    case State::TRAILERS:
+        if (this->line_.empty()) {
+            this->on_message_end();
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void HttpParser::on_start_line() {
+    this->header_bytes_ = 0;
+    this->content_length_ = 0;
+    this->has_length_ = false;
+    this->chunked_ = false;
+    this->close_ = false;
+    this->keep_alive_ = false;
+    this->tunnel_ = false;
+    this->status_ = 0;
+    if (this->capturing_) {
+        this->message_ = HttpMessage();
+        this->message_.start_line = this->line_;
+    }
+
+    auto first = this->line_.find(' ');
+    if (first == std::string::npos) {
+        this->do_fail();
+        return;
+    }
+    if (this->kind_ == Kind::REQUEST) {
+        auto last = this->line_.rfind(' ');
+        auto method = this->line_.substr(0, first);
+        auto version = this->line_.substr(last + 1);
+        if (last == first || !boost::algorithm::starts_with(version, "HTTP/1.")) {
+            this->do_fail();
+            return;
+        }
+        this->http10_ = version == "HTTP/1.0";
+        this->head_ = method == "HEAD";
+        this->tunnel_ = method == "CONNECT";
+    } else {
+        auto version = this->line_.substr(0, first);
+        uint64_t status = 0;
+        if (!boost::algorithm::starts_with(version, "HTTP/1.") || !parse_decimal(this->line_.substr(first + 1, 3), status)) {
+            this->do_fail();
+            return;
+        }
+        this->http10_ = version == "HTTP/1.0";
+        this->status_ = static_cast<int>(status);
+    }
+    this->state_ = State::HEADERS;
+}
+
+void HttpParser::on_header() {
+    auto colon = this->line_.find(':');
+    if (colon == std::string::npos || colon == 0) {
+        this->do_fail();
+        return;
+    }
+    auto name = this->line_.substr(0, colon);
+    auto value = boost::algorithm::trim_copy(this->line_.substr(colon + 1));
+    if (this->capturing_) {
+        this->message_.headers.emplace_back(name, value);
+    }
+
+    if (boost::algorithm::iequals(name, "Content-Length")) {
+        uint64_t length = 0;
+        // repeated lengths must agree
+        if (!parse_decimal(value, length) || (this->has_length_ && length != this->content_length_)) {
+            this->do_fail();
+            return;
+        }
+        this->content_length_ = length;
+        this->has_length_ = true;
+    } else if (boost::algorithm::iequals(name, "Transfer-Encoding")) {
+        // only a final chunked coding frames the message
+        bool chunked = false;
+        for_each_token(value, [&chunked](const std::string & token) -> void {
+            chunked = boost::algorithm::iequals(token, "chunked");
+        });
+        if (!chunked) {
+            this->do_fail();
+            return;
+        }
+        this->chunked_ = true;
+    } else if (boost::algorithm::iequals(name, "Connection")) {
+        for_each_token(value, [this](const std::string & token) -> void {
+            if (boost::algorithm::iequals(token, "close")) {
+                this->close_ = true;
+            } else if (boost::algorithm::iequals(token, "keep-alive")) {
+                this->keep_alive_ = true;
+            } else if (boost::algorithm::iequals(token, "upgrade")) {
+                this->tunnel_ = true;
+            }
+        });
+    }
+}
+
+void HttpParser::on_headers_end() {
+    if (this->close_ || (this->http10_ && !this->keep_alive_)) {
+        this->reusable_ = false;
+    }
+
+    if (this->kind_ == Kind::REQUEST) {
+        if (this->responses_) {
+            this->responses_->expect(this->head_, this->message_);
+        }
+        if (this->tunnel_) {
+            // whatever follows is not HTTP any more
+            this->do_fail();
+        } else if (this->chunked_) {
+            this->state_ = State::CHUNK_SIZE;
+        } else if (this->has_length_ && this->content_length_ > 0) {
+            this->remaining_ = this->content_length_;
+            this->state_ = State::BODY;
+        } else {
+            this->on_message_end();
+        }
+        return;
+    }
+
+    if (this->status_ == 101) {
+        this->do_fail();
+        return;
+    }
+    if (this->status_ < 200) {
+        // an interim response, the final one follows
+        this->state_ = State::START_LINE;
+        return;
+    }
+    if (this->expected_.empty()) {
+        // nobody asked for this one
+        this->do_fail();
+        return;
+    }
+    this->head_ = this->expected_.front().head;
+    if (this->capturing_) {
+        this->request_ = std::move(this->expected_.front().request);
+    }
+    this->expected_.pop_front();
+
+    if (this->head_ || this->status_ == 204 || this->status_ == 304) {
+        this->on_message_end();
+    } else if (this->chunked_) {
+        this->state_ = State::CHUNK_SIZE;
+    } else if (this->has_length_) {
+        this->remaining_ = this->content_length_;
+        if (this->remaining_ == 0) {
+            this->on_message_end();
+        } else {
+            this->state_ = State::BODY;
+        }
+    } else {
+        // the body ends when the server closes
+        this->do_fail();
+    }
+}
+
+void HttpParser::on_chunk_size() {
+    auto end = this->line_.find_first_of("; \t");
+    auto text = this->line_.substr(0, end);
+    if (text.empty() || text.size() > 15) {
+        this->do_fail();
+        return;
+    }
+    uint64_t size = 0;
+    for (auto c : text) {
+        uint64_t digit = 0;
+        if (c >= '0' && c <= '9') {
+            digit = static_cast<uint64_t>(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            digit = static_cast<uint64_t>(c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            digit = static_cast<uint64_t>(c - 'A' + 10);
+        } else {
+            this->do_fail();
+            return;
+        }
+        size = size * 16 + digit;
+    }
+    if (size == 0) {
+        this->state_ = State::TRAILERS;
+        return;
+    }
+    this->remaining_ = size;
+    this->state_ = State::CHUNK_DATA;
+}
+
+void HttpParser::on_message_end() {
+    this->state_ = State::START_LINE;
+    ++this->messages_;
+}
+
+void HttpParser::do_keep_body(const uint8_t * data, std::size_t length) {
+    if (!this->capturing_ || this->message_.truncated) {
+        return;
+    }
+    if (this->message_.body.size() + length > this->body_limit_) {
+        this->message_.truncated = true;
+        this->message_.body.clear();
+        return;
+    }
+    this->message_.body.append(reinterpret_cast<const char *>(data), length);
+}
+
+void HttpParser::do_fail() {
+    this->state_ = State::OPAQUE;
+    this->reusable_ = false;
+}
@@ -0,0 +1,148 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_HTTP_PARSER_HPP
+#define S5P_HTTP_PARSER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace s5p {
+
+/**
+ * The start line, headers and body of the last message a capturing parser
+ * has seen. A chunked body is kept without its framing.
+ */
+struct HttpMessage {
+    HttpMessage();
+
+    std::string header(const std::string & name) const;
+
+    std::string start_line;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    // the body was longer than the capture limit
+    bool truncated;
+};
+
+
+/**
+ * Follows the framing of the HTTP/1.1 messages on one direction of a
+ * connection, without keeping them.
+ *
+ * Bodies are skipped by Content-Length or chunked encoding, so the parser
+ * knows where every message ends. The connection stays reusable while every
+ * message had a known length and none asked to close. Anything it does not
+ * understand, an upgrade or a CONNECT turn the rest of the stream opaque.
+ *
+ * A capturing parser also keeps the last message, and a capturing response
+ * parser the request it answers.
+ */
+class HttpParser {
+public:
+    enum class Kind : uint8_t {
+        REQUEST,
+        RESPONSE,
+    };
+
+    // a request parser tells its responses which requests they answer
+    explicit HttpParser(Kind kind, HttpParser * responses = nullptr);
+
+    void capture(std::size_t body_limit);
+    void feed(const uint8_t * data, std::size_t length);
+    std::size_t feed_message(const uint8_t * data, std::size_t length);
+    void expect(bool head, const HttpMessage & request);
+    void retract();
+
+    bool idle() const;
+    bool opaque() const;
+    bool reusable() const;
+    bool answered() const;
+    std::size_t pending() const;
+    uint64_t messages() const;
+    const HttpMessage & message() const;
+    const HttpMessage & request() const;
+
+private:
+    enum class State : uint8_t {
+        START_LINE,
+        HEADERS,
+        BODY,
+        CHUNK_SIZE,
+        CHUNK_DATA,
+        CHUNK_END,
+        TRAILERS,
+        OPAQUE,
+    };
+
+    struct Expectation {
+        bool head;
+        HttpMessage request;
+    };
+
+    HttpParser(const HttpParser &);
+    HttpParser & operator = (const HttpParser &);
+    HttpParser(HttpParser &&);
+    HttpParser & operator = (HttpParser &&);
+
+    std::size_t do_line(const uint8_t * data, std::size_t length);
+    void on_line();
+    void on_start_line();
+    void on_header();
+    void on_headers_end();
+    void on_chunk_size();
+    void on_message_end();
+    void do_keep_body(const uint8_t * data, std::size_t length);
+    void do_fail();
+
+    Kind kind_;
+    HttpParser * responses_;
+    State state_;
+    std::string line_;
+    std::size_t header_bytes_;
+    uint64_t remaining_;
+    uint64_t content_length_;
+    bool has_length_;
+    bool chunked_;
+    bool close_;
+    bool keep_alive_;
+    bool http10_;
+    bool head_;
+    bool tunnel_;
+    int status_;
+    bool reusable_;
+    uint64_t messages_;
+    std::deque<Expectation> expected_;
+    bool capturing_;
+    std::size_t body_limit_;
+    HttpMessage message_;
+    HttpMessage request_;
+};
+
+}
+
+#endif
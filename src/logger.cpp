@@ -0,0 +1,356 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "logger_p.hpp"
+
+#include <iostream>
+#include <sstream>
+
+#include <time.h>
+
+
+using s5p::Logger;
+using s5p::LogQueue;
+using s5p::LogRecord;
+using s5p::LogLevel;
+using s5p::LogFields;
+using s5p::RateBucket;
+using s5p::RateBuckets;
+
+
+namespace {
+
+typedef std::chrono::steady_clock SteadyClock;
+
+const std::size_t QUEUE_SIZE = 4096;
+
+// the drain thread wakes up at least this often, and a message left alone
+// this long has ended its burst
+const auto TICK = std::chrono::seconds(1);
+
+const char * level_name(LogLevel level) {
+    switch (level) {
+    case LogLevel::DEBUG:
+        return "debug";
+    case LogLevel::INFO:
+        return "info";
+    case LogLevel::WARNING:
+        return "warning";
+    case LogLevel::ERROR:
+        return "error";
+    default:
+        return "unknown";
+    }
+}
+
+// logfmt, quote only when needed
+void write_value(std::ostream & out, const std::string & value) {
+    bool plain = !value.empty() && value.find_first_of(" =\"\\\n") == std::string::npos;
+    if (plain) {
+        out << value;
+        return;
+    }
+    out << '"';
+    for (auto c : value) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c == '\n') {
+            out << "\\n";
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+void write_time(std::ostream & out, std::chrono::system_clock::time_point time) {
+    using namespace std::chrono;
+    auto seconds = system_clock::to_time_t(time);
+    auto ms = duration_cast<milliseconds>(time.time_since_epoch()).count() % 1000;
+    struct tm utc;
+    ::gmtime_r(&seconds, &utc);
+    char text[32];
+    std::strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+    out << text << '.' << (ms < 100 ? (ms < 10 ? "00" : "0") : "") << ms << 'Z';
+}
+
+}
+
+
+Logger & Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger()
+    : _(std::make_shared<Private>())
+{
+}
+
+Logger::~Logger() {
+    this->stop();
+}
+
+void Logger::start(LogLevel level, std::size_t rate) {
+    _->level = level;
+    _->rate = rate;
+    if (_->running) {
+        return;
+    }
+    _->running = true;
+    _->thread = std::thread(std::bind(&Logger::Private::do_drain, _));
+}
+
+void Logger::stop() {
+    if (!_->running) {
+        return;
+    }
+    // the consumer drains what is left before it leaves
+    _->running = false;
+    _->do_wake();
+    _->thread.join();
+}
+
+bool Logger::admit(LogLevel level, const std::string & message, std::size_t & suppressed) {
+    if (level < _->level.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    suppressed = 0;
+    if (_->rate == 0) {
+        return true;
+    }
+
+    // a token bucket per message, one second worth of burst
+    auto now = SteadyClock::now();
+    auto & rate_buckets = _->do_rate_buckets();
+    std::lock_guard<std::mutex> guard(rate_buckets.lock);
+    auto & buckets = rate_buckets.buckets;
+    auto it = buckets.find(message);
+    if (it == buckets.end()) {
+        buckets.emplace(message, RateBucket{level, static_cast<double>(_->rate) - 1.0, now, 0});
+        return true;
+    }
+    auto & bucket = it->second;
+    auto elapsed = std::chrono::duration<double>(now - bucket.last).count();
+    bucket.tokens = std::min(static_cast<double>(_->rate), bucket.tokens + elapsed * _->rate);
+    bucket.last = now;
+    if (bucket.tokens < 1.0) {
+        ++bucket.suppressed;
+        return false;
+    }
+    bucket.tokens -= 1.0;
+    suppressed = bucket.suppressed;
+    bucket.suppressed = 0;
+    return true;
+}
+
+void Logger::push(LogLevel level, const std::string & message, LogFields fields, std::size_t suppressed) {
+    LogRecord record{level, std::chrono::system_clock::now(), message, std::move(fields), suppressed};
+    if (!_->running) {
+        std::ostringstream sout;
+        _->do_format(sout, record);
+        std::cerr << sout.str() << std::flush;
+        return;
+    }
+    if (!_->queue.push(std::move(record))) {
+        _->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    _->do_wake();
+}
+
+void Logger::write(LogLevel level, const std::string & message, LogFields fields) {
+    std::size_t suppressed = 0;
+    if (!this->admit(level, message, suppressed)) {
+        return;
+    }
+    this->push(level, message, std::move(fields), suppressed);
+}
+
+Logger::Private::Private()
+    : level(LogLevel::INFO)
+    , rate(0)
+    , queue(QUEUE_SIZE)
+    , running(false)
+    , dropped(0)
+    , thread()
+    , lock()
+    , wake()
+    , woken(false)
+    , rate_buckets()
+{
+}
+
+// every thread limits on its own, admitting a message takes only a lock
+// nobody but the writer ever shares
+RateBuckets & Logger::Private::do_rate_buckets() {
+    thread_local std::shared_ptr<RateBuckets> buckets;
+    if (!buckets) {
+        buckets = std::make_shared<RateBuckets>();
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->rate_buckets.push_back(buckets);
+    }
+    return *buckets;
+}
+
+void Logger::Private::do_wake() {
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->woken = true;
+    }
+    this->wake.notify_one();
+}
+
+void Logger::Private::do_drain() {
+    LogRecord record;
+    auto reported = SteadyClock::now();
+    while (true) {
+        // read the flag first, so nothing pushed before stop() is left behind
+        bool running = this->running.load();
+
+        std::ostringstream batch;
+        bool empty = true;
+        while (this->queue.pop(record)) {
+            this->do_format(batch, record);
+            empty = false;
+        }
+        auto dropped = this->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            LogRecord overflow{LogLevel::WARNING, std::chrono::system_clock::now(), "log queue is full", {
+                {"dropped", std::to_string(dropped)},
+            }, 0};
+            this->do_format(batch, overflow);
+            empty = false;
+        }
+        // once a tick, and everything that is left on the way out
+        auto now = SteadyClock::now();
+        if (!running || now - reported >= TICK) {
+            reported = now;
+            if (this->do_report_suppressed(batch, !running)) {
+                empty = false;
+            }
+        }
+
+        if (!empty) {
+            // one write and one flush per batch
+            std::cerr << batch.str() << std::flush;
+        } else if (running) {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->wake.wait_for(guard, TICK, [this]() -> bool {
+                return this->woken || !this->running;
+            });
+            this->woken = false;
+        }
+        if (!running && empty) {
+            break;
+        }
+    }
+}
+
+// nothing else reports the copies suppressed in the last burst of a message,
+// as no copy comes along to carry the count
+bool Logger::Private::do_report_suppressed(std::ostream & out, bool all) {
+    std::vector<std::shared_ptr<RateBuckets>> threads;
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        threads = this->rate_buckets;
+    }
+    auto now = SteadyClock::now();
+    bool written = false;
+    for (auto & rate_buckets : threads) {
+        std::lock_guard<std::mutex> guard(rate_buckets->lock);
+        for (auto & pair : rate_buckets->buckets) {
+            auto & bucket = pair.second;
+            if (bucket.suppressed == 0 || (!all && now - bucket.last < TICK)) {
+                continue;
+            }
+            LogRecord record{bucket.level, std::chrono::system_clock::now(), pair.first, {}, bucket.suppressed};
+            this->do_format(out, record);
+            bucket.suppressed = 0;
+            written = true;
+        }
+    }
+    return written;
+}
+
+void Logger::Private::do_format(std::ostream & out, const LogRecord & record) {
+    out << "time=";
+    write_time(out, record.time);
+    out << " level=" << level_name(record.level) << " msg=";
+    write_value(out, record.message);
+    for (auto & field : record.fields) {
+        out << ' ' << field.first << '=';
+        write_value(out, field.second);
+    }
+    if (record.suppressed > 0) {
+        out << " suppressed=" << record.suppressed;
+    }
+    out << '\n';
+}
+
+
+LogQueue::LogQueue(std::size_t capacity)
+    : cells_(new Cell[capacity])
+    , mask_(capacity - 1)
+    , head_(0)
+    , tail_(0)
+{
+    // capacity must be a power of two
+    for (std::size_t i = 0; i < capacity; ++i) {
+        this->cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool LogQueue::push(LogRecord && record) {
+    auto position = this->tail_.load(std::memory_order_relaxed);
+    while (true) {
+        auto & cell = this->cells_[position & this->mask_];
+        auto sequence = cell.sequence.load(std::memory_order_acquire);
+        auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+        if (difference == 0) {
+            // the cell is free, claim it
+            if (this->tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                cell.record = std::move(record);
+                cell.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            // the consumer has not freed it yet, the queue is full
+            return false;
+        } else {
+            position = this->tail_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool LogQueue::pop(LogRecord & record) {
+    // single consumer, nobody races us for head_
+    auto position = this->head_.load(std::memory_order_relaxed);
+    auto & cell = this->cells_[position & this->mask_];
+    auto sequence = cell.sequence.load(std::memory_order_acquire);
+    if (sequence != position + 1) {
+        return false;
+    }
+    record = std::move(cell.record);
+    this->head_.store(position + 1, std::memory_order_relaxed);
+    cell.sequence.store(position + this->mask_ + 1, std::memory_order_release);
+    return true;
+}
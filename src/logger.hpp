@@ -0,0 +1,69 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_LOGGER_HPP
+#define S5P_LOGGER_HPP
+
+#include "global.hpp"
+
+#include <memory>
+
+
+namespace s5p {
+
+/**
+ * Process-wide logger, a background thread does the writing.
+ *
+ * Producers never wait for the writer: a record goes into a bounded
+ * lock-free queue, or is dropped and counted when the queue is full, and the
+ * writer is woken up. Every message is rate limited per thread, the next copy
+ * let through carries how many were suppressed, or the writer reports them
+ * once the burst is over. Before start() and after stop() records are
+ * written synchronously.
+ */
+class Logger {
+public:
+    static Logger & instance();
+
+    Logger();
+    ~Logger();
+
+    void start(LogLevel level, std::size_t rate);
+    void stop();
+
+    bool admit(LogLevel level, const std::string & message, std::size_t & suppressed);
+    void push(LogLevel level, const std::string & message, LogFields fields, std::size_t suppressed);
+    void write(LogLevel level, const std::string & message, LogFields fields);
+
+private:
+    Logger(const Logger &);
+    Logger & operator = (const Logger &);
+    Logger(Logger &&);
+    Logger & operator = (Logger &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_LOGGER_HPP_
+#define S5P_LOGGER_HPP_
+
+#include "logger.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+namespace s5p {
+
+struct LogRecord {
+    LogLevel level;
+    std::chrono::system_clock::time_point time;
+    std::string message;
+    LogFields fields;
+    std::size_t suppressed;
+};
+
+
+struct RateBucket {
+    LogLevel level;
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+    std::size_t suppressed;
+};
+
+// the buckets of one producer thread, only the writer shares the lock when
+// it looks for bursts which have ended
+struct RateBuckets {
+    std::mutex lock;
+    std::unordered_map<std::string, RateBucket> buckets;
+};
+
+
+/**
+ * A bounded multi-producer queue, every cell carries a sequence number
+ * which tells producers and the consumer whose turn it is.
+ */
+class LogQueue {
+public:
+    explicit LogQueue(std::size_t capacity);
+
+    bool push(LogRecord && record);
+    bool pop(LogRecord & record);
+
+private:
+    LogQueue(const LogQueue &);
+    LogQueue & operator = (const LogQueue &);
+    LogQueue(LogQueue &&);
+    LogQueue & operator = (LogQueue &&);
+
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        LogRecord record;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    std::size_t mask_;
+    alignas(64) std::atomic<std::size_t> head_;
+    alignas(64) std::atomic<std::size_t> tail_;
+};
+
+
+class Logger::Private {
+public:
+    Private();
+
+    RateBuckets & do_rate_buckets();
+    void do_wake();
+    void do_drain();
+    bool do_report_suppressed(std::ostream & out, bool all);
+    void do_format(std::ostream & out, const LogRecord & record);
+
+    std::atomic<LogLevel> level;
+    std::size_t rate;
+    LogQueue queue;
+    std::atomic<bool> running;
+    std::atomic<std::size_t> dropped;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool woken;
+    std::vector<std::shared_ptr<RateBuckets>> rate_buckets;
+};
+
+}
+
+#endif
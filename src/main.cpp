@@ -21,7 +21,14 @@
  * SOFTWARE.
  */
 #include "global.hpp"
+#include "admin_server.hpp"
+#include "balancer.hpp"
+#include "handover.hpp"
 #include "server.hpp"
+#include "udp_relay.hpp"
+
+#include <memory>
+#include <vector>
 
 
 int main(int argc, char * argv[]) {
@@ -31,10 +38,70 @@ int main(int argc, char * argv[]) {
         return 0 ? code == -1 : code;
     }
 
-    s5p::Server server(app.ioloop());
+    s5p::Balancer::instance().start(app.ioloop());
+
+    std::shared_ptr<s5p::AdminServer> admin;
+    if (app.get_admin_port() != 0) {
+        admin = std::make_shared<s5p::AdminServer>(app.ioloop());
+        admin->listen(app.get_admin_host(), app.get_admin_port());
+    }
+
+    // a restart takes the listeners of the running process, if any
+    std::shared_ptr<s5p::Handover> handover;
+    if (!app.get_handover_path().empty()) {
+        handover = std::make_shared<s5p::Handover>(app.ioloop(), app.get_handover_path());
+        handover->take_over();
+    }
+
+    std::vector<std::shared_ptr<s5p::Server>> servers;
+    std::vector<int> listeners;
+    for (std::size_t i = 0; i < app.get_threads(); ++i) {
+        auto server = std::make_shared<s5p::Server>(app.ioloop(i));
+        int v4 = handover ? handover->take_v4() : -1;
+        int v6 = handover ? handover->take_v6() : -1;
+        if (v4 >= 0) {
+            server->adopt_v4(v4);
+        } else {
+            server->listen_v4(app.get_port());
+        }
+        if (v6 >= 0) {
+            server->adopt_v6(v6);
+        } else {
+            server->listen_v6(app.get_port());
+        }
+        auto fds = server->listeners();
+        listeners.insert(listeners.end(), fds.begin(), fds.end());
+        servers.push_back(server);
+    }
 
-    server.listen_v4(app.get_port());
-    server.listen_v6(app.get_port());
+    // a datagram has no session to drain, the relays stop along with the
+    // listeners
+    std::vector<std::shared_ptr<s5p::UdpRelay>> relays;
+    for (std::size_t i = 0; app.get_udp_port() != 0 && i < app.get_threads(); ++i) {
+        auto relay = std::make_shared<s5p::UdpRelay>(app.ioloop(i));
+        relay->listen_v4(app.get_udp_port());
+        relay->listen_v6(app.get_udp_port());
+        relays.push_back(relay);
+    }
+
+    app.on_drain([servers, relays]() -> void {
+        for (auto & server : servers) {
+            server->stop();
+        }
+        for (auto & relay : relays) {
+            relay->stop();
+        }
+    });
+    if (handover) {
+        // the replacement binds the admin port once this process lets go
+        app.on_drain([handover, admin]() -> void {
+            handover->stop();
+            if (admin) {
+                admin->stop();
+            }
+        });
+        handover->ready(listeners);
+    }
 
     return app.exec();
 }
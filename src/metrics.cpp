@@ -0,0 +1,356 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "metrics.hpp"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+
+
+namespace {
+
+const std::size_t COUNTERS = static_cast<std::size_t>(s5p::Counter::SIZE);
+const std::size_t GAUGES = static_cast<std::size_t>(s5p::Gauge::SIZE);
+const std::size_t HISTOGRAMS = static_cast<std::size_t>(s5p::Histogram::SIZE);
+
+// upper bounds in microseconds, the last bucket is +Inf
+const std::array<uint64_t, 16> BOUNDS = {
+    100, 250, 500,
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000,
+    10000000,
+};
+
+
+struct Descriptor {
+    // for report_metrics
+    const char * text;
+    // for report_prometheus, the same family must be adjacent
+    const char * family;
+    const char * labels;
+    const char * help;
+};
+
+const std::array<Descriptor, COUNTERS> COUNTER_DESCRIPTORS = {{
+    {"accepts", "s5p_accepts_total", "", "Accepted client connections."},
+    {"accept backoffs", "s5p_accept_backoffs_total", "", "Times accepting paused because descriptors ran out."},
+    {"shed at the session limit", "s5p_shed_total", "reason=\"sessions\"", "Connections turned away by admission control."},
+    {"shed at the handshake limit", "s5p_shed_total", "reason=\"handshakes\"", "Connections turned away by admission control."},
+    {"shed while recovering", "s5p_shed_total", "reason=\"overloaded\"", "Connections turned away by admission control."},
+    {"upstream reads delayed", "s5p_rate_limited_total", "direction=\"upstream\"", "Reads put off by a bandwidth limit."},
+    {"downstream reads delayed", "s5p_rate_limited_total", "direction=\"downstream\"", "Reads put off by a bandwidth limit."},
+    {"bytes to upstream", "s5p_relay_bytes_total", "direction=\"upstream\"", "Payload bytes relayed."},
+    {"bytes to downstream", "s5p_relay_bytes_total", "direction=\"downstream\"", "Payload bytes relayed."},
+    {"bytes copied", "s5p_relay_mode_bytes_total", "mode=\"copy\"", "Payload bytes relayed by each relay mode."},
+    {"bytes spliced", "s5p_relay_mode_bytes_total", "mode=\"splice\"", "Payload bytes relayed by each relay mode."},
+    {"bytes through io_uring", "s5p_relay_mode_bytes_total", "mode=\"uring\"", "Payload bytes relayed by each relay mode."},
+    {"datagrams to upstream", "s5p_udp_datagrams_total", "direction=\"upstream\"", "UDP datagrams relayed."},
+    {"datagrams to downstream", "s5p_udp_datagrams_total", "direction=\"downstream\"", "UDP datagrams relayed."},
+    {"datagrams dropped", "s5p_udp_dropped_total", "", "UDP datagrams dropped: truncated, malformed or without socket buffer space."},
+    {"udp syscalls", "s5p_udp_syscalls_total", "", "Batched receive and send calls made for UDP."},
+    {"resolve cache hits", "s5p_resolve_cache_total", "result=\"hit\"", "Upstream lookups by cache outcome."},
+    {"resolve cache misses", "s5p_resolve_cache_total", "result=\"miss\"", "Upstream lookups by cache outcome."},
+    {"resolve cache stale answers", "s5p_resolve_cache_total", "result=\"stale\"", "Upstream lookups by cache outcome."},
+    {"resolve cache refreshes", "s5p_resolve_refreshes_total", "", "Background refreshes of cached upstream addresses."},
+    {"tunnels reused", "s5p_tunnels_reused_total", "", "Tunnels put back in the pool after a complete HTTP exchange."},
+    {"targets from http connect", "s5p_client_targets_total", "frontend=\"connect\"", "Targets taken from the clients, by how they asked."},
+    {"targets from http host", "s5p_client_targets_total", "frontend=\"host\"", "Targets taken from the clients, by how they asked."},
+    {"targets from socks5", "s5p_client_targets_total", "frontend=\"socks5\"", "Targets taken from the clients, by how they asked."},
+    {"http cache hits", "s5p_http_cache_total", "result=\"hit\"", "Cacheable HTTP requests by cache outcome."},
+    {"http cache misses", "s5p_http_cache_total", "result=\"miss\"", "Cacheable HTTP requests by cache outcome."},
+    {"http cache bytes saved", "s5p_http_cache_saved_bytes_total", "", "Response bytes served from the HTTP cache instead of the target."},
+    {"buffers allocated", "s5p_buffers_allocated_total", "", "Relay buffers the pool had to allocate."},
+    {"io_uring submits", "s5p_ring_submits_total", "", "io_uring_enter() calls made to submit operations."},
+    {"io_uring buffer misses", "s5p_ring_buffer_misses_total", "", "Receives which found no provided buffer left."},
+    {"connect timeouts", "s5p_timeouts_total", "phase=\"connect\"", "Sessions closed by a timeout."},
+    {"handshake timeouts", "s5p_timeouts_total", "phase=\"handshake\"", "Sessions closed by a timeout."},
+    {"idle timeouts", "s5p_timeouts_total", "phase=\"idle\"", "Sessions closed by a timeout."},
+    {"resolution errors", "s5p_errors_total", "class=\"ResolutionError\"", "Errors by exception class."},
+    {"connection errors", "s5p_errors_total", "class=\"ConnectionError\"", "Errors by exception class."},
+    {"socks5 errors", "s5p_errors_total", "class=\"Socks5Error\"", "Errors by exception class."},
+    {"client request errors", "s5p_errors_total", "class=\"RequestError\"", "Errors by exception class."},
+    {"end of file errors", "s5p_errors_total", "class=\"EndOfFileError\"", "Errors by exception class."},
+}};
+
+const std::array<Descriptor, GAUGES> GAUGE_DESCRIPTORS = {{
+    {"active sessions", "s5p_sessions_active", "", "Sessions currently open."},
+    {"active handshakes", "s5p_handshakes_active", "", "Sessions still connecting to the SOCKS5 server."},
+    {"idle pooled tunnels", "s5p_pool_idle_tunnels", "", "Tunnels waiting in the pools for a session."},
+    {"http cache entries", "s5p_http_cache_entries", "", "Responses held by the HTTP cache."},
+    {"http cache bytes", "s5p_http_cache_bytes", "", "Memory held by the HTTP cache."},
+    {"udp associations", "s5p_udp_associations", "", "UDP client addresses with a SOCKS5 association."},
+    {"buffers in use", "s5p_buffers_in_use", "", "Relay buffers currently borrowed."},
+    {"buffer bytes in use", "s5p_buffer_bytes", "state=\"in_use\"", "Relay buffer memory."},
+    {"buffer bytes idle", "s5p_buffer_bytes", "state=\"idle\"", "Relay buffer memory."},
+}};
+
+const std::array<Descriptor, HISTOGRAMS> HISTOGRAM_DESCRIPTORS = {{
+    {"resolve", "s5p_phase_duration_seconds", "phase=\"resolve\"", "Latency of each session phase."},
+    {"connect", "s5p_phase_duration_seconds", "phase=\"connect\"", "Latency of each session phase."},
+    {"socks5 phase 1", "s5p_phase_duration_seconds", "phase=\"phase1\"", "Latency of each session phase."},
+    {"socks5 phase 2", "s5p_phase_duration_seconds", "phase=\"phase2\"", "Latency of each session phase."},
+    {"time to first byte", "s5p_phase_duration_seconds", "phase=\"first_byte\"", "Latency of each session phase."},
+}};
+
+
+struct HistogramSlots {
+    std::array<std::atomic<uint64_t>, BOUNDS.size() + 1> buckets;
+    std::atomic<uint64_t> sum;
+};
+
+struct HistogramSnapshot {
+    std::array<uint64_t, BOUNDS.size() + 1> buckets;
+    uint64_t sum;
+    uint64_t count;
+};
+
+struct ThreadMetrics {
+    std::array<std::atomic<uint64_t>, COUNTERS> counters;
+    std::array<std::atomic<int64_t>, GAUGES> gauges;
+    std::array<HistogramSlots, HISTOGRAMS> histograms;
+};
+
+struct Snapshot {
+    std::array<uint64_t, COUNTERS> counters;
+    std::array<int64_t, GAUGES> gauges;
+    std::array<HistogramSnapshot, HISTOGRAMS> histograms;
+};
+
+
+/**
+ * Knows the slots of every live thread, and keeps what exited threads
+ * have counted.
+ */
+class Registry {
+public:
+    Registry();
+
+    void attach(ThreadMetrics * metrics);
+    void detach(ThreadMetrics * metrics);
+    Snapshot snapshot();
+
+private:
+    std::mutex lock_;
+    std::set<ThreadMetrics *> threads_;
+    Snapshot retired_;
+};
+
+Registry & registry() {
+    static Registry registry;
+    return registry;
+}
+
+
+class ThreadSlots {
+public:
+    ThreadSlots();
+    ~ThreadSlots();
+
+    ThreadMetrics metrics;
+};
+
+ThreadMetrics & local() {
+    thread_local ThreadSlots slots;
+    return slots.metrics;
+}
+
+
+// only the owner thread writes, a relaxed load and store is enough and
+// avoids a locked read-modify-write
+template<typename T>
+void add(std::atomic<T> & slot, T value) {
+    slot.store(slot.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void accumulate(Snapshot & snapshot, const ThreadMetrics & metrics) {
+    for (std::size_t i = 0; i < COUNTERS; ++i) {
+        snapshot.counters[i] += metrics.counters[i].load(std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < GAUGES; ++i) {
+        snapshot.gauges[i] += metrics.gauges[i].load(std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < HISTOGRAMS; ++i) {
+        auto & from = metrics.histograms[i];
+        auto & to = snapshot.histograms[i];
+        for (std::size_t j = 0; j < to.buckets.size(); ++j) {
+            auto value = from.buckets[j].load(std::memory_order_relaxed);
+            to.buckets[j] += value;
+            to.count += value;
+        }
+        to.sum += from.sum.load(std::memory_order_relaxed);
+    }
+}
+
+void write_sample(std::ostream & out, const std::string & family, const char * suffix,
+                  const std::string & labels, double value) {
+    out << family << suffix;
+    if (!labels.empty()) {
+        out << "{" << labels << "}";
+    }
+    out << " " << value << "\n";
+}
+
+template<std::size_t N>
+void write_header(std::ostream & out, const std::array<Descriptor, N> & descriptors,
+                  std::size_t index, const char * type) {
+    auto & descriptor = descriptors[index];
+    if (index > 0 && std::string(descriptors[index - 1].family) == descriptor.family) {
+        return;
+    }
+    out << "# HELP " << descriptor.family << " " << descriptor.help << "\n";
+    out << "# TYPE " << descriptor.family << " " << type << "\n";
+}
+
+}
+
+
+namespace s5p {
+
+void count(Counter counter, uint64_t value) {
+    add(local().counters[static_cast<std::size_t>(counter)], value);
+}
+
+uint64_t get_count(Counter counter) {
+    return registry().snapshot().counters[static_cast<std::size_t>(counter)];
+}
+
+void adjust(Gauge gauge, int64_t delta) {
+    add(local().gauges[static_cast<std::size_t>(gauge)], delta);
+}
+
+int64_t get_gauge(Gauge gauge) {
+    return registry().snapshot().gauges[static_cast<std::size_t>(gauge)];
+}
+
+void observe(Histogram histogram, std::chrono::steady_clock::duration elapsed) {
+    auto us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    std::size_t bucket = 0;
+    while (bucket < BOUNDS.size() && us > BOUNDS[bucket]) {
+        ++bucket;
+    }
+    auto & slots = local().histograms[static_cast<std::size_t>(histogram)];
+    add(slots.buckets[bucket], uint64_t(1));
+    add(slots.sum, us);
+}
+
+void report_metrics(std::ostream & out) {
+    auto snapshot = registry().snapshot();
+    for (std::size_t i = 0; i < COUNTERS; ++i) {
+        if (snapshot.counters[i] > 0) {
+            out << COUNTER_DESCRIPTORS[i].text << ": " << snapshot.counters[i] << std::endl;
+        }
+    }
+    auto hits = snapshot.counters[static_cast<std::size_t>(s5p::Counter::HTTP_CACHE_HITS)];
+    auto misses = snapshot.counters[static_cast<std::size_t>(s5p::Counter::HTTP_CACHE_MISSES)];
+    if (hits + misses > 0) {
+        out << "http cache hit ratio: " << static_cast<double>(hits) / (hits + misses) << std::endl;
+    }
+    for (std::size_t i = 0; i < GAUGES; ++i) {
+        out << GAUGE_DESCRIPTORS[i].text << ": " << snapshot.gauges[i] << std::endl;
+    }
+    for (std::size_t i = 0; i < HISTOGRAMS; ++i) {
+        auto & histogram = snapshot.histograms[i];
+        if (histogram.count > 0) {
+            out << HISTOGRAM_DESCRIPTORS[i].text << " latency: " << histogram.count << " samples, mean "
+                << static_cast<double>(histogram.sum) / histogram.count / 1000.0 << " ms" << std::endl;
+        }
+    }
+}
+
+void report_prometheus(std::ostream & out) {
+    auto snapshot = registry().snapshot();
+    for (std::size_t i = 0; i < COUNTERS; ++i) {
+        write_header(out, COUNTER_DESCRIPTORS, i, "counter");
+        auto & descriptor = COUNTER_DESCRIPTORS[i];
+        write_sample(out, descriptor.family, "", descriptor.labels, static_cast<double>(snapshot.counters[i]));
+    }
+    for (std::size_t i = 0; i < GAUGES; ++i) {
+        write_header(out, GAUGE_DESCRIPTORS, i, "gauge");
+        auto & descriptor = GAUGE_DESCRIPTORS[i];
+        write_sample(out, descriptor.family, "", descriptor.labels, static_cast<double>(snapshot.gauges[i]));
+    }
+    for (std::size_t i = 0; i < HISTOGRAMS; ++i) {
+        write_header(out, HISTOGRAM_DESCRIPTORS, i, "histogram");
+        auto & descriptor = HISTOGRAM_DESCRIPTORS[i];
+        auto & histogram = snapshot.histograms[i];
+        std::string labels = descriptor.labels;
+        std::string separator = labels.empty() ? "" : ",";
+
+        uint64_t cumulative = 0;
+        for (std::size_t j = 0; j < BOUNDS.size(); ++j) {
+            cumulative += histogram.buckets[j];
+            std::ostringstream le;
+            le << static_cast<double>(BOUNDS[j]) / 1000000.0;
+            write_sample(out, descriptor.family, "_bucket", labels + separator + "le=\"" + le.str() + "\"", static_cast<double>(cumulative));
+        }
+        write_sample(out, descriptor.family, "_bucket", labels + separator + "le=\"+Inf\"", static_cast<double>(histogram.count));
+        write_sample(out, descriptor.family, "_sum", labels, static_cast<double>(histogram.sum) / 1000000.0);
+        write_sample(out, descriptor.family, "_count", labels, static_cast<double>(histogram.count));
+    }
+}
+
+}
+
+
+Registry::Registry()
+    : lock_()
+    , threads_()
+    , retired_()
+{
+}
+
+void Registry::attach(ThreadMetrics * metrics) {
+    std::lock_guard<std::mutex> lock(this->lock_);
+    this->threads_.insert(metrics);
+}
+
+void Registry::detach(ThreadMetrics * metrics) {
+    std::lock_guard<std::mutex> lock(this->lock_);
+    accumulate(this->retired_, *metrics);
+    this->threads_.erase(metrics);
+}
+
+Snapshot Registry::snapshot() {
+    std::lock_guard<std::mutex> lock(this->lock_);
+    auto snapshot = this->retired_;
+    for (auto metrics : this->threads_) {
+        accumulate(snapshot, *metrics);
+    }
+    return snapshot;
+}
+
+
+ThreadSlots::ThreadSlots()
+    : metrics()
+{
+    registry().attach(&this->metrics);
+}
+
+ThreadSlots::~ThreadSlots() {
+    registry().detach(&this->metrics);
+}
@@ -0,0 +1,111 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_METRICS_HPP
+#define S5P_METRICS_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+
+namespace s5p {
+
+enum class Counter : std::size_t {
+    ACCEPTS,
+    ACCEPT_BACKOFFS,
+    SHED_SESSIONS,
+    SHED_HANDSHAKES,
+    SHED_OVERLOADED,
+    STALLS_UPSTREAM,
+    STALLS_DOWNSTREAM,
+    BYTES_UPSTREAM,
+    BYTES_DOWNSTREAM,
+    BYTES_COPIED,
+    BYTES_SPLICED,
+    BYTES_RING,
+    UDP_DATAGRAMS_UPSTREAM,
+    UDP_DATAGRAMS_DOWNSTREAM,
+    UDP_DROPS,
+    UDP_SYSCALLS,
+    RESOLVE_HITS,
+    RESOLVE_MISSES,
+    RESOLVE_STALE,
+    RESOLVE_REFRESHES,
+    TUNNELS_REUSED,
+    TARGETS_CONNECT,
+    TARGETS_HOST,
+    TARGETS_SOCKS5,
+    HTTP_CACHE_HITS,
+    HTTP_CACHE_MISSES,
+    HTTP_CACHE_BYTES_SAVED,
+    BUFFERS_ALLOCATED,
+    RING_SUBMITS,
+    RING_BUFFER_MISSES,
+    TIMEOUTS_CONNECT,
+    TIMEOUTS_HANDSHAKE,
+    TIMEOUTS_IDLE,
+    ERRORS_RESOLUTION,
+    ERRORS_CONNECTION,
+    ERRORS_SOCKS5,
+    ERRORS_REQUEST,
+    ERRORS_END_OF_FILE,
+    SIZE,
+};
+
+enum class Gauge : std::size_t {
+    SESSIONS_ACTIVE,
+    HANDSHAKES_ACTIVE,
+    POOL_IDLE,
+    HTTP_CACHE_ENTRIES,
+    HTTP_CACHE_BYTES,
+    UDP_ASSOCIATIONS,
+    BUFFERS_IN_USE,
+    BUFFER_BYTES_IN_USE,
+    BUFFER_BYTES_IDLE,
+    SIZE,
+};
+
+enum class Histogram : std::size_t {
+    RESOLVE,
+    CONNECT,
+    PHASE1,
+    PHASE2,
+    FIRST_BYTE,
+    SIZE,
+};
+
+
+// every thread writes its own slots, so these cost a plain add; readers
+// sum over all threads
+void count(Counter counter, uint64_t value = 1);
+uint64_t get_count(Counter counter);
+void adjust(Gauge gauge, int64_t delta);
+int64_t get_gauge(Gauge gauge);
+void observe(Histogram histogram, std::chrono::steady_clock::duration elapsed);
+void report_metrics(std::ostream & out);
+void report_prometheus(std::ostream & out);
+
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "pipe.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+
+
+using s5p::Pipe;
+
+
+Pipe::Pipe()
+    : fds_{-1, -1}
+    , capacity_(0)
+{
+}
+
+Pipe::~Pipe() {
+#ifdef __linux__
+    for (auto fd : this->fds_) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+#endif
+}
+
+bool Pipe::open(ErrorCode & ec) {
+#ifdef __linux__
+    if (::pipe2(this->fds_, O_NONBLOCK | O_CLOEXEC) != 0) {
+        ec.assign(errno, boost::system::system_category());
+        return false;
+    }
+    auto size = ::fcntl(this->fds_[1], F_GETPIPE_SZ);
+    this->capacity_ = size > 0 ? static_cast<std::size_t>(size) : 4096;
+    ec.clear();
+    return true;
+#else
+    ec = boost::asio::error::operation_not_supported;
+    return false;
+#endif
+}
+
+int Pipe::read_end() const {
+    return this->fds_[0];
+}
+
+int Pipe::write_end() const {
+    return this->fds_[1];
+}
+
+std::size_t Pipe::capacity() const {
+    return this->capacity_;
+}
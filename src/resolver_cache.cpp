@@ -0,0 +1,252 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "resolver_cache_p.hpp"
+
+#include "exception.hpp"
+#include "metrics.hpp"
+
+#include <boost/lexical_cast.hpp>
+
+
+namespace {
+
+std::string make_key(const std::string & host, uint16_t port) {
+    return host + ":" + boost::lexical_cast<std::string>(port);
+}
+
+}
+
+
+using s5p::ResolverCache;
+using s5p::EndPointList;
+using s5p::YieldContext;
+using s5p::IOLoop;
+using s5p::Counter;
+
+
+ResolverCache & ResolverCache::instance() {
+    static ResolverCache cache;
+    return cache;
+}
+
+ResolverCache::ResolverCache()
+    : _(std::make_shared<ResolverCache::Private>())
+{
+}
+
+EndPointList ResolverCache::resolve(YieldContext yield, IOLoop & loop, const std::string & host, uint16_t port) {
+    namespace ph = std::placeholders;
+
+    auto ttl = Application::instance().get_resolve_ttl();
+    if (ttl == 0) {
+        return _->do_resolve(yield, loop, host, port);
+    }
+
+    auto key = make_key(host, port);
+    auto now = SteadyClock::now();
+    std::shared_ptr<SteadyTimer> waiter;
+    bool refresh = false;
+    EndPointList stale;
+    {
+        std::lock_guard<std::mutex> lock(_->mutex);
+        auto & entry = _->entries[key];
+        if (!entry.endpoints.empty()) {
+            entry.used = true;
+            if (now < entry.expire_at) {
+                count(Counter::RESOLVE_HITS);
+                return entry.endpoints;
+            }
+            // the refresh failed so far, or stopped since nobody asked
+            count(Counter::RESOLVE_STALE);
+            refresh = !entry.refreshing;
+            entry.refreshing = true;
+            if (refresh) {
+                entry.refresh_at = now;
+            }
+            stale = entry.endpoints;
+        } else if (entry.resolving) {
+            count(Counter::RESOLVE_MISSES);
+            waiter = std::make_shared<SteadyTimer>(loop);
+            waiter->expires_at(SteadyTimer::time_point::max());
+            entry.waiters.push_back(waiter);
+        } else {
+            count(Counter::RESOLVE_MISSES);
+            entry.resolving = true;
+        }
+    }
+
+    // the refresh may start right here, it must not find the mutex held
+    if (!stale.empty()) {
+        if (refresh) {
+            boost::asio::spawn(loop, std::bind(&ResolverCache::Private::do_refresh, _, ph::_1, std::ref(loop), host, port), coroutine_attributes());
+        }
+        return stale;
+    }
+
+    // the lookup in flight cancels the timer when it is done
+    if (waiter) {
+        ErrorCode ec;
+        waiter->async_wait(yield[ec]);
+        std::lock_guard<std::mutex> lock(_->mutex);
+        auto & entry = _->entries[key];
+        if (entry.endpoints.empty()) {
+            throw ResolutionError(boost::system::system_error(entry.error));
+        }
+        return entry.endpoints;
+    }
+
+    try {
+        auto endpoints = _->do_resolve(yield, loop, host, port);
+        _->do_store(loop, host, port, endpoints);
+        return endpoints;
+    } catch (ResolutionError & e) {
+        _->do_fail(key, e.code());
+        throw;
+    }
+}
+
+ResolverCache::Private::Entry::Entry()
+    : endpoints()
+    , refresh_at()
+    , expire_at()
+    , resolving(false)
+    , used(false)
+    , refreshing(false)
+    , error()
+    , waiters()
+{
+}
+
+ResolverCache::Private::Private()
+    : enable_shared_from_this()
+    , mutex()
+    , entries()
+{
+}
+
+EndPointList ResolverCache::Private::do_resolve(YieldContext yield, IOLoop & loop, const std::string & host, uint16_t port) {
+    Resolver resolver(loop);
+
+    try {
+        auto results = resolver.async_resolve(host, boost::lexical_cast<std::string>(port), yield);
+        EndPointList endpoints;
+        for (auto & result : results) {
+            endpoints.push_back(result.endpoint());
+        }
+        return endpoints;
+    } catch (boost::system::system_error & e) {
+        throw ResolutionError(std::move(e));
+    }
+
+    return {};
+}
+
+// the first store starts the refresh of the entry on the loop that made it
+void ResolverCache::Private::do_store(IOLoop & loop, const std::string & host, uint16_t port, const EndPointList & endpoints) {
+    namespace ph = std::placeholders;
+
+    auto ttl = std::chrono::seconds(Application::instance().get_resolve_ttl());
+    auto now = SteadyClock::now();
+    std::vector<std::shared_ptr<SteadyTimer>> waiters;
+    bool refresh = false;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto & entry = this->entries[make_key(host, port)];
+        entry.endpoints = endpoints;
+        entry.refresh_at = now + ttl * 3 / 4;
+        entry.expire_at = now + ttl;
+        entry.resolving = false;
+        entry.used = false;
+        entry.error.clear();
+        waiters.swap(entry.waiters);
+        refresh = !entry.refreshing;
+        entry.refreshing = true;
+    }
+    this->do_wake(std::move(waiters));
+    if (refresh) {
+        boost::asio::spawn(loop, std::bind(&ResolverCache::Private::do_refresh, this->shared_from_this(), ph::_1, std::ref(loop), host, port), coroutine_attributes());
+    }
+}
+
+void ResolverCache::Private::do_fail(const std::string & key, const ErrorCode & ec) {
+    std::vector<std::shared_ptr<SteadyTimer>> waiters;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto & entry = this->entries[key];
+        entry.resolving = false;
+        entry.error = ec;
+        waiters.swap(entry.waiters);
+    }
+    this->do_wake(std::move(waiters));
+}
+
+// a waiter may sit on another loop, its timer is only touched from there
+void ResolverCache::Private::do_wake(std::vector<std::shared_ptr<SteadyTimer>> waiters) {
+    for (auto & waiter : waiters) {
+        boost::asio::post(waiter->get_executor(), [waiter]() -> void {
+            waiter->cancel();
+        });
+    }
+}
+
+// renews the entry before it expires for as long as lookups use it, and
+// retries a failed refresh at a quarter of the TTL meanwhile
+void ResolverCache::Private::do_refresh(YieldContext yield, IOLoop & loop, const std::string & host, uint16_t port) {
+    auto key = make_key(host, port);
+    auto ttl = std::chrono::seconds(Application::instance().get_resolve_ttl());
+    SteadyTimer timer(loop);
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            timer.expires_at(this->entries[key].refresh_at);
+        }
+        ErrorCode ec;
+        timer.async_wait(yield[ec]);
+        if (ec) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto & entry = this->entries[key];
+            if (!entry.used) {
+                // an expired entry starts it again once somebody asks
+                entry.refreshing = false;
+                return;
+            }
+            entry.resolving = true;
+        }
+
+        count(Counter::RESOLVE_REFRESHES);
+        try {
+            auto endpoints = this->do_resolve(yield, loop, host, port);
+            this->do_store(loop, host, port, endpoints);
+        } catch (ResolutionError & e) {
+            // keep serving the current entry, even once it has expired
+            report_error("cannot refresh the domain", e);
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto & entry = this->entries[key];
+            entry.resolving = false;
+            entry.refresh_at = SteadyClock::now() + ttl / 4;
+        }
+    }
+}
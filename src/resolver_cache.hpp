@@ -0,0 +1,65 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_RESOLVER_CACHE_HPP
+#define S5P_RESOLVER_CACHE_HPP
+
+#include "global.hpp"
+
+#include <memory>
+#include <vector>
+
+
+namespace s5p {
+
+typedef std::vector<EndPoint> EndPointList;
+
+
+/**
+ * Process-wide cache of resolved upstream addresses.
+ *
+ * Concurrent misses on one name share a single lookup. Every entry has a
+ * refresh running in the background on the loop that first resolved it,
+ * which renews the entry shortly before it expires as long as it is used,
+ * and an expired entry is still served while a refresh is under way.
+ */
+class ResolverCache {
+public:
+    static ResolverCache & instance();
+
+    ResolverCache();
+
+    EndPointList resolve(YieldContext yield, IOLoop & loop, const std::string & host, uint16_t port);
+
+private:
+    ResolverCache(const ResolverCache &);
+    ResolverCache & operator = (const ResolverCache &);
+    ResolverCache(ResolverCache &&);
+    ResolverCache & operator = (ResolverCache &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_RESOLVER_CACHE_HPP_
+#define S5P_RESOLVER_CACHE_HPP_
+
+#include "resolver_cache.hpp"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+
+namespace s5p {
+
+typedef boost::asio::ip::tcp::resolver Resolver;
+typedef std::chrono::steady_clock SteadyClock;
+
+class ResolverCache::Private : public std::enable_shared_from_this<ResolverCache::Private> {
+public:
+    struct Entry {
+        Entry();
+
+        EndPointList endpoints;
+        SteadyClock::time_point refresh_at;
+        SteadyClock::time_point expire_at;
+        // a lookup is in flight, a miss waits for it instead of starting one
+        bool resolving;
+        // looked up since the last store, nobody refreshes an unused entry
+        bool used;
+        bool refreshing;
+        ErrorCode error;
+        std::vector<std::shared_ptr<SteadyTimer>> waiters;
+    };
+
+    Private();
+
+    EndPointList do_resolve(YieldContext yield, IOLoop & loop, const std::string & host, uint16_t port);
+    void do_store(IOLoop & loop, const std::string & host, uint16_t port, const EndPointList & endpoints);
+    void do_fail(const std::string & key, const ErrorCode & ec);
+    void do_wake(std::vector<std::shared_ptr<SteadyTimer>> waiters);
+    void do_refresh(YieldContext yield, IOLoop & loop, const std::string & host, uint16_t port);
+
+    std::mutex mutex;
+    std::map<std::string, Entry> entries;
+};
+}
+
+#endif
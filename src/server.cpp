@@ -23,11 +23,66 @@
 #include "server_p.hpp"
 
 #include "session.hpp"
+#include "admission.hpp"
+#include "metrics.hpp"
+#include "socket_options.hpp"
 
 #include <boost/asio/ip/v6_only.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/detail/socket_option.hpp>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+namespace {
+
+#ifdef SO_REUSEPORT
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> ReusePort;
+#endif
+
+// accepts taken right away when one completes, before waiting again
+const std::size_t ACCEPT_BURST = 64;
+const std::chrono::milliseconds MIN_BACKOFF(10);
+const std::chrono::milliseconds MAX_BACKOFF(1000);
+// how often a paused listener checks whether the load went down
+const std::chrono::milliseconds PAUSE_POLL(10);
+
+bool is_exhausted(const s5p::ErrorCode & ec) {
+    return ec == boost::asio::error::no_descriptors
+        || ec == boost::system::errc::too_many_files_open_in_system
+        || ec == boost::asio::error::no_buffer_space
+        || ec == boost::asio::error::no_memory;
+}
+
+int open_reserve() {
+    return ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+// every shard binds its own acceptor to the same port, so the kernel spreads
+// incoming connections across them; with a handover a restart may run more
+// shards than the listeners it inherits, and those bind next to them
+void set_reuse_port(s5p::Acceptor & acceptor) {
+#ifdef SO_REUSEPORT
+    auto & app = s5p::Application::instance();
+    if (app.get_threads() > 1 || !app.get_handover_path().empty()) {
+        acceptor.set_option(ReusePort(true));
+    }
+#endif
+}
+
+}
 
 
 using s5p::Server;
+using s5p::Counter;
+using s5p::IOEngine;
+using s5p::Uring;
+using s5p::Listener;
+using s5p::ErrorCode;
+using s5p::Admission;
+using s5p::OverloadMode;
 
 
 Server::Server(IOLoop & loop)
@@ -37,58 +92,378 @@ Server::Server(IOLoop & loop)
 
 void Server::listen_v4(uint16_t port) {
     _->do_v4_listen(port);
-    _->do_v4_accept();
+    _->do_listen(_->v4);
 }
 
 void Server::listen_v6(uint16_t port) {
     _->do_v6_listen(port);
-    _->do_v6_accept();
+    _->do_listen(_->v6);
+}
+
+// a listening socket handed over by the previous process, already bound and
+// tuned
+void Server::adopt_v4(int fd) {
+    _->v4.acceptor.assign(boost::asio::ip::tcp::v4(), fd);
+    _->do_listen(_->v4);
+}
+
+void Server::adopt_v6(int fd) {
+    _->v6.acceptor.assign(boost::asio::ip::tcp::v6(), fd);
+    _->do_listen(_->v6);
+}
+
+std::vector<int> Server::listeners() const {
+    std::vector<int> fds;
+    for (auto listener : {&_->v4, &_->v6}) {
+        if (listener->acceptor.is_open()) {
+            fds.push_back(listener->acceptor.native_handle());
+        }
+    }
+    return fds;
+}
+
+// stops accepting, the sessions already started go on
+void Server::stop() {
+    auto self = _;
+    boost::asio::post(_->loop, [self]() -> void {
+        self->do_stop(self->v4);
+        self->do_stop(self->v6);
+        self->parked.clear();
+    });
+}
+
+Listener::Listener(IOLoop & loop)
+    : acceptor(loop)
+    , backoff(loop)
+    , delay(MIN_BACKOFF)
+    , backing_off(false)
+    , paused(false)
+    , stopped(false)
+{
 }
 
 Server::Private::Private(IOLoop & loop)
-    : v4_acceptor(loop)
-    , v6_acceptor(loop)
-    , socket(loop)
+    : loop(loop)
+    , v4(loop)
+    , v6(loop)
+    , reserve(open_reserve())
+    , pool()
+    , wheel(std::make_shared<TimingWheel>(loop, std::chrono::milliseconds(100)))
+    , uring()
+    , parked()
 {
+    auto & application = Application::instance();
+    if (application.get_io_engine() == IOEngine::URING) {
+        ErrorCode ec;
+        this->uring = std::make_shared<Uring>(loop);
+        if (!this->uring->open(ec)) {
+            report_error("cannot set up io_uring, fall back to the reactor", ec);
+            this->uring.reset();
+        }
+    }
+    if (application.get_pool_max() > 0) {
+        this->pool = std::make_shared<TunnelPool>(loop, application.get_pool_min(), application.get_pool_max());
+        this->pool->start();
+    }
+}
+
+Server::Private::~Private() {
+    if (this->reserve >= 0) {
+        ::close(this->reserve);
+    }
 }
 
 void Server::Private::do_v4_listen(uint16_t port) {
     EndPoint ep(boost::asio::ip::tcp::v4(), port);
-    this->v4_acceptor.open(ep.protocol());
-    this->v4_acceptor.set_option(Acceptor::reuse_address(true));
-    this->v4_acceptor.bind(ep);
-    this->v4_acceptor.listen();
+    auto & acceptor = this->v4.acceptor;
+    acceptor.open(ep.protocol());
+    acceptor.set_option(Acceptor::reuse_address(true));
+    set_reuse_port(acceptor);
+    tune_listener(acceptor);
+    acceptor.bind(ep);
+    acceptor.listen(listen_backlog());
+    report_socket_options(acceptor);
 }
 
-void Server::Private::do_v4_accept() {
-    this->v4_acceptor.async_accept(this->socket, [this](const ErrorCode & ec) -> void {
-        if (ec) {
-            report_error("doV4Accept", ec);
+void Server::Private::do_v6_listen(uint16_t port) {
+    EndPoint ep(boost::asio::ip::tcp::v6(), port);
+    auto & acceptor = this->v6.acceptor;
+    acceptor.open(ep.protocol());
+    acceptor.set_option(Acceptor::reuse_address(true));
+    acceptor.set_option(boost::asio::ip::v6_only(true));
+    set_reuse_port(acceptor);
+    tune_listener(acceptor);
+    acceptor.bind(ep);
+    acceptor.listen(listen_backlog());
+}
+
+void Server::Private::do_listen(Listener & listener) {
+    // the burst drain and the shedding must not block, whichever engine
+    // accepts
+    ErrorCode ec;
+    listener.acceptor.non_blocking(true, ec);
+    if (this->uring && !this->uring->is_broken()) {
+        this->do_ring_accept(listener);
+    } else {
+        this->do_accept(listener);
+    }
+}
+
+void Server::Private::do_stop(Listener & listener) {
+    if (listener.stopped || !listener.acceptor.is_open()) {
+        return;
+    }
+    listener.stopped = true;
+    ErrorCode ec;
+    listener.backoff.cancel(ec);
+    if (this->uring) {
+        // the ring holds its own reference to the file, close the acceptor
+        // once the multishot accept has let go of it
+        this->uring->cancel(listener.acceptor.native_handle(), [&listener](int, uint32_t) -> void {
+            ErrorCode ec;
+            listener.acceptor.close(ec);
+        });
+        return;
+    }
+    listener.acceptor.close(ec);
+}
+
+// several accepts wait at once, each one accepts into a socket of its own
+void Server::Private::do_accept(Listener & listener) {
+    for (std::size_t i = 0; i < Application::instance().get_pending_accepts(); ++i) {
+        listener.acceptor.async_accept([this, &listener](const ErrorCode & ec, Socket socket) -> void {
+            this->on_accepted(listener, ec, std::move(socket));
+        });
+    }
+}
+
+void Server::Private::on_accepted(Listener & listener, const ErrorCode & ec, Socket socket) {
+    auto resume = [this, &listener]() -> void {
+        if (listener.stopped) {
+            return;
+        }
+        listener.acceptor.async_accept([this, &listener](const ErrorCode & ec, Socket socket) -> void {
+            this->on_accepted(listener, ec, std::move(socket));
+        });
+    };
+
+    if (ec == boost::asio::error::operation_aborted) {
+        return;
+    }
+    if (ec) {
+        if (is_exhausted(ec)) {
+            this->do_back_off(listener, ec, resume);
+            return;
+        }
+        report_error("accept", ec);
+        resume();
+        return;
+    }
+
+    listener.delay = MIN_BACKOFF;
+    ErrorCode drained;
+    if (!this->do_start_session(std::move(socket)) || !this->do_drain(listener, drained)) {
+        if (drained) {
+            this->do_back_off(listener, drained, resume);
         } else {
-            std::make_shared<Session>(std::move(this->socket))->start();
+            this->do_pause_listener(listener);
         }
+        return;
+    }
+    resume();
+}
 
-        this->do_v4_accept();
-    });
+// a wakeup usually means a burst, take what is ready without going back to
+// the reactor; false means stop accepting, for a while if ec is set, or
+// until admission control has room again
+bool Server::Private::do_drain(Listener & listener, ErrorCode & ec) {
+    for (std::size_t i = 0; i < ACCEPT_BURST; ++i) {
+        Socket socket(this->loop);
+        listener.acceptor.accept(socket, ec);
+        if (ec == boost::asio::error::would_block || ec == boost::asio::error::try_again) {
+            break;
+        }
+        if (ec) {
+            if (is_exhausted(ec)) {
+                return false;
+            }
+            report_error("accept", ec);
+            break;
+        }
+        if (!this->do_start_session(std::move(socket))) {
+            return false;
+        }
+    }
+    ec.clear();
+    return true;
 }
 
-void Server::Private::do_v6_listen(uint16_t port) {
-    EndPoint ep(boost::asio::ip::tcp::v6(), port);
-    this->v6_acceptor.open(ep.protocol());
-    this->v6_acceptor.set_option(Acceptor::reuse_address(true));
-    this->v6_acceptor.set_option(boost::asio::ip::v6_only(true));
-    this->v6_acceptor.bind(ep);
-    this->v6_acceptor.listen();
+// one multishot accept keeps delivering connections until the kernel ends it
+void Server::Private::do_ring_accept(Listener & listener) {
+    namespace ph = std::placeholders;
+    this->uring->accept(listener.acceptor.native_handle(), std::bind(&Server::Private::on_ring_accepted, this, std::ref(listener), ph::_1, ph::_2));
 }
 
-void Server::Private::do_v6_accept() {
-    this->v6_acceptor.async_accept(this->socket, [this](const ErrorCode & ec) -> void {
+void Server::Private::on_ring_accepted(Listener & listener, int result, uint32_t flags) {
+    // only stopping or pausing cancels, and both arm it again if need be
+    if (result == -ECANCELED) {
+        return;
+    }
+    if (result == -EINVAL) {
+        // multishot accept needs Linux 5.19
+        report_error("io_uring cannot accept, fall back to the reactor", ErrorCode(-result, boost::system::system_category()));
+        this->do_accept(listener);
+        return;
+    }
+    if (result < 0 && this->uring->is_broken()) {
+        // reported by the ring already
+        if (!listener.stopped && !listener.paused) {
+            this->do_accept(listener);
+        }
+        return;
+    }
+    bool more = Uring::has_more(flags);
+    if (result < 0) {
+        ErrorCode ec(-result, boost::system::system_category());
+        if (is_exhausted(ec) && !more) {
+            this->do_back_off(listener, ec, [this, &listener]() -> void {
+                if (!listener.stopped) {
+                    this->do_ring_accept(listener);
+                }
+            });
+            return;
+        }
+        report_error("ring accept", ec);
+    } else {
+        ErrorCode ec;
+        Socket socket(this->loop);
+        socket.assign(listener.acceptor.local_endpoint().protocol(), result, ec);
         if (ec) {
-            report_error("doV6Accept", ec);
+            ::close(result);
+            report_error("ring accept", ec);
         } else {
-            std::make_shared<Session>(std::move(this->socket))->start();
+            listener.delay = MIN_BACKOFF;
+            if (!this->do_start_session(std::move(socket))) {
+                this->do_pause_listener(listener);
+            }
+        }
+    }
+    if (!more && !listener.stopped && !listener.paused) {
+        this->do_ring_accept(listener);
+    }
+}
+
+// false means the listener should pause until admission control has room
+bool Server::Private::do_start_session(Socket socket) {
+    count(Counter::ACCEPTS);
+    auto & admission = Admission::instance();
+    if (Application::instance().get_overload_mode() == OverloadMode::PAUSE) {
+        // accepted before the listeners could pause, it waits for room here
+        // rather than in the backlog
+        if (!admission.try_enter()) {
+            this->parked.push_back(std::move(socket));
+            return false;
         }
+        std::make_shared<Session>(std::move(socket), this->pool, this->wheel, this->uring)->start();
+        return admission.has_room();
+    }
+    if (!admission.admit()) {
+        this->do_reject(socket);
+        return true;
+    }
+    std::make_shared<Session>(std::move(socket), this->pool, this->wheel, this->uring)->start();
+    return true;
+}
+
+// a reset costs the client one round trip, instead of a stalled connect
+void Server::Private::do_reject(Socket & socket) {
+    ErrorCode ec;
+    socket.set_option(Socket::linger(true, 0), ec);
+    socket.close(ec);
+}
+
+// the backlog absorbs the burst meanwhile; the kernel drops SYNs once it is
+// full, and clients retry
+void Server::Private::do_pause(std::function<void ()> resume) {
+    if (this->do_unpark()) {
+        resume();
+        return;
+    }
+    auto timer = std::make_shared<SteadyTimer>(this->loop, PAUSE_POLL);
+    timer->async_wait([this, timer, resume](const ErrorCode & ec) -> void {
+        if (ec) {
+            return;
+        }
+        this->do_pause(resume);
+    });
+}
 
-        this->do_v6_accept();
+// no accept stays armed on a full proxy, not just the one which noticed;
+// the ones completing meanwhile are parked, and every accept is armed again
+// once there is room
+void Server::Private::do_pause_listener(Listener & listener) {
+    if (listener.paused) {
+        return;
+    }
+    listener.paused = true;
+    ErrorCode ec;
+    listener.acceptor.cancel(ec);
+    if (this->uring) {
+        this->uring->cancel(listener.acceptor.native_handle(), Uring::Completion());
+    }
+    this->do_pause([this, &listener]() -> void {
+        listener.paused = false;
+        if (!listener.stopped) {
+            this->do_listen(listener);
+        }
     });
 }
+
+// the parked connections go first, true if there is room for more
+bool Server::Private::do_unpark() {
+    auto & admission = Admission::instance();
+    while (!this->parked.empty()) {
+        if (!admission.try_enter()) {
+            return false;
+        }
+        std::make_shared<Session>(std::move(this->parked.front()), this->pool, this->wheel, this->uring)->start();
+        this->parked.pop_front();
+    }
+    return admission.has_room();
+}
+
+// out of descriptors: turn one waiting client away, so it does not sit in
+// the backlog, and stop accepting for a while; every pending accept waits on
+// the same timer
+void Server::Private::do_back_off(Listener & listener, const ErrorCode & ec, std::function<void ()> resume) {
+    if (!listener.backing_off) {
+        listener.backing_off = true;
+        count(Counter::ACCEPT_BACKOFFS);
+        report_error("out of descriptors, pause accepting", ec, {
+            {"delay_ms", std::to_string(listener.delay.count())},
+        });
+        this->do_shed(listener);
+        listener.backoff.expires_after(listener.delay);
+        listener.delay = std::min(listener.delay * 2, MAX_BACKOFF);
+    }
+    listener.backoff.async_wait([&listener, resume](const ErrorCode & ec) -> void {
+        listener.backing_off = false;
+        if (ec) {
+            return;
+        }
+        resume();
+    });
+}
+
+void Server::Private::do_shed(Listener & listener) {
+    if (this->reserve < 0) {
+        return;
+    }
+    ::close(this->reserve);
+    // EAGAIN means nobody is waiting, there is nothing to shed
+    int fd = ::accept4(listener.acceptor.native_handle(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    this->reserve = open_reserve();
+}
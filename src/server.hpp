@@ -26,6 +26,7 @@
 #include "global.hpp"
 
 #include <memory>
+#include <vector>
 
 
 namespace s5p {
@@ -36,6 +37,10 @@ public:
 
     void listen_v4(uint16_t port);
     void listen_v6(uint16_t port);
+    void adopt_v4(int fd);
+    void adopt_v6(int fd);
+    std::vector<int> listeners() const;
+    void stop();
 
 private:
     Server(const Server &);
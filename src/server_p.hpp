@@ -24,22 +24,63 @@
 #define S5P_SERVER_HPP_
 
 #include "server.hpp"
+#include "tunnel_pool.hpp"
+#include "timing_wheel.hpp"
+#include "uring.hpp"
+
+#include <deque>
+#include <functional>
 
 
 namespace s5p {
 
+/**
+ * An acceptor and its backoff, for when the process runs out of descriptors.
+ */
+struct Listener {
+    explicit Listener(IOLoop & loop);
+
+    Acceptor acceptor;
+    SteadyTimer backoff;
+    std::chrono::milliseconds delay;
+    bool backing_off;
+    // admission control is full, no accept is armed
+    bool paused;
+    bool stopped;
+};
+
+
 class Server::Private {
 public:
     explicit Private(IOLoop & loop);
+    ~Private();
 
     void do_v4_listen(uint16_t port);
-    void do_v4_accept();
     void do_v6_listen(uint16_t port);
-    void do_v6_accept();
+    void do_listen(Listener & listener);
+    void do_stop(Listener & listener);
+    void do_accept(Listener & listener);
+    void on_accepted(Listener & listener, const ErrorCode & ec, Socket socket);
+    bool do_drain(Listener & listener, ErrorCode & ec);
+    void do_ring_accept(Listener & listener);
+    void on_ring_accepted(Listener & listener, int result, uint32_t flags);
+    bool do_start_session(Socket socket);
+    void do_reject(Socket & socket);
+    void do_pause(std::function<void ()> resume);
+    void do_pause_listener(Listener & listener);
+    bool do_unpark();
+    void do_back_off(Listener & listener, const ErrorCode & ec, std::function<void ()> resume);
+    void do_shed(Listener & listener);
 
-    Acceptor v4_acceptor;
-    Acceptor v6_acceptor;
-    Socket socket;
+    IOLoop & loop;
+    Listener v4;
+    Listener v6;
+    int reserve;
+    std::shared_ptr<TunnelPool> pool;
+    std::shared_ptr<TimingWheel> wheel;
+    std::shared_ptr<Uring> uring;
+    // accepted while the listeners were pausing, they wait for room here
+    std::deque<Socket> parked;
 };
 
 }
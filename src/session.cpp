@@ -24,98 +24,167 @@
 
 #include "global.hpp"
 #include "exception.hpp"
+#include "metrics.hpp"
+#include "balancer.hpp"
+#include "admission.hpp"
+#include "buffer.hpp"
+#include "socket_options.hpp"
 
-#include <boost/lexical_cast.hpp>
+#ifdef __linux__
+#include <fcntl.h>
+#endif
 
+#include <boost/asio/write.hpp>
 
-namespace {
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <limits>
 
-std::size_t fill_ipv4(s5p::Chunk & buffer, std::size_t offset) {
-    // ATYP
-    buffer[offset++] = 0x01;
 
-    // DST.ADDR
-    auto bytes = s5p::Application::instance().get_http_host_as_ipv4().to_bytes();
-    std::copy_n(std::begin(bytes), bytes.size(), std::next(std::begin(buffer), offset));
+using s5p::Session;
+using s5p::Tunnel;
+using s5p::HttpParser;
+using s5p::HttpCache;
+using s5p::Balancer;
+using s5p::IOLoop;
+using s5p::Socket;
+using s5p::YieldContext;
+using s5p::ErrorCode;
+using s5p::Chunk;
+using s5p::Buffer;
+using s5p::Pipe;
+using s5p::RelayMode;
+using s5p::Counter;
+using s5p::Gauge;
+using s5p::Histogram;
+using s5p::TimingWheel;
+using s5p::LogFields;
+using s5p::RelayQueue;
+using s5p::Uring;
+using s5p::Admission;
+using s5p::Shaper;
+using s5p::TokenBucket;
+using s5p::Frontend;
+using s5p::TargetMode;
 
-    return 1 + bytes.size();
-}
 
-std::size_t fill_ipv6(s5p::Chunk & buffer, std::size_t offset) {
-    // ATYP
-    buffer[offset++] = 0x04;
+namespace {
 
-    // DST.ADDR
-    auto bytes = s5p::Application::instance().get_http_host_as_ipv6().to_bytes();
-    std::copy_n(std::begin(bytes), bytes.size(), std::next(std::begin(buffer), offset));
+// a direction stops reading once this much waits for the other side
+const std::size_t HIGH_WATER_MARK = 256 * 1024;
+// segments handed to one gathered write
+const std::size_t MAX_GATHER = 16;
+// a request body beyond this goes on without waiting for the rest
+const std::size_t MAX_HELD_REQUEST = 64 * 1024;
 
-    return 1 + bytes.size();
+#ifdef __linux__
+// the ring waits for data itself, asio expects its sockets non-blocking
+void set_blocking(Socket & socket, bool blocking) {
+    auto fd = socket.native_handle();
+    auto flags = ::fcntl(fd, F_GETFL);
+    ::fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
 }
+#endif
 
-std::size_t fill_fqdn(s5p::Chunk & buffer, std::size_t offset) {
-    // ATYP
-    buffer[offset++] = 0x03;
-
-    // DST.ADDR
-    const std::string & hostname = s5p::Application::instance().get_http_host_as_fqdn();
-    buffer[offset++] = static_cast<uint8_t>(hostname.size());
-    std::copy(std::begin(hostname), std::end(hostname), std::next(std::begin(buffer), offset));
-
-    return 1 + 1 + hostname.size();
+uint64_t next_session_id() {
+    static std::atomic<uint64_t> id(0);
+    return id.fetch_add(1, std::memory_order_relaxed) + 1;
 }
 
 }
 
 
-using s5p::Session;
-using s5p::Socket;
-using s5p::Resolver;
-using s5p::ResolvedRange;
-using s5p::ErrorCode;
-using s5p::Chunk;
-
-
-Session::Session(Socket socket)
-    : _(std::make_shared<Session::Private>(std::move(socket)))
+Session::Session(Socket socket, std::shared_ptr<TunnelPool> pool, std::shared_ptr<TimingWheel> wheel, std::shared_ptr<Uring> uring)
+    : _(std::make_shared<Session::Private>(std::move(socket), pool, wheel, uring))
 {
 }
 
 void Session::start() {
-    namespace ph = std::placeholders;
-    _->self = this->shared_from_this();
-    boost::asio::spawn(_->loop, std::bind(&Session::Private::do_start, _, ph::_1));
+    auto self = this->shared_from_this();
+    _->self = self;
+    // the coroutine starts later, keep the session alive until then
+    boost::asio::spawn(_->loop, [self](YieldContext yield) -> void {
+        self->_->do_start(yield);
+    }, coroutine_attributes());
 }
 
 void Session::stop() {
-    try {
-        _->inner_socket.shutdown(Socket::shutdown_both);
-    } catch (std::exception & e) {
-        report_error("inner socket shutdown failed", e);
-    }
-    try {
-        _->inner_socket.close();
-    } catch (std::exception & e) {
-        report_error("inner socket close failed", e);
+    // both directions end here, the second one finds the sockets closed
+    ErrorCode ec;
+    _->upload.timer.cancel(ec);
+    _->download.timer.cancel(ec);
+    if (_->ring_relay) {
+        // wakes up the pending ring operations, the sockets are closed with
+        // the session once all of them have completed
+        _->inner_socket.shutdown(Socket::shutdown_both, ec);
+        _->outer_socket.shutdown(Socket::shutdown_both, ec);
+        return;
     }
-    try {
-        _->outer_socket.shutdown(Socket::shutdown_both);
-    } catch (std::exception & e) {
-        report_error("outer socket shutdown failed", e);
+    if (_->inner_socket.is_open()) {
+        _->inner_socket.shutdown(Socket::shutdown_both, ec);
+        _->inner_socket.close(ec);
+        if (ec) {
+            report_error("inner socket close failed", ec, _->do_log_fields("close"));
+        }
     }
-    try {
-        _->outer_socket.close();
-    } catch (std::exception & e) {
-        report_error("outer socket close failed", e);
+    if (_->outer_socket.is_open()) {
+        _->outer_socket.shutdown(Socket::shutdown_both, ec);
+        _->outer_socket.close(ec);
+        if (ec) {
+            report_error("outer socket close failed", ec, _->do_log_fields("close"));
+        }
     }
 }
 
 
-Session::Private::Private(Socket socket)
+Session::Private::Private(Socket socket, std::shared_ptr<TunnelPool> pool, std::shared_ptr<TimingWheel> wheel, std::shared_ptr<Uring> uring)
     : self()
+    , id(next_session_id())
     , outer_socket(std::move(socket))
-    , loop(this->outer_socket.get_io_service())
+    , loop(static_cast<IOLoop &>(this->outer_socket.get_executor().context()))
     , inner_socket(this->loop)
+    , pool(pool)
+    , upstream()
+    , wheel(wheel)
+    , uring(uring)
+    , ring_relay(false)
+    , upload(this->loop, Application::instance().get_session_upload_rate(), TokenBucket::upload(), Counter::STALLS_UPSTREAM)
+    , download(this->loop, Application::instance().get_session_download_rate(), TokenBucket::download(), Counter::STALLS_DOWNSTREAM)
+    , timeout()
+    , timed_out(false)
+    , last_active()
+    , accepted(std::chrono::steady_clock::now())
+    , answered(false)
+    , handshaking(true)
+    , responses(HttpParser::Kind::RESPONSE)
+    , requests(HttpParser::Kind::REQUEST, &this->responses)
+    , client_left(false)
+    , caching(Application::instance().get_http_cache_size() > 0)
+    , frontend(Application::instance().get_target_mode() == TargetMode::FIXED ? nullptr : new Frontend(this->outer_socket))
 {
+    adjust(Gauge::SESSIONS_ACTIVE, 1);
+    tune_client(this->outer_socket);
+    if (this->caching) {
+        this->requests.capture(0);
+        this->responses.capture(HttpCache::instance().object_limit());
+    }
+}
+
+Session::Private::~Private() {
+#ifdef __linux__
+    if (this->ring_relay) {
+        // every ring operation has completed, asio closes the sockets
+        set_blocking(this->outer_socket, false);
+        set_blocking(this->inner_socket, false);
+    }
+#endif
+    adjust(Gauge::SESSIONS_ACTIVE, -1);
+    Admission::instance().leave(this->handshaking);
+    this->wheel->cancel(this->timeout);
+    if (this->upstream) {
+        this->upstream->end_session();
+    }
 }
 
 std::shared_ptr<Session> Session::Private::kung_fu_death_grip() {
@@ -124,192 +193,988 @@ std::shared_ptr<Session> Session::Private::kung_fu_death_grip() {
 
 void Session::Private::do_start(YieldContext yield) {
     auto self = this->kung_fu_death_grip();
+
+    // the client names the target before anything else
+    if (this->frontend && !this->do_read_target(yield)) {
+        return;
+    }
+
+    // a cached response needs no tunnel, the first miss opens one
+    if (this->caching) {
+        boost::asio::spawn(this->loop, [this, self](YieldContext yield) -> void {
+            this->do_http_serving(yield);
+        }, coroutine_attributes());
+        return;
+    }
+
+    // a pooled tunnel has already finished CONNECT
+    auto tunnel = this->pool ? this->pool->acquire() : nullptr;
+    if (tunnel) {
+        this->do_inner_adopt(*tunnel);
+    } else if (!this->do_inner_open(yield)) {
+        return;
+    }
+    this->do_end_handshake();
+    this->do_watch_idle();
+
+    if (Application::instance().get_http_keep_alive()) {
+        boost::asio::spawn(this->loop, [this, self](YieldContext yield) -> void {
+            this->do_http_proxying(yield, this->outer_socket, this->inner_socket, this->requests);
+        }, coroutine_attributes());
+        boost::asio::spawn(this->loop, [this, self](YieldContext yield) -> void {
+            this->do_http_proxying(yield, this->inner_socket, this->outer_socket, this->responses);
+        }, coroutine_attributes());
+        return;
+    }
+
+    if (this->uring && !this->uring->is_broken()) {
+        this->do_ring_start();
+        return;
+    }
+
+    if (Application::instance().get_relay_mode() == RelayMode::SPLICE) {
+        boost::asio::spawn(this->loop, [this, self](YieldContext yield) -> void {
+            this->do_splicing(yield, this->outer_socket, this->inner_socket);
+        }, coroutine_attributes());
+        boost::asio::spawn(this->loop, [this, self](YieldContext yield) -> void {
+            this->do_splicing(yield, this->inner_socket, this->outer_socket);
+        }, coroutine_attributes());
+        return;
+    }
+
+    if (Application::instance().get_relay_mode() == RelayMode::OVERLAP) {
+        this->do_overlap_read(this->outer_socket, this->inner_socket, std::make_shared<RelayQueue>());
+        this->do_overlap_read(this->inner_socket, this->outer_socket, std::make_shared<RelayQueue>());
+        return;
+    }
+
+    if (Application::instance().get_stackless_relay()) {
+        this->do_relay(this->outer_socket, this->inner_socket, 0);
+        this->do_relay(this->inner_socket, this->outer_socket, 0);
+        return;
+    }
+
+    boost::asio::spawn(this->loop, [this, self](YieldContext yield) -> void {
+        this->do_proxying(yield, this->outer_socket, this->inner_socket);
+    }, coroutine_attributes());
+    boost::asio::spawn(this->loop, [this, self](YieldContext yield) -> void {
+        this->do_proxying(yield, this->inner_socket, this->outer_socket);
+    }, coroutine_attributes());
+}
+
+// a client which names its own target waits for it without a tunnel, the
+// handshake timeout covers this wait as well
+bool Session::Private::do_read_target(YieldContext yield) {
+    auto self = this->kung_fu_death_grip();
+    auto seconds = Application::instance().get_handshake_timeout();
+    if (seconds > 0) {
+        std::weak_ptr<Session> weak = this->self;
+        this->timeout = this->wheel->schedule(std::chrono::seconds(seconds), [this, weak]() -> void {
+            auto session = weak.lock();
+            if (!session) {
+                return;
+            }
+            count(Counter::TIMEOUTS_HANDSHAKE);
+            this->timed_out = true;
+            session->stop();
+        });
+    }
+
+    ErrorCode ec;
     bool ok = false;
+    try {
+        ok = this->frontend->read_request(yield, ec);
+    } catch (RequestError & e) {
+        this->do_disarm();
+        count(Counter::ERRORS_REQUEST);
+        report_error("malformed client request", e, this->do_log_fields("request"));
+        this->frontend->refuse(yield, e.reply());
+        return false;
+    }
+    this->do_disarm();
+    if (!ok) {
+        if (this->timed_out) {
+            report_error("client request timed out", this->do_log_fields("request"));
+        } else {
+            this->do_finish(ec);
+        }
+        return false;
+    }
+    count(this->frontend->kind());
+    return true;
+}
+
+bool Session::Private::do_inner_open(YieldContext yield) {
+    auto self = this->kung_fu_death_grip();
+    auto tunnel = std::make_shared<Tunnel>(this->loop, Balancer::instance().pick());
+    auto chunk = create_chunk();
+
+    // what came with the target name goes first, the head of an HTTP request
+    std::size_t early = 0;
+    if (this->frontend) {
+        tunnel->set_target(this->frontend->target());
+        auto & data = this->frontend->early_data();
+        early = std::min(data.size(), chunk.size());
+        std::copy_n(std::begin(data), early, std::begin(chunk));
+        this->do_count_bytes(this->outer_socket, Counter::BYTES_COPIED, early);
+    }
+
+    // a caching session has read its first request already
+    bool pipelined = Application::instance().get_pipelined_handshake() && !this->caching;
+    if (pipelined) {
+        // whatever the client has sent so far rides along with CONNECT
+        ErrorCode ec;
+        std::size_t length = 0;
+        if (this->outer_socket.available(ec) > 0 && !ec && early < chunk.size()) {
+            length = this->outer_socket.read_some(boost::asio::buffer(&chunk[early], chunk.size() - early), ec);
+        }
+        if (!ec && length > 0) {
+            this->requests.feed(&chunk[early], length);
+            this->do_count_bytes(this->outer_socket, Counter::BYTES_COPIED, length);
+            early += length;
+        }
+        if (early > 0) {
+            tunnel->set_early_data(chunk, early);
+        }
+    }
 
+    auto & application = Application::instance();
+    this->do_arm_phase(tunnel, Counter::TIMEOUTS_CONNECT, application.get_connect_timeout());
     try {
-        auto resolved_range = this->do_inner_resolve(yield);
-        for (auto it = resolved_range.first; !ok && it != resolved_range.second; ++it) {
-            ok = this->do_inner_connect(yield, it);
+        if (!tunnel->connect(yield)) {
+            this->do_disarm();
+            count(Counter::ERRORS_CONNECTION);
+            report_error(this->timed_out ? "socks5 connect timed out" : "no resolved address is available", this->do_log_fields("connect"));
+            this->do_refuse(yield, this->timed_out ? 0x06 : 0x01);
+            return false;
         }
+    } catch (ResolutionError & e) {
+        this->do_disarm();
+        count(Counter::ERRORS_RESOLUTION);
+        report_error("cannot resolve the domain", e, this->do_log_fields("connect"));
+        this->do_refuse(yield, 0x01);
+        return false;
+    }
+
+    this->do_arm_phase(tunnel, Counter::TIMEOUTS_HANDSHAKE, application.get_handshake_timeout());
+    ErrorCode ec;
+    try {
+        bool ok = tunnel->handshake(yield, ec);
+        this->do_disarm();
         if (!ok) {
-            report_error("no resolved address is available");
+            if (this->timed_out) {
+                count(Counter::ERRORS_CONNECTION);
+                report_error("socks5 handshake timed out", this->do_log_fields("handshake"));
+                this->do_refuse(yield, 0x06);
+            } else if (ec == boost::asio::error::eof) {
+                count(Counter::ERRORS_END_OF_FILE);
+                this->do_refuse(yield, 0x01);
+                self->stop();
+            } else {
+                count(Counter::ERRORS_CONNECTION);
+                report_error("socks5 connection error", ec, this->do_log_fields("handshake"));
+                this->do_refuse(yield, 0x01);
+            }
+            return false;
+        }
+    } catch (Socks5Error & e) {
+        this->do_disarm();
+        count(Counter::ERRORS_SOCKS5);
+        report_error("socks5 auth error", e, this->do_log_fields("handshake"));
+        this->do_refuse(yield, e.reply());
+        return false;
+    }
+
+    if (this->frontend) {
+        this->frontend->accept(yield, tunnel->bound(), ec);
+        if (!ec && !pipelined && early > 0) {
+            write_chunk(yield, tunnel->socket(), chunk, early, ec);
+        }
+        if (ec) {
+            this->do_finish(ec);
+            return false;
+        }
+    }
+
+    // the target may have answered the early data already
+    auto length = tunnel->read_leftover(chunk);
+    this->responses.feed(chunk.data(), length);
+    write_chunk(yield, this->outer_socket, chunk, length, ec);
+    if (ec) {
+        this->do_finish(ec);
+        return false;
+    }
+    this->do_count_bytes(this->inner_socket, Counter::BYTES_COPIED, length);
+
+    this->do_inner_adopt(*tunnel);
+    return true;
+}
+
+void Session::Private::do_refuse(YieldContext yield, uint8_t reply) {
+    if (this->frontend) {
+        this->frontend->refuse(yield, reply);
+    }
+}
+
+void Session::Private::do_inner_adopt(Tunnel & tunnel) {
+    this->inner_socket = std::move(tunnel.socket());
+    this->upstream = tunnel.upstream();
+    this->upstream->begin_session();
+}
+
+void Session::Private::do_end_handshake() {
+    if (!this->handshaking) {
+        return;
+    }
+    this->handshaking = false;
+    Admission::instance().end_handshake();
+}
+
+// also replaces a phase timeout still armed
+void Session::Private::do_watch_idle() {
+    this->do_disarm();
+    auto idle_timeout = Application::instance().get_idle_timeout();
+    if (idle_timeout > 0) {
+        this->last_active = this->wheel->now();
+        this->do_arm_idle(std::chrono::seconds(idle_timeout));
+    }
+}
+
+// aborts the tunnel if the connect or handshake phase runs out of time
+void Session::Private::do_arm_phase(std::weak_ptr<Tunnel> tunnel, Counter counter, std::size_t seconds) {
+    this->do_disarm();
+    if (seconds == 0) {
+        return;
+    }
+    // a pending timeout must not keep the session alive
+    std::weak_ptr<Session> self = this->self;
+    this->timeout = this->wheel->schedule(std::chrono::seconds(seconds), [this, self, tunnel, counter]() -> void {
+        auto session = self.lock();
+        auto victim = tunnel.lock();
+        if (!session || !victim) {
             return;
         }
-    } catch (ResolutionError & e) {
-        report_error("cannot resolve the domain", e);
+        count(counter);
+        this->timed_out = true;
+        victim->cancel();
+    });
+}
+
+void Session::Private::do_arm_idle(TimingWheel::Clock::duration timeout) {
+    std::weak_ptr<Session> self = this->self;
+    this->timeout = this->wheel->schedule(timeout, [this, self, timeout]() -> void {
+        auto session = self.lock();
+        if (!session) {
+            return;
+        }
+        this->on_idle_expired(timeout);
+    });
+}
+
+void Session::Private::do_disarm() {
+    this->wheel->cancel(this->timeout);
+    this->timeout.reset();
+}
+
+void Session::Private::on_idle_expired(TimingWheel::Clock::duration timeout) {
+    // the relay only stamps its activity, the deadline moves lazily here
+    auto idle = this->wheel->now() - this->last_active;
+    if (idle < timeout) {
+        this->do_arm_idle(timeout - idle);
         return;
     }
+    count(Counter::TIMEOUTS_IDLE);
+    auto self = this->kung_fu_death_grip();
+    self->stop();
+}
 
-    try {
-        this->do_inner_socks5(yield);
-    } catch (EndOfFileError &) {
-        self->stop();
+// the handler gets the most the next read from input may take, once the
+// buckets have something for it
+template<typename Handler>
+void Session::Private::do_throttle(Socket & input, std::size_t wanted, Handler handler) {
+    auto & shaper = this->do_shaper(input);
+    auto allowed = shaper.allowance(wanted);
+    if (allowed > 0) {
+        handler(ErrorCode(), allowed);
         return;
-    } catch (Socks5Error & e) {
-        report_error("socks5 auth error", e);
+    }
+    count(shaper.stalls);
+    auto self = this->kung_fu_death_grip();
+    shaper.timer.expires_after(shaper.delay());
+    shaper.timer.async_wait([this, self, &input, wanted, handler](const ErrorCode & ec) -> void {
+        if (ec) {
+            handler(ec, 0);
+            return;
+        }
+        this->do_throttle(input, wanted, handler);
+    });
+}
+
+void Session::Private::do_proxying(YieldContext yield, Socket & input, Socket & output) {
+    auto self = this->kung_fu_death_grip();
+    std::size_t size_class = 0;
+    ErrorCode ec;
+    while (true) {
+        // an idle session holds no buffer while it waits
+        input.async_wait(Socket::wait_read, yield[ec]);
+        if (ec) {
+            break;
+        }
+
+        // a throttled session holds no buffer either
+        auto allowed = this->do_throttle(yield, input, Buffer::class_size(size_class), ec);
+        if (ec) {
+            break;
+        }
+
+        Buffer buffer(size_class);
+        auto length = read_buffer(yield, input, boost::asio::buffer(buffer.buffer(), allowed), ec);
+        if (ec) {
+            break;
+        }
+        this->do_shaper(input).consume(length);
+        this->last_active = this->wheel->now();
+        write_buffer(yield, output, buffer.buffer(length), ec);
+        if (ec) {
+            break;
+        }
+        this->do_count_bytes(input, Counter::BYTES_COPIED, length);
+        size_class = Buffer::next_class(size_class, length);
+    }
+    this->do_finish(ec);
+}
+
+// the same relay as do_proxying, but as a chain of completion handlers, so
+// nothing but the session itself stays alive between two reads
+void Session::Private::do_relay(Socket & input, Socket & output, std::size_t size_class) {
+    auto self = this->kung_fu_death_grip();
+    input.async_wait(Socket::wait_read, [this, self, &input, &output, size_class](const ErrorCode & ec) -> void {
+        this->on_relay_readable(input, output, size_class, ec);
+    });
+}
+
+void Session::Private::on_relay_readable(Socket & input, Socket & output, std::size_t size_class, const ErrorCode & ec) {
+    if (ec) {
+        this->do_finish(ec);
+        return;
+    }
+    auto self = this->kung_fu_death_grip();
+    this->do_throttle(input, Buffer::class_size(size_class), [this, self, &input, &output, size_class](const ErrorCode & ec, std::size_t allowed) -> void {
+        if (ec) {
+            this->do_finish(ec);
+            return;
+        }
+        auto buffer = std::make_shared<Buffer>(size_class);
+        input.async_read_some(boost::asio::buffer(buffer->buffer(), allowed), [this, self, &input, &output, buffer](const ErrorCode & ec, std::size_t length) -> void {
+            this->on_relay_read(input, output, buffer, ec, length);
+        });
+    });
+}
+
+void Session::Private::on_relay_read(Socket & input, Socket & output, std::shared_ptr<Buffer> buffer, const ErrorCode & ec, std::size_t length) {
+    if (ec) {
+        this->do_finish(ec);
         return;
-    } catch (ConnectionError & e) {
-        report_error("socks5 connection error", e);
+    }
+    this->do_shaper(input).consume(length);
+    this->last_active = this->wheel->now();
+    auto self = this->kung_fu_death_grip();
+    boost::asio::async_write(output, buffer->buffer(length), [this, self, &input, &output, buffer](const ErrorCode & ec, std::size_t length) -> void {
+        this->on_relay_wrote(input, output, buffer, ec, length);
+    });
+}
+
+void Session::Private::on_relay_wrote(Socket & input, Socket & output, std::shared_ptr<Buffer> buffer, const ErrorCode & ec, std::size_t length) {
+    if (ec) {
+        this->do_finish(ec);
         return;
     }
+    this->do_count_bytes(input, Counter::BYTES_COPIED, length);
+    auto size_class = Buffer::next_class(buffer->size_class(), length);
+    // give the buffer back before going idle
+    buffer.reset();
+    this->do_relay(input, output, size_class);
+}
 
-    namespace ph = std::placeholders;
-    boost::asio::spawn(this->loop, [this](YieldContext yield) -> void {
-        this->do_proxying(yield, this->outer_socket, this->inner_socket);
+// reads keep going while the previous segments are being written, until the
+// queue reaches the high water mark
+void Session::Private::do_overlap_read(Socket & input, Socket & output, std::shared_ptr<RelayQueue> queue) {
+    if (queue->reading || queue->closed || queue->queued >= HIGH_WATER_MARK) {
+        return;
+    }
+    queue->reading = true;
+    auto self = this->kung_fu_death_grip();
+    input.async_wait(Socket::wait_read, [this, self, &input, &output, queue](const ErrorCode & ec) -> void {
+        if (ec) {
+            std::unique_ptr<Buffer> none;
+            this->on_overlap_read(input, output, queue, none, ec, 0);
+            return;
+        }
+        this->do_throttle(input, Buffer::class_size(queue->size_class), [this, self, &input, &output, queue](const ErrorCode & ec, std::size_t allowed) -> void {
+            if (ec) {
+                std::unique_ptr<Buffer> none;
+                this->on_overlap_read(input, output, queue, none, ec, 0);
+                return;
+            }
+            // an idle or throttled direction holds no buffer while it waits
+            auto buffer = std::make_shared<std::unique_ptr<Buffer>>(new Buffer(queue->size_class));
+            input.async_read_some(boost::asio::buffer((*buffer)->buffer(), allowed), [this, self, &input, &output, queue, buffer](const ErrorCode & ec, std::size_t length) -> void {
+                this->on_overlap_read(input, output, queue, *buffer, ec, length);
+            });
+        });
     });
-    boost::asio::spawn(this->loop, [this](YieldContext yield) -> void {
-        this->do_proxying(yield, this->inner_socket, this->outer_socket);
+}
+
+void Session::Private::on_overlap_read(Socket & input, Socket & output, std::shared_ptr<RelayQueue> queue, std::unique_ptr<Buffer> & buffer, const ErrorCode & ec, std::size_t length) {
+    queue->reading = false;
+    if (ec) {
+        // the queued segments still go out before the direction ends
+        queue->closed = true;
+        queue->error = ec;
+        if (!queue->writing) {
+            this->do_finish(ec);
+        }
+        return;
+    }
+    this->do_shaper(input).consume(length);
+    this->last_active = this->wheel->now();
+    queue->size_class = Buffer::next_class(buffer->size_class(), length);
+    queue->segments.emplace_back(std::move(buffer), length);
+    queue->queued += length;
+    this->do_overlap_write(input, output, queue);
+    this->do_overlap_read(input, output, queue);
+}
+
+void Session::Private::do_overlap_write(Socket & input, Socket & output, std::shared_ptr<RelayQueue> queue) {
+    if (queue->writing || queue->segments.empty()) {
+        return;
+    }
+    // everything queued goes out in one gathered write
+    std::vector<boost::asio::const_buffer> buffers;
+    for (auto & segment : queue->segments) {
+        if (buffers.size() >= MAX_GATHER) {
+            break;
+        }
+        buffers.push_back(segment.first->buffer(segment.second));
+    }
+    queue->writing = true;
+    auto self = this->kung_fu_death_grip();
+    auto segments = buffers.size();
+    boost::asio::async_write(output, buffers, [this, self, &input, &output, queue, segments](const ErrorCode & ec, std::size_t length) -> void {
+        this->on_overlap_wrote(input, output, queue, segments, ec, length);
     });
 }
 
-std::size_t Session::Private::do_read(YieldContext yield, Socket & socket, Chunk & chunk) {
-    auto buffer = boost::asio::buffer(chunk);
-    try {
-        auto length = socket.async_read_some(buffer, yield);
-        return length;
-    } catch (boost::system::system_error & e) {
-        if (e.code() == boost::asio::error::eof) {
-            throw EndOfFileError();
-        } else {
-            throw ConnectionError(std::move(e));
+void Session::Private::on_overlap_wrote(Socket & input, Socket & output, std::shared_ptr<RelayQueue> queue, std::size_t segments, const ErrorCode & ec, std::size_t length) {
+    queue->writing = false;
+    if (ec) {
+        this->do_finish(ec);
+        return;
+    }
+    for (std::size_t i = 0; i < segments; ++i) {
+        queue->segments.pop_front();
+    }
+    queue->queued -= length;
+    this->do_count_bytes(input, Counter::BYTES_COPIED, length);
+
+    if (!queue->segments.empty()) {
+        this->do_overlap_write(input, output, queue);
+    } else if (queue->closed) {
+        this->do_finish(queue->error);
+        return;
+    }
+    this->do_overlap_read(input, output, queue);
+}
+
+void Session::Private::do_ring_start() {
+    // the ring holds its own reference to the files, so the sockets must
+    // stay open until the last operation has completed, see Session::stop
+    this->ring_relay = true;
+#ifdef __linux__
+    set_blocking(this->outer_socket, true);
+    set_blocking(this->inner_socket, true);
+#endif
+    this->do_ring_recv(this->outer_socket, this->inner_socket, -1);
+    this->do_ring_recv(this->inner_socket, this->outer_socket, -1);
+}
+
+// the kernel picks a buffer only when data arrives, an idle direction holds
+// none; the buffer of the previous round goes back in the same submission
+void Session::Private::do_ring_recv(Socket & input, Socket & output, int release) {
+    if (release >= 0 && this->do_shaper(input).allowance(1) == 0) {
+        // a throttled direction must not pin a provided buffer
+        this->uring->release(release);
+        release = -1;
+    }
+    auto self = this->kung_fu_death_grip();
+    this->do_throttle(input, std::numeric_limits<std::size_t>::max(), [this, self, &input, &output, release](const ErrorCode & ec, std::size_t allowed) -> void {
+        if (ec) {
+            if (release >= 0) {
+                this->uring->release(release);
+            }
+            this->do_finish(ec);
+            return;
         }
+        this->uring->recv(input.native_handle(), release, allowed, [this, self, &input, &output, allowed](int result, uint32_t flags) -> void {
+            this->on_ring_recv(input, output, allowed, result, flags);
+        });
+    });
+}
+
+void Session::Private::on_ring_recv(Socket & input, Socket & output, std::size_t allowed, int result, uint32_t flags) {
+    if (result == -ENOBUFS) {
+        // every provided buffer is busy, this round borrows one from the pool
+        count(Counter::RING_BUFFER_MISSES);
+        auto self = this->kung_fu_death_grip();
+        auto buffer = std::make_shared<Buffer>(0);
+        this->uring->recv(input.native_handle(), boost::asio::buffer(buffer->buffer(), allowed), [this, self, &input, &output, buffer](int result, uint32_t) -> void {
+            if (result <= 0) {
+                this->do_finish(result == 0 ? boost::asio::error::eof : ErrorCode(-result, boost::system::system_category()));
+                return;
+            }
+            this->do_shaper(input).consume(static_cast<std::size_t>(result));
+            this->last_active = this->wheel->now();
+            this->do_ring_send(input, output, -1, buffer, 0, static_cast<std::size_t>(result));
+        });
+        return;
     }
-    return 0;
+    if (result <= 0) {
+        this->do_finish(result == 0 ? boost::asio::error::eof : ErrorCode(-result, boost::system::system_category()));
+        return;
+    }
+    this->do_shaper(input).consume(static_cast<std::size_t>(result));
+    this->last_active = this->wheel->now();
+    this->do_ring_send(input, output, Uring::buffer_index(flags), nullptr, 0, static_cast<std::size_t>(result));
 }
 
-void Session::Private::do_write(YieldContext yield, Socket & socket, const Chunk & chunk, std::size_t length) {
-    try {
-        std::size_t offset = 0;
-        while (length > 0) {
-            auto buffer = boost::asio::buffer(&chunk[offset], length);
-            auto wrote_length = socket.async_write_some(buffer, yield);
-            offset += wrote_length;
-            length -= wrote_length;
+void Session::Private::do_ring_send(Socket & input, Socket & output, int index, std::shared_ptr<Buffer> buffer, std::size_t offset, std::size_t length) {
+    auto self = this->kung_fu_death_grip();
+    auto callback = [this, self, &input, &output, index, buffer, offset, length](int result, uint32_t) -> void {
+        this->on_ring_sent(input, output, index, buffer, offset, length, result);
+    };
+    if (buffer) {
+        this->uring->send(output.native_handle(), boost::asio::buffer(buffer->data() + offset, length), callback);
+    } else {
+        this->uring->send(output.native_handle(), index, offset, length, callback);
+    }
+}
+
+void Session::Private::on_ring_sent(Socket & input, Socket & output, int index, std::shared_ptr<Buffer> buffer, std::size_t offset, std::size_t length, int result) {
+    if (result < 0) {
+        if (index >= 0) {
+            this->uring->release(index);
         }
-    } catch (boost::system::system_error & e) {
-        throw ConnectionError(std::move(e));
+        this->do_finish(ErrorCode(-result, boost::system::system_category()));
+        return;
     }
+    auto written = static_cast<std::size_t>(result);
+    this->do_count_bytes(input, Counter::BYTES_RING, written);
+    if (written < length) {
+        this->do_ring_send(input, output, index, buffer, offset + written, length - written);
+        return;
+    }
+    this->do_ring_recv(input, output, index);
 }
 
-ResolvedRange Session::Private::do_inner_resolve(YieldContext yield) {
-    Resolver resolver(this->loop);
-    auto host = Application::instance().get_socks5_host();
-    auto port = boost::lexical_cast<std::string>(Application::instance().get_socks5_port());
+// the copy relay, following the HTTP messages on the way; a client leaving
+// between two requests hands the tunnel back to the pool
+void Session::Private::do_http_proxying(YieldContext yield, Socket & input, Socket & output, HttpParser & parser) {
+    auto self = this->kung_fu_death_grip();
+    bool from_upstream = &input == &this->inner_socket;
+    std::size_t size_class = 0;
+    ErrorCode ec;
+    while (true) {
+        input.async_wait(Socket::wait_read, yield[ec]);
+        if (ec) {
+            break;
+        }
+        auto allowed = this->do_throttle(yield, input, Buffer::class_size(size_class), ec);
+        if (ec) {
+            break;
+        }
 
-    try {
-        auto it = resolver.async_resolve({
-            host,
-            port,
-        }, yield);
-        return {it, Resolver::iterator()};
-    } catch (boost::system::system_error & e) {
-        throw ResolutionError(std::move(e));
+        Buffer buffer(size_class);
+        auto length = read_buffer(yield, input, boost::asio::buffer(buffer.buffer(), allowed), ec);
+        if (ec) {
+            break;
+        }
+        this->do_shaper(input).consume(length);
+        this->last_active = this->wheel->now();
+        write_buffer(yield, output, buffer.buffer(length), ec);
+        if (ec) {
+            break;
+        }
+        // only once it is out, a cache hit may write to the client next
+        this->do_http_feed(parser, buffer.data(), length);
+        this->do_count_bytes(input, Counter::BYTES_COPIED, length);
+        size_class = Buffer::next_class(size_class, length);
+
+        if (from_upstream && this->do_http_reusable()) {
+            // the last response is out, the client has gone already
+            this->do_http_release();
+            return;
+        }
     }
 
-    return {Resolver::iterator(), Resolver::iterator()};
+    if (!from_upstream && this->do_http_leave(ec)) {
+        return;
+    }
+    if (from_upstream && ec == boost::asio::error::operation_aborted && this->do_http_reusable()) {
+        this->do_http_release();
+        return;
+    }
+    this->do_finish(ec);
 }
 
-bool Session::Private::do_inner_connect(YieldContext yield, Resolver::iterator it) {
-    if (Resolver::iterator() == it) {
+// the client side with the cache in front: a request is held until it is
+// complete, then answered from the cache or sent on, the first miss connects
+void Session::Private::do_http_serving(YieldContext yield) {
+    auto self = this->kung_fu_death_grip();
+    std::string held;
+    std::size_t size_class = 0;
+    ErrorCode ec;
+    this->do_watch_idle();
+    while (!ec) {
+        this->outer_socket.async_wait(Socket::wait_read, yield[ec]);
+        if (ec) {
+            break;
+        }
+        auto allowed = this->do_throttle(yield, this->outer_socket, Buffer::class_size(size_class), ec);
+        if (ec) {
+            break;
+        }
+
+        Buffer buffer(size_class);
+        auto length = read_buffer(yield, this->outer_socket, boost::asio::buffer(buffer.buffer(), allowed), ec);
+        if (ec) {
+            break;
+        }
+        this->do_shaper(this->outer_socket).consume(length);
+        this->last_active = this->wheel->now();
+        size_class = Buffer::next_class(size_class, length);
+
+        std::size_t offset = 0;
+        while (offset < length && !ec) {
+            auto messages = this->requests.messages();
+            auto used = this->requests.feed_message(buffer.data() + offset, length - offset);
+            held.append(reinterpret_cast<const char *>(buffer.data() + offset), used);
+            offset += used;
+            bool ended = this->requests.messages() != messages;
+
+            if (ended && this->do_http_hit(yield, ec)) {
+                held.clear();
+                if (!ec && !this->requests.reusable()) {
+                    // the client asked to close after this one
+                    this->do_finish(boost::asio::error::eof);
+                    return;
+                }
+                continue;
+            }
+            if (ended || this->requests.opaque() || held.size() >= MAX_HELD_REQUEST) {
+                if (!this->do_http_forward(yield, held, ec)) {
+                    return;
+                }
+                held.clear();
+            }
+        }
+    }
+
+    if (held.empty() && this->do_http_leave(ec)) {
+        return;
+    }
+    this->do_finish(ec);
+}
+
+// answers the request which just ended, if nothing is in front of it
+bool Session::Private::do_http_hit(YieldContext yield, ErrorCode & ec) {
+    if (!this->responses.idle() || this->responses.pending() != 1) {
+        return false;
+    }
+    std::string response;
+    if (!HttpCache::instance().lookup(this->requests.message(), response)) {
         return false;
     }
+    this->responses.retract();
+    this->do_end_handshake();
+    write_buffer(yield, this->outer_socket, boost::asio::buffer(response), ec);
+    return true;
+}
 
-    try {
-        this->inner_socket.async_connect(*it, yield);
-    } catch (boost::system::system_error & e) {
-        this->inner_socket.close();
+// false if the tunnel could not be opened, the session is over then
+bool Session::Private::do_http_forward(YieldContext yield, const std::string & data, ErrorCode & ec) {
+    if (!this->upstream && !this->do_http_connect(yield)) {
         return false;
     }
+    write_buffer(yield, this->inner_socket, boost::asio::buffer(data), ec);
+    if (!ec) {
+        this->do_count_bytes(this->outer_socket, Counter::BYTES_COPIED, data.size());
+    }
+    return true;
+}
+
+bool Session::Private::do_http_connect(YieldContext yield) {
+    auto self = this->kung_fu_death_grip();
+    auto tunnel = this->pool ? this->pool->acquire() : nullptr;
+    if (tunnel) {
+        this->do_inner_adopt(*tunnel);
+    } else if (!this->do_inner_open(yield)) {
+        return false;
+    }
+    this->do_end_handshake();
+    this->do_watch_idle();
 
+    boost::asio::spawn(this->loop, [this, self](YieldContext yield) -> void {
+        this->do_http_proxying(yield, this->inner_socket, this->outer_socket, this->responses);
+    }, coroutine_attributes());
     return true;
 }
 
-void Session::Private::do_inner_socks5(YieldContext yield) {
-    this->do_inner_socks5_phase1(yield);
-    this->do_inner_socks5_phase2(yield);
+// a caching session hands every complete response to the cache
+void Session::Private::do_http_feed(HttpParser & parser, const uint8_t * data, std::size_t length) {
+    if (!this->caching || &parser != &this->responses) {
+        parser.feed(data, length);
+        return;
+    }
+    while (length > 0) {
+        auto messages = parser.messages();
+        auto used = parser.feed_message(data, length);
+        if (parser.messages() != messages) {
+            HttpCache::instance().store(parser.request(), parser.message());
+        }
+        data += used;
+        length -= used;
+    }
 }
 
-void Session::Private::do_inner_socks5_phase1(YieldContext yield) {
-    auto chunk = create_chunk();
-    // VER
-    chunk[0] = 0x05;
-    // NMETHODS
-    chunk[1] = 0x01;
-    // METHODS
-    chunk[2] = 0x00;
+// the client closed between two requests; the target does not see this
+// close, the last responses may still be on their way
+bool Session::Private::do_http_leave(const ErrorCode & ec) {
+    if (ec != boost::asio::error::eof || !this->upstream || !Application::instance().get_http_keep_alive()) {
+        return false;
+    }
+    if (!this->requests.idle() || !this->requests.reusable()) {
+        return false;
+    }
+    this->client_left = true;
+    if (this->do_http_reusable()) {
+        // wakes up the other direction, which hands the tunnel back
+        ErrorCode ignored;
+        this->inner_socket.cancel(ignored);
+        this->download.timer.cancel(ignored);
+    }
+    return true;
+}
 
-    this->do_write(yield, this->inner_socket, chunk, 3);
-    auto length = this->do_read(yield, this->inner_socket, chunk);
+bool Session::Private::do_http_reusable() const {
+    return this->client_left
+        && this->requests.idle() && this->requests.reusable()
+        && this->responses.answered() && this->responses.reusable();
+}
 
-    if (length < 2) {
-        throw Socks5Error("wrong auth header length");
+void Session::Private::do_http_release() {
+    if (this->pool && this->inner_socket.is_open()) {
+        auto tunnel = std::make_shared<Tunnel>(this->loop, this->upstream);
+        tunnel->socket() = std::move(this->inner_socket);
+        this->pool->release(tunnel);
     }
-    if (chunk[1] != 0x00) {
-        throw Socks5Error("provided auth not supported");
+    auto self = this->kung_fu_death_grip();
+    self->stop();
+}
+
+void Session::Private::do_splicing(YieldContext yield, Socket & input, Socket & output) {
+    Pipe pipe;
+    ErrorCode ec;
+    if (!pipe.open(ec)) {
+        report_error("cannot create pipe, fall back to copy", ec, this->do_log_fields("relay"));
+        this->do_proxying(yield, input, output);
+        return;
+    }
+    // splice(2) talks to the descriptors directly, they must not block
+    input.non_blocking(true, ec);
+    output.non_blocking(true, ec);
+
+    while (true) {
+        auto allowed = this->do_throttle(yield, input, pipe.capacity(), ec);
+        if (ec) {
+            break;
+        }
+        auto length = this->do_splice_in(yield, input, pipe, allowed, ec);
+        if (ec) {
+            break;
+        }
+        this->do_shaper(input).consume(length);
+        this->last_active = this->wheel->now();
+        this->do_splice_out(yield, pipe, output, length, ec);
+        if (ec) {
+            break;
+        }
+        this->do_count_bytes(input, Counter::BYTES_SPLICED, length);
     }
+    this->do_finish(ec);
 }
 
-void Session::Private::do_inner_socks5_phase2(YieldContext yield) {
-    auto chunk = create_chunk();
-    // VER
-    chunk[0] = 0x05;
-    // CMD
-    chunk[1] = 0x01;
-    // RSV
-    chunk[2] = 0x00;
-
-    std::size_t used_byte = 0;
-    switch (Application::instance().get_http_host_type()) {
-    case AddressType::IPV4:
-        used_byte = fill_ipv4(chunk, 3);
-        break;
-    case AddressType::IPV6:
-        used_byte = fill_ipv6(chunk, 3);
-        break;
-    case AddressType::FQDN:
-        used_byte = fill_fqdn(chunk, 3);
-        break;
-    default:
-        throw Socks5Error("unknown target http address");
-    }
-
-    // DST.PORT
-    put_big_endian(&chunk[3 + used_byte], Application::instance().get_http_port());
-
-    std::size_t total_length = 3 + used_byte + 2;
-
-    this->do_write(yield, this->inner_socket, chunk, total_length);
-    auto length = this->do_read(yield, this->inner_socket, chunk);
-
-    if (length < 3) {
-        throw Socks5Error("server replied error");
-    }
-    if (chunk[1] != 0x00) {
-        throw Socks5Error("server replied error");
-    }
-    switch (chunk[3]) {
-    case 0x01:
-        break;
-    case 0x03:
-        break;
-    case 0x04:
-        break;
-    default:
-        throw Socks5Error("unknown address type");
+Shaper & Session::Private::do_shaper(const Socket & input) {
+    return &input == &this->outer_socket ? this->upload : this->download;
+}
+
+// the most the next read from input may take, waits while the buckets are
+// empty instead of reading ahead into memory
+std::size_t Session::Private::do_throttle(YieldContext yield, Socket & input, std::size_t wanted, ErrorCode & ec) {
+    auto & shaper = this->do_shaper(input);
+    while (true) {
+        auto allowed = shaper.allowance(wanted);
+        if (allowed > 0) {
+            return allowed;
+        }
+        count(shaper.stalls);
+        shaper.timer.expires_after(shaper.delay());
+        shaper.timer.async_wait(yield[ec]);
+        if (ec) {
+            return 0;
+        }
     }
 }
 
-void Session::Private::do_proxying(YieldContext yield, Socket & input, Socket & output) {
+// bytes read from input, by relay mode and by direction
+void Session::Private::do_count_bytes(const Socket & input, Counter mode, std::size_t length) {
+    if (length == 0) {
+        return;
+    }
+    count(mode, length);
+    if (&input == &this->outer_socket) {
+        count(Counter::BYTES_UPSTREAM, length);
+        return;
+    }
+    count(Counter::BYTES_DOWNSTREAM, length);
+    if (!this->answered) {
+        this->answered = true;
+        observe(Histogram::FIRST_BYTE, std::chrono::steady_clock::now() - this->accepted);
+    }
+}
+
+// a relay direction has ended, closing is the normal way out and is not
+// worth an exception
+void Session::Private::do_finish(const ErrorCode & ec) {
+    // the other direction has already stopped the session
+    if (ec == boost::asio::error::operation_aborted) {
+        return;
+    }
+    if (ec != boost::asio::error::eof) {
+        count(Counter::ERRORS_CONNECTION);
+        report_error("connection error", ec, this->do_log_fields("relay"));
+    }
     auto self = this->kung_fu_death_grip();
-    auto chunk = create_chunk();
-    try {
-        while (true) {
-            auto length = this->do_read(yield, input, chunk);
-            this->do_write(yield, output, chunk, length);
+    self->stop();
+}
+
+RelayQueue::RelayQueue()
+    : segments()
+    , queued(0)
+    , size_class(0)
+    , reading(false)
+    , writing(false)
+    , closed(false)
+    , error()
+{
+}
+
+Shaper::Shaper(IOLoop & loop, std::size_t rate, std::shared_ptr<TokenBucket> global, Counter stalls)
+    : own(rate > 0 ? new TokenBucket(rate) : nullptr)
+    , global(global)
+    , timer(loop)
+    , stalls(stalls)
+{
+}
+
+bool Shaper::limited() const {
+    return this->own || this->global;
+}
+
+std::size_t Shaper::allowance(std::size_t wanted) {
+    if (this->own) {
+        wanted = std::min(wanted, this->own->available());
+    }
+    if (this->global && wanted > 0) {
+        wanted = std::min(wanted, this->global->available());
+    }
+    return wanted;
+}
+
+void Shaper::consume(std::size_t length) {
+    if (this->own) {
+        this->own->consume(length);
+    }
+    if (this->global) {
+        this->global->consume(length);
+    }
+}
+
+TokenBucket::Clock::duration Shaper::delay() const {
+    TokenBucket::Clock::duration delay(0);
+    if (this->own) {
+        delay = this->own->delay();
+    }
+    if (this->global) {
+        delay = std::max(delay, this->global->delay());
+    }
+    return delay;
+}
+
+LogFields Session::Private::do_log_fields(const char * phase) const {
+    return {
+        {"session", std::to_string(this->id)},
+        {"phase", phase},
+    };
+}
+
+std::size_t Session::Private::do_splice_in(YieldContext yield, Socket & socket, Pipe & pipe, std::size_t limit, ErrorCode & ec) {
+#ifdef __linux__
+    // the pipe is always drained before the next read, so EAGAIN means
+    // the socket has nothing for us yet
+    while (true) {
+        auto length = ::splice(socket.native_handle(), nullptr, pipe.write_end(), nullptr,
+                               limit, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (length > 0) {
+            return static_cast<std::size_t>(length);
+        }
+        if (length == 0) {
+            ec = boost::asio::error::eof;
+            return 0;
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            ec.assign(errno, boost::system::system_category());
+            return 0;
+        }
+        socket.async_wait(Socket::wait_read, yield[ec]);
+        if (ec) {
+            return 0;
+        }
+    }
+#else
+    ec = boost::asio::error::operation_not_supported;
+    return 0;
+#endif
+}
+
+void Session::Private::do_splice_out(YieldContext yield, Pipe & pipe, Socket & socket, std::size_t length, ErrorCode & ec) {
+#ifdef __linux__
+    while (length > 0) {
+        auto wrote_length = ::splice(pipe.read_end(), nullptr, socket.native_handle(), nullptr,
+                                     length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (wrote_length > 0) {
+            length -= static_cast<std::size_t>(wrote_length);
+            continue;
+        }
+        if (wrote_length < 0 && errno != EAGAIN && errno != EINTR) {
+            ec.assign(errno, boost::system::system_category());
+            return;
+        }
+        socket.async_wait(Socket::wait_write, yield[ec]);
+        if (ec) {
+            return;
         }
-    } catch (EndOfFileError & e) {
-        self->stop();
-    } catch (ConnectionError & e) {
-        report_error("connection error", e);
     }
+#else
+    ec = boost::asio::error::operation_not_supported;
+#endif
 }
@@ -30,9 +30,14 @@
 
 namespace s5p {
 
+class TunnelPool;
+class TimingWheel;
+class Uring;
+
+
 class Session : public std::enable_shared_from_this<Session> {
 public:
-    Session(Socket socket);
+    Session(Socket socket, std::shared_ptr<TunnelPool> pool, std::shared_ptr<TimingWheel> wheel, std::shared_ptr<Uring> uring);
 
     void start();
     void stop();
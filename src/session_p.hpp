@@ -24,39 +24,138 @@
 #define S5P_SESSION_HPP_
 
 #include "session.hpp"
+#include "buffer.hpp"
+#include "pipe.hpp"
+#include "tunnel.hpp"
+#include "tunnel_pool.hpp"
+#include "timing_wheel.hpp"
+#include "uring.hpp"
+#include "token_bucket.hpp"
+#include "http_parser.hpp"
+#include "http_cache.hpp"
+#include "frontend.hpp"
+#include "metrics.hpp"
 
-#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
 
+#include <deque>
 #include <memory>
 
 
 namespace s5p {
 
-typedef boost::asio::yield_context YieldContext;
-typedef boost::asio::ip::tcp::resolver Resolver;
-typedef std::pair<Resolver::iterator, Resolver::iterator> ResolvedRange;
+/**
+ * Segments read from one side and not written to the other yet, the reading
+ * and the writing end of a direction run at the same time.
+ */
+struct RelayQueue {
+    RelayQueue();
+
+    std::deque<std::pair<std::unique_ptr<Buffer>, std::size_t>> segments;
+    std::size_t queued;
+    std::size_t size_class;
+    bool reading;
+    bool writing;
+    bool closed;
+    ErrorCode error;
+};
+
+
+/**
+ * The buckets one relay direction draws from, its own and the process-wide
+ * one. A direction with neither is never throttled.
+ */
+struct Shaper {
+    Shaper(IOLoop & loop, std::size_t rate, std::shared_ptr<TokenBucket> global, Counter stalls);
+
+    bool limited() const;
+    std::size_t allowance(std::size_t wanted);
+    void consume(std::size_t length);
+    TokenBucket::Clock::duration delay() const;
+
+    std::unique_ptr<TokenBucket> own;
+    std::shared_ptr<TokenBucket> global;
+    boost::asio::steady_timer timer;
+    Counter stalls;
+};
+
 
 class Session::Private {
 public:
-    Private(Socket socket);
+    Private(Socket socket, std::shared_ptr<TunnelPool> pool, std::shared_ptr<TimingWheel> wheel, std::shared_ptr<Uring> uring);
+    ~Private();
 
     std::shared_ptr<Session> kung_fu_death_grip();
 
     void do_start(YieldContext yield);
-    ResolvedRange do_inner_resolve(YieldContext yield);
-    bool do_inner_connect(YieldContext yield, Resolver::iterator it);
-    void do_inner_socks5(YieldContext yield);
-    void do_inner_socks5_phase1(YieldContext yield);
-    void do_inner_socks5_phase2(YieldContext yield);
+    bool do_read_target(YieldContext yield);
+    bool do_inner_open(YieldContext yield);
+    void do_refuse(YieldContext yield, uint8_t reply);
+    void do_inner_adopt(Tunnel & tunnel);
+    void do_end_handshake();
+    void do_watch_idle();
+    void do_arm_phase(std::weak_ptr<Tunnel> tunnel, Counter counter, std::size_t seconds);
+    void do_arm_idle(TimingWheel::Clock::duration timeout);
+    void do_disarm();
+    void on_idle_expired(TimingWheel::Clock::duration timeout);
     void do_proxying(YieldContext yield, Socket & input, Socket & output);
+    void do_relay(Socket & input, Socket & output, std::size_t size_class);
+    void on_relay_readable(Socket & input, Socket & output, std::size_t size_class, const ErrorCode & ec);
+    void on_relay_read(Socket & input, Socket & output, std::shared_ptr<Buffer> buffer, const ErrorCode & ec, std::size_t length);
+    void on_relay_wrote(Socket & input, Socket & output, std::shared_ptr<Buffer> buffer, const ErrorCode & ec, std::size_t length);
+    void do_overlap_read(Socket & input, Socket & output, std::shared_ptr<RelayQueue> queue);
+    void on_overlap_read(Socket & input, Socket & output, std::shared_ptr<RelayQueue> queue, std::unique_ptr<Buffer> & buffer, const ErrorCode & ec, std::size_t length);
+    void do_overlap_write(Socket & input, Socket & output, std::shared_ptr<RelayQueue> queue);
+    void on_overlap_wrote(Socket & input, Socket & output, std::shared_ptr<RelayQueue> queue, std::size_t segments, const ErrorCode & ec, std::size_t length);
+    void do_ring_start();
+    void do_ring_recv(Socket & input, Socket & output, int release);
+    void on_ring_recv(Socket & input, Socket & output, std::size_t allowed, int result, uint32_t flags);
+    void do_ring_send(Socket & input, Socket & output, int index, std::shared_ptr<Buffer> buffer, std::size_t offset, std::size_t length);
+    void on_ring_sent(Socket & input, Socket & output, int index, std::shared_ptr<Buffer> buffer, std::size_t offset, std::size_t length, int result);
+    void do_splicing(YieldContext yield, Socket & input, Socket & output);
+    void do_http_proxying(YieldContext yield, Socket & input, Socket & output, HttpParser & parser);
+    void do_http_serving(YieldContext yield);
+    bool do_http_hit(YieldContext yield, ErrorCode & ec);
+    bool do_http_forward(YieldContext yield, const std::string & data, ErrorCode & ec);
+    bool do_http_connect(YieldContext yield);
+    void do_http_feed(HttpParser & parser, const uint8_t * data, std::size_t length);
+    bool do_http_leave(const ErrorCode & ec);
+    bool do_http_reusable() const;
+    void do_http_release();
+    Shaper & do_shaper(const Socket & input);
+    std::size_t do_throttle(YieldContext yield, Socket & input, std::size_t wanted, ErrorCode & ec);
+    template<typename Handler>
+    void do_throttle(Socket & input, std::size_t wanted, Handler handler);
 
-    void do_write(YieldContext yield, Socket & socket, const Chunk & chunk, std::size_t length);
-    std::size_t do_read(YieldContext yield, Socket & socket, Chunk & chunk);
+    std::size_t do_splice_in(YieldContext yield, Socket & socket, Pipe & pipe, std::size_t limit, ErrorCode & ec);
+    void do_splice_out(YieldContext yield, Pipe & pipe, Socket & socket, std::size_t length, ErrorCode & ec);
+    void do_count_bytes(const Socket & input, Counter mode, std::size_t length);
+    void do_finish(const ErrorCode & ec);
+    LogFields do_log_fields(const char * phase) const;
 
     std::weak_ptr<Session> self;
+    uint64_t id;
     Socket outer_socket;
     IOLoop & loop;
     Socket inner_socket;
+    std::shared_ptr<TunnelPool> pool;
+    std::shared_ptr<Upstream> upstream;
+    std::shared_ptr<TimingWheel> wheel;
+    std::shared_ptr<Uring> uring;
+    bool ring_relay;
+    Shaper upload;
+    Shaper download;
+    TimeoutHandle timeout;
+    bool timed_out;
+    TimingWheel::Clock::time_point last_active;
+    std::chrono::steady_clock::time_point accepted;
+    bool answered;
+    bool handshaking;
+    HttpParser responses;
+    HttpParser requests;
+    bool client_left;
+    bool caching;
+    std::unique_ptr<Frontend> frontend;
 };
 
 }
@@ -0,0 +1,177 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "socket_options.hpp"
+
+#include <boost/asio/detail/socket_option.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <fstream>
+#include <mutex>
+
+#include <netinet/tcp.h>
+
+
+namespace {
+
+#ifdef TCP_NOTSENT_LOWAT
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_NOTSENT_LOWAT> NotSentLowWater;
+#endif
+#ifdef TCP_KEEPIDLE
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE> KeepIdle;
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPINTVL> KeepInterval;
+#endif
+#ifdef TCP_FASTOPEN
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN> FastOpen;
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+typedef boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN_CONNECT> FastOpenConnect;
+#endif
+
+template<typename S, typename O>
+void set_option(S & socket, const O & option, const char * name) {
+    s5p::ErrorCode ec;
+    socket.set_option(option, ec);
+    if (ec) {
+        s5p::report_error("cannot set socket option", ec, {
+            {"option", name},
+        });
+    }
+}
+
+template<typename S, typename O>
+std::string get_option(S & socket) {
+    s5p::ErrorCode ec;
+    O option;
+    socket.get_option(option, ec);
+    if (ec) {
+        return "unsupported";
+    }
+    return boost::lexical_cast<std::string>(option.value());
+}
+
+int read_somaxconn() {
+    std::ifstream fin("/proc/sys/net/core/somaxconn");
+    int value = 0;
+    if (!(fin >> value)) {
+        return 0;
+    }
+    return value;
+}
+
+}
+
+
+namespace s5p {
+
+void tune_listener(Acceptor & acceptor) {
+    auto & application = Application::instance();
+    // accepted sockets inherit it, and the window scale is fixed by the SYN
+    if (application.get_receive_buffer() > 0) {
+        set_option(acceptor, Socket::receive_buffer_size(static_cast<int>(application.get_receive_buffer())), "SO_RCVBUF");
+    }
+#ifdef TCP_FASTOPEN
+    if (application.get_fast_open() > 0) {
+        set_option(acceptor, FastOpen(static_cast<int>(application.get_fast_open())), "TCP_FASTOPEN");
+    }
+#endif
+}
+
+void tune_client(Socket & socket) {
+    auto & application = Application::instance();
+    if (application.get_no_delay()) {
+        set_option(socket, boost::asio::ip::tcp::no_delay(true), "TCP_NODELAY");
+    }
+    if (application.get_send_buffer() > 0) {
+        set_option(socket, Socket::send_buffer_size(static_cast<int>(application.get_send_buffer())), "SO_SNDBUF");
+    }
+    if (application.get_receive_buffer() > 0) {
+        set_option(socket, Socket::receive_buffer_size(static_cast<int>(application.get_receive_buffer())), "SO_RCVBUF");
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    if (application.get_not_sent_low_water() > 0) {
+        set_option(socket, NotSentLowWater(static_cast<int>(application.get_not_sent_low_water())), "TCP_NOTSENT_LOWAT");
+    }
+#endif
+    if (application.get_keepalive() > 0) {
+        set_option(socket, Socket::keep_alive(true), "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+        auto idle = static_cast<int>(application.get_keepalive());
+        set_option(socket, KeepIdle(idle), "TCP_KEEPIDLE");
+        set_option(socket, KeepInterval(std::max(1, idle / 3)), "TCP_KEEPINTVL");
+#endif
+    }
+}
+
+void tune_upstream(Socket & socket) {
+    tune_client(socket);
+#ifdef TCP_FASTOPEN_CONNECT
+    // connect() returns at once, the SYN leaves with the first write
+    if (Application::instance().get_fast_open() > 0) {
+        set_option(socket, FastOpenConnect(true), "TCP_FASTOPEN_CONNECT");
+    }
+#endif
+}
+
+int listen_backlog() {
+    auto backlog = Application::instance().get_backlog();
+    auto somaxconn = read_somaxconn();
+    return somaxconn > 0 ? std::min(backlog, somaxconn) : backlog;
+}
+
+// reads back what the kernel made of the options, once per process
+void report_socket_options(Acceptor & acceptor) {
+    static std::once_flag once;
+    std::call_once(once, [&acceptor]() -> void {
+        LogFields fields = {
+            {"backlog", boost::lexical_cast<std::string>(listen_backlog())},
+            {"listener_rcvbuf", get_option<Acceptor, Socket::receive_buffer_size>(acceptor)},
+        };
+#ifdef TCP_FASTOPEN
+        fields.emplace_back("listener_fastopen", get_option<Acceptor, FastOpen>(acceptor));
+#endif
+
+        // a socket tuned like the real ones, which are not there yet
+        ErrorCode ec;
+        Socket probe(acceptor.get_executor());
+        probe.open(acceptor.local_endpoint().protocol(), ec);
+        if (!ec) {
+            tune_upstream(probe);
+            fields.emplace_back("nodelay", get_option<Socket, boost::asio::ip::tcp::no_delay>(probe));
+            fields.emplace_back("sndbuf", get_option<Socket, Socket::send_buffer_size>(probe));
+            fields.emplace_back("rcvbuf", get_option<Socket, Socket::receive_buffer_size>(probe));
+#ifdef TCP_NOTSENT_LOWAT
+            fields.emplace_back("notsent_lowat", get_option<Socket, NotSentLowWater>(probe));
+#endif
+            fields.emplace_back("keepalive", get_option<Socket, Socket::keep_alive>(probe));
+#ifdef TCP_KEEPIDLE
+            fields.emplace_back("keepidle", get_option<Socket, KeepIdle>(probe));
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+            fields.emplace_back("fastopen_connect", get_option<Socket, FastOpenConnect>(probe));
+#endif
+        }
+        report_info("socket options", fields);
+    });
+}
+
+}
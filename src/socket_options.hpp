@@ -0,0 +1,46 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_SOCKET_OPTIONS_HPP
+#define S5P_SOCKET_OPTIONS_HPP
+
+#include "global.hpp"
+
+
+namespace s5p {
+
+/**
+ * Applies the socket options from the command line.
+ *
+ * A failure is logged and otherwise ignored, the kernel defaults still work.
+ * Client sockets are tuned when accepted, upstream sockets before they
+ * connect, listeners before they listen.
+ */
+void tune_listener(Acceptor & acceptor);
+void tune_client(Socket & socket);
+void tune_upstream(Socket & socket);
+int listen_backlog();
+void report_socket_options(Acceptor & acceptor);
+
+}
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "timing_wheel_p.hpp"
+
+#include <algorithm>
+
+
+using s5p::TimingWheel;
+using s5p::TimeoutHandle;
+using s5p::TimeoutEntry;
+using s5p::ErrorCode;
+
+
+namespace {
+
+// with a 100 ms tick one round covers 102 seconds, longer timeouts wait
+// for more rounds in the same slot
+const std::size_t SLOTS = 1024;
+
+}
+
+
+TimingWheel::TimingWheel(IOLoop & loop, Clock::duration tick)
+    : _(std::make_shared<Private>(loop, tick))
+{
+}
+
+TimeoutHandle TimingWheel::schedule(Clock::duration timeout, Callback callback) {
+    if (!_->running) {
+        _->running = true;
+        _->now = Clock::now();
+        _->do_tick();
+    }
+
+    // count from the last tick and round up, a timeout never fires early
+    auto delay = Clock::now() - _->now + timeout;
+    auto ticks = static_cast<std::size_t>((delay + _->tick - Clock::duration(1)) / _->tick);
+    ticks = std::max<std::size_t>(ticks, 1);
+
+    auto entry = std::make_shared<TimeoutEntry>();
+    entry->rounds = (ticks - 1) / SLOTS;
+    entry->callback = std::move(callback);
+    _->slots[(_->cursor + ticks) % SLOTS].push_back(entry);
+    ++_->pending;
+    return entry;
+}
+
+void TimingWheel::cancel(const TimeoutHandle & handle) {
+    if (!handle) {
+        return;
+    }
+    // the slot drops it on its next tick, but whatever the callback holds
+    // is released right now
+    handle->callback = nullptr;
+}
+
+TimingWheel::Clock::time_point TimingWheel::now() const {
+    return _->running ? _->now : Clock::now();
+}
+
+TimingWheel::Private::Private(IOLoop & loop, Clock::duration tick)
+    : enable_shared_from_this()
+    , timer(loop)
+    , tick(tick)
+    , now()
+    , slots(SLOTS)
+    , cursor(0)
+    , pending(0)
+    , running(false)
+{
+}
+
+void TimingWheel::Private::do_tick() {
+    namespace ph = std::placeholders;
+    this->timer.expires_at(this->now + this->tick);
+    this->timer.async_wait(std::bind(&TimingWheel::Private::on_tick, this->shared_from_this(), ph::_1));
+}
+
+void TimingWheel::Private::on_tick(const ErrorCode & ec) {
+    if (ec) {
+        return;
+    }
+
+    // catch up when the loop was too busy to wake us on time
+    auto current = Clock::now();
+    while (this->now + this->tick <= current) {
+        this->now += this->tick;
+        this->cursor = (this->cursor + 1) % SLOTS;
+
+        std::vector<TimeoutHandle> expired;
+        auto & slot = this->slots[this->cursor];
+        for (std::size_t i = 0; i < slot.size();) {
+            auto & entry = slot[i];
+            if (entry->callback && entry->rounds > 0) {
+                --entry->rounds;
+                ++i;
+                continue;
+            }
+            if (entry->callback) {
+                expired.push_back(entry);
+            }
+            --this->pending;
+            // order within a slot does not matter, the last one moves into i
+            std::swap(entry, slot.back());
+            slot.pop_back();
+        }
+
+        // a callback may schedule again, so run them after the slot is done
+        for (auto & entry : expired) {
+            auto callback = std::move(entry->callback);
+            entry->callback = nullptr;
+            if (callback) {
+                callback();
+            }
+        }
+    }
+
+    if (this->pending == 0) {
+        // nothing to watch, stop waking up
+        this->running = false;
+        return;
+    }
+    this->do_tick();
+}
@@ -0,0 +1,68 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_TIMING_WHEEL_HPP
+#define S5P_TIMING_WHEEL_HPP
+
+#include "global.hpp"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+
+
+namespace s5p {
+
+struct TimeoutEntry;
+typedef std::shared_ptr<TimeoutEntry> TimeoutHandle;
+
+
+/**
+ * A hashed timing wheel, one steady_timer drives every timeout of a shard.
+ *
+ * Scheduling and cancelling are O(1). Timeouts fire on the tick after they
+ * expire, so the resolution is one tick.
+ */
+class TimingWheel {
+public:
+    typedef std::chrono::steady_clock Clock;
+    typedef std::function<void ()> Callback;
+
+    TimingWheel(IOLoop & loop, Clock::duration tick);
+
+    TimeoutHandle schedule(Clock::duration timeout, Callback callback);
+    void cancel(const TimeoutHandle & handle);
+    Clock::time_point now() const;
+
+private:
+    TimingWheel(const TimingWheel &);
+    TimingWheel & operator = (const TimingWheel &);
+    TimingWheel(TimingWheel &&);
+    TimingWheel & operator = (TimingWheel &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
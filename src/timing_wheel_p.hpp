@@ -0,0 +1,57 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_TIMING_WHEEL_HPP_
+#define S5P_TIMING_WHEEL_HPP_
+
+#include "timing_wheel.hpp"
+
+#include <vector>
+
+
+namespace s5p {
+
+struct TimeoutEntry {
+    std::size_t rounds;
+    TimingWheel::Callback callback;
+};
+
+
+class TimingWheel::Private : public std::enable_shared_from_this<TimingWheel::Private> {
+public:
+    Private(IOLoop & loop, Clock::duration tick);
+
+    void do_tick();
+    void on_tick(const ErrorCode & ec);
+
+    SteadyTimer timer;
+    Clock::duration tick;
+    Clock::time_point now;
+    std::vector<std::vector<TimeoutHandle>> slots;
+    std::size_t cursor;
+    std::size_t pending;
+    bool running;
+};
+
+}
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "token_bucket_p.hpp"
+#include "global.hpp"
+
+#include <algorithm>
+
+
+using s5p::TokenBucket;
+
+
+namespace {
+
+// a full bucket lasts this long, or holds one large read if that is more
+const int64_t BURST_MS = 100;
+const int64_t MIN_BURST = 64 * 1024;
+// a stalled reader waits for this share of a second or for MIN_QUANTUM
+const int64_t QUANTUM_DIVISOR = 50;
+const int64_t MIN_QUANTUM = 4 * 1024;
+
+int64_t nanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(TokenBucket::Clock::now().time_since_epoch()).count();
+}
+
+std::shared_ptr<TokenBucket> create_bucket(std::size_t rate) {
+    if (rate == 0) {
+        return nullptr;
+    }
+    return std::make_shared<TokenBucket>(rate);
+}
+
+}
+
+
+std::shared_ptr<TokenBucket> TokenBucket::upload() {
+    static auto bucket = create_bucket(Application::instance().get_upload_rate());
+    return bucket;
+}
+
+std::shared_ptr<TokenBucket> TokenBucket::download() {
+    static auto bucket = create_bucket(Application::instance().get_download_rate());
+    return bucket;
+}
+
+TokenBucket::TokenBucket(std::size_t rate)
+    : _(std::make_shared<Private>(rate))
+{
+}
+
+std::size_t TokenBucket::available() {
+    _->do_refill();
+    auto tokens = _->tokens.load(std::memory_order_relaxed);
+    return tokens > 0 ? static_cast<std::size_t>(tokens) : 0;
+}
+
+void TokenBucket::consume(std::size_t length) {
+    _->tokens.fetch_sub(static_cast<int64_t>(length), std::memory_order_relaxed);
+}
+
+// how long until the bucket holds enough for a worthwhile read
+TokenBucket::Clock::duration TokenBucket::delay() const {
+    auto quantum = std::min(_->burst, std::max(_->rate / QUANTUM_DIVISOR, MIN_QUANTUM));
+    auto missing = quantum - _->tokens.load(std::memory_order_relaxed);
+    if (missing <= 0) {
+        return std::chrono::milliseconds(1);
+    }
+    return std::max<Clock::duration>(std::chrono::milliseconds(1),
+                                     std::chrono::nanoseconds(missing * 1000000000 / _->rate));
+}
+
+TokenBucket::Private::Private(std::size_t rate)
+    : rate(static_cast<int64_t>(rate))
+    , burst(std::max(this->rate * BURST_MS / 1000, MIN_BURST))
+    , tokens(this->burst)
+    , stamp(nanoseconds())
+{
+}
+
+void TokenBucket::Private::do_refill() {
+    auto now = nanoseconds();
+    auto last = this->stamp.load(std::memory_order_relaxed);
+    auto elapsed = now - last;
+    if (elapsed < 1000000) {
+        return;
+    }
+    // a full bucket needs no more than this, and the product cannot overflow
+    auto full = this->burst * 1000000000 / this->rate + 1;
+    int64_t added = this->burst;
+    auto next = now;
+    if (elapsed < full) {
+        added = elapsed * this->rate / 1000000000;
+        // the remainder is kept for the next refill
+        next = last + added * 1000000000 / this->rate;
+    }
+    if (added == 0) {
+        return;
+    }
+    // whoever wins the stamp does the refill
+    if (!this->stamp.compare_exchange_strong(last, next, std::memory_order_relaxed)) {
+        return;
+    }
+    auto tokens = this->tokens.load(std::memory_order_relaxed);
+    while (!this->tokens.compare_exchange_weak(tokens, std::min(this->burst, tokens + added), std::memory_order_relaxed)) {
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_TOKEN_BUCKET_HPP
+#define S5P_TOKEN_BUCKET_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+
+
+namespace s5p {
+
+/**
+ * A token bucket counted in bytes, safe to share between threads.
+ *
+ * Readers look at what is available, read no more than that and pay for what
+ * they have read afterwards, so the bucket may briefly go into debt and the
+ * next reader waits until it is paid back. Tokens are refilled by the readers
+ * themselves, at most once per millisecond.
+ */
+class TokenBucket {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // the process-wide buckets, null if there is no limit
+    static std::shared_ptr<TokenBucket> upload();
+    static std::shared_ptr<TokenBucket> download();
+
+    explicit TokenBucket(std::size_t rate);
+
+    std::size_t available();
+    void consume(std::size_t length);
+    Clock::duration delay() const;
+
+private:
+    TokenBucket(const TokenBucket &);
+    TokenBucket & operator = (const TokenBucket &);
+    TokenBucket(TokenBucket &&);
+    TokenBucket & operator = (TokenBucket &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,536 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "tunnel_p.hpp"
+
+#include "exception.hpp"
+#include "metrics.hpp"
+#include "socket_options.hpp"
+
+#include <boost/asio/write.hpp>
+
+#include <algorithm>
+
+
+namespace {
+
+std::size_t fill_ipv4(s5p::Chunk & buffer, std::size_t offset, const s5p::AddressV4 & address) {
+    // ATYP
+    buffer[offset++] = 0x01;
+
+    // DST.ADDR
+    auto bytes = address.to_bytes();
+    std::copy_n(std::begin(bytes), bytes.size(), std::next(std::begin(buffer), offset));
+
+    return 1 + bytes.size();
+}
+
+std::size_t fill_ipv6(s5p::Chunk & buffer, std::size_t offset, const s5p::AddressV6 & address) {
+    // ATYP
+    buffer[offset++] = 0x04;
+
+    // DST.ADDR
+    auto bytes = address.to_bytes();
+    std::copy_n(std::begin(bytes), bytes.size(), std::next(std::begin(buffer), offset));
+
+    return 1 + bytes.size();
+}
+
+std::size_t fill_fqdn(s5p::Chunk & buffer, std::size_t offset, const std::string & hostname) {
+    // ATYP
+    buffer[offset++] = 0x03;
+
+    // DST.ADDR
+    buffer[offset++] = static_cast<uint8_t>(hostname.size());
+    std::copy(std::begin(hostname), std::end(hostname), std::next(std::begin(buffer), offset));
+
+    return 1 + 1 + hostname.size();
+}
+
+// alternate address families, starting with the one the resolver prefers
+s5p::EndPointList interleave_families(const s5p::EndPointList & endpoints) {
+    if (endpoints.empty()) {
+        return endpoints;
+    }
+
+    auto preferred = endpoints.front().protocol();
+    s5p::EndPointList first;
+    s5p::EndPointList second;
+    for (auto & endpoint : endpoints) {
+        if (endpoint.protocol() == preferred) {
+            first.push_back(endpoint);
+        } else {
+            second.push_back(endpoint);
+        }
+    }
+
+    s5p::EndPointList rv;
+    for (std::size_t i = 0; i < std::max(first.size(), second.size()); ++i) {
+        if (i < first.size()) {
+            rv.push_back(first[i]);
+        }
+        if (i < second.size()) {
+            rv.push_back(second[i]);
+        }
+    }
+    return rv;
+}
+
+// the server reached, the target did not answer
+bool is_target_failure(uint8_t reply) {
+    // network unreachable, host unreachable, connection refused, TTL expired
+    return reply == 0x03 || reply == 0x04 || reply == 0x05 || reply == 0x06;
+}
+
+}
+
+
+using s5p::Tunnel;
+using s5p::ConnectRace;
+using s5p::Upstream;
+using s5p::Socket;
+using s5p::Chunk;
+using s5p::EndPointList;
+using s5p::YieldContext;
+using s5p::Histogram;
+using s5p::EndPoint;
+using s5p::Socks5Command;
+using s5p::Socks5Error;
+using s5p::Target;
+
+
+namespace s5p {
+
+std::size_t fill_target(Chunk & chunk, std::size_t offset, const Target & target) {
+    std::size_t used_byte = 0;
+    switch (target.type) {
+    case AddressType::IPV4:
+        used_byte = fill_ipv4(chunk, offset, target.ipv4);
+        break;
+    case AddressType::IPV6:
+        used_byte = fill_ipv6(chunk, offset, target.ipv6);
+        break;
+    case AddressType::FQDN:
+        used_byte = fill_fqdn(chunk, offset, target.fqdn);
+        break;
+    default:
+        throw Socks5Error("unknown target http address");
+    }
+
+    // DST.PORT
+    put_big_endian(&chunk[offset + used_byte], target.port);
+
+    return used_byte + 2;
+}
+
+}
+
+
+Tunnel::Tunnel(IOLoop & loop, std::shared_ptr<Upstream> upstream)
+    : _(std::make_shared<Tunnel::Private>(loop, upstream))
+{
+}
+
+Socket & Tunnel::socket() {
+    return _->socket;
+}
+
+std::shared_ptr<Upstream> Tunnel::upstream() const {
+    return _->upstream;
+}
+
+// BND.ADDR and BND.PORT of the reply, where a UDP relay takes datagrams
+const EndPoint & Tunnel::bound() const {
+    return _->bound;
+}
+
+void Tunnel::set_command(Socks5Command command) {
+    _->command = command;
+}
+
+// the HTTP target unless a client asked for another one
+void Tunnel::set_target(const Target & target) {
+    _->target = target;
+}
+
+bool Tunnel::connect(YieldContext yield) {
+    _->started = std::chrono::steady_clock::now();
+
+    bool ok = false;
+    try {
+        auto endpoints = _->do_resolve(yield);
+        auto resolved = std::chrono::steady_clock::now();
+        observe(Histogram::RESOLVE, resolved - _->started);
+        ok = _->do_connect(yield, interleave_families(endpoints));
+        if (ok) {
+            observe(Histogram::CONNECT, std::chrono::steady_clock::now() - resolved);
+        }
+    } catch (ResolutionError &) {
+        _->upstream->report_failure();
+        throw;
+    }
+    if (!ok) {
+        _->upstream->report_failure();
+    }
+    return ok;
+}
+
+bool Tunnel::handshake(YieldContext yield, ErrorCode & ec) {
+    bool ok = false;
+    try {
+        if (Application::instance().get_pipelined_handshake()) {
+            ok = _->do_socks5_pipelined(yield, ec);
+        } else {
+            ok = _->do_socks5_phase1(yield, ec) && _->do_socks5_phase2(yield, ec);
+        }
+    } catch (Socks5Error & e) {
+        // an unreachable target says nothing about the server
+        if (is_target_failure(e.reply())) {
+            _->upstream->report_success(std::chrono::steady_clock::now() - _->started);
+        } else {
+            _->upstream->report_failure();
+        }
+        throw;
+    }
+    if (!ok) {
+        _->upstream->report_failure();
+        return false;
+    }
+    _->upstream->report_success(std::chrono::steady_clock::now() - _->started);
+    return true;
+}
+
+// method selection only, for a server which has no target to CONNECT to
+bool Tunnel::greet(YieldContext yield, ErrorCode & ec) {
+    bool ok = false;
+    try {
+        ok = _->do_socks5_phase1(yield, ec);
+    } catch (Socks5Error &) {
+        _->upstream->report_failure();
+        throw;
+    }
+    if (!ok) {
+        _->upstream->report_failure();
+        return false;
+    }
+    _->upstream->report_success(std::chrono::steady_clock::now() - _->started);
+    return true;
+}
+
+// aborts whatever connect or handshake is in flight, they fail with
+// operation_aborted
+void Tunnel::cancel() {
+    _->cancelled = true;
+    ErrorCode ignored;
+    _->socket.close(ignored);
+    auto race = _->race.lock();
+    if (race) {
+        for (auto & socket : race->sockets) {
+            socket->close(ignored);
+        }
+        race->timer.cancel();
+    }
+}
+
+void Tunnel::set_early_data(const Chunk & chunk, std::size_t length) {
+    _->early.assign(std::begin(chunk), std::next(std::begin(chunk), length));
+}
+
+std::size_t Tunnel::read_leftover(Chunk & chunk) {
+    auto length = std::min(_->leftover.size(), chunk.size());
+    std::copy_n(std::begin(_->leftover), length, std::begin(chunk));
+    _->leftover.clear();
+    return length;
+}
+
+ConnectRace::ConnectRace(IOLoop & loop)
+    : timer(loop)
+    , sockets()
+    , running(0)
+    , failed(false)
+    , winner()
+{
+}
+
+Tunnel::Private::Private(IOLoop & loop, std::shared_ptr<Upstream> upstream)
+    : loop(loop)
+    , socket(loop)
+    , upstream(upstream)
+    , command(Socks5Command::CONNECT)
+    , target(Application::instance().get_http_target())
+    , bound()
+    , started()
+    , early()
+    , leftover()
+    , race()
+    , cancelled(false)
+{
+}
+
+EndPointList Tunnel::Private::do_resolve(YieldContext yield) {
+    return ResolverCache::instance().resolve(yield, this->loop, this->upstream->host(), this->upstream->port());
+}
+
+bool Tunnel::Private::do_connect(YieldContext yield, const EndPointList & endpoints) {
+    // Happy Eyeballs (RFC 8305): start the next attempt when the previous
+    // one failed or has been pending for the attempt delay, and take the
+    // first one which succeeds
+    auto delay = std::chrono::milliseconds(Application::instance().get_connect_delay());
+    auto race = std::make_shared<ConnectRace>(this->loop);
+    auto next = endpoints.begin();
+    this->race = race;
+
+    while (!this->cancelled && !race->winner && (race->running > 0 || next != endpoints.end())) {
+        if (next != endpoints.end()) {
+            this->do_attempt(race, *next++);
+            race->timer.expires_after(delay);
+        } else {
+            race->timer.expires_at(SteadyTimer::time_point::max());
+        }
+
+        // attempts cancel the timer when they finish
+        race->failed = false;
+        ErrorCode ec;
+        race->timer.async_wait(yield[ec]);
+        while (!this->cancelled && !race->winner && !race->failed && ec == boost::asio::error::operation_aborted) {
+            race->timer.async_wait(yield[ec]);
+        }
+    }
+
+    for (auto & socket : race->sockets) {
+        if (socket != race->winner) {
+            ErrorCode ignored;
+            socket->close(ignored);
+        }
+    }
+    if (this->cancelled || !race->winner) {
+        return false;
+    }
+
+    this->socket = std::move(*race->winner);
+    return true;
+}
+
+void Tunnel::Private::do_attempt(std::shared_ptr<ConnectRace> race, const EndPoint & endpoint) {
+    auto socket = std::make_shared<Socket>(this->loop);
+    race->sockets.push_back(socket);
+    ++race->running;
+
+    // buffer sizes must be in place before the SYN goes out
+    ErrorCode ec;
+    socket->open(endpoint.protocol(), ec);
+    if (!ec) {
+        tune_upstream(*socket);
+    }
+
+    socket->async_connect(endpoint, [race, socket](const ErrorCode & ec) -> void {
+        --race->running;
+        if (race->winner) {
+            return;
+        }
+        if (ec) {
+            race->failed = true;
+        } else {
+            race->winner = socket;
+        }
+        race->timer.cancel();
+    });
+}
+
+bool Tunnel::Private::do_socks5_phase1(YieldContext yield, ErrorCode & ec) {
+    auto begin = std::chrono::steady_clock::now();
+    auto chunk = create_chunk();
+    auto total_length = this->do_fill_greeting(chunk, 0);
+
+    write_chunk(yield, this->socket, chunk, total_length, ec);
+    if (ec) {
+        return false;
+    }
+    auto length = read_chunk(yield, this->socket, chunk, ec);
+    if (ec) {
+        return false;
+    }
+
+    this->do_check_greeting_reply(chunk, 0, length);
+    observe(Histogram::PHASE1, std::chrono::steady_clock::now() - begin);
+    return true;
+}
+
+bool Tunnel::Private::do_socks5_phase2(YieldContext yield, ErrorCode & ec) {
+    auto begin = std::chrono::steady_clock::now();
+    auto chunk = create_chunk();
+    auto total_length = this->do_fill_request(chunk, 0);
+
+    write_chunk(yield, this->socket, chunk, total_length, ec);
+    if (ec) {
+        return false;
+    }
+    auto length = read_chunk(yield, this->socket, chunk, ec);
+    if (ec) {
+        return false;
+    }
+
+    if (length < 4) {
+        throw Socks5Error("server replied error");
+    }
+    this->do_check_request_reply(chunk, 0, length);
+    observe(Histogram::PHASE2, std::chrono::steady_clock::now() - begin);
+    return true;
+}
+
+bool Tunnel::Private::do_socks5_pipelined(YieldContext yield, ErrorCode & ec) {
+    // only "no auth" is offered, so the CONNECT request can follow the
+    // greeting without waiting for the method selection
+    auto begin = std::chrono::steady_clock::now();
+    auto chunk = create_chunk();
+    auto total_length = this->do_fill_greeting(chunk, 0);
+    total_length += this->do_fill_request(chunk, total_length);
+
+    std::array<boost::asio::const_buffer, 2> buffers = {
+        boost::asio::buffer(chunk, total_length),
+        boost::asio::buffer(this->early),
+    };
+    boost::asio::async_write(this->socket, buffers, yield[ec]);
+    if (ec) {
+        return false;
+    }
+    this->early.clear();
+
+    // both replies may arrive in one segment, possibly followed by the
+    // response to the early data, so consume them byte exact
+    auto length = this->do_read_at_least(yield, chunk, 0, 2, ec);
+    if (ec) {
+        return false;
+    }
+    this->do_check_greeting_reply(chunk, 0, length);
+    // both phases share one round trip, phase 2 is what is left of it
+    auto greeted = std::chrono::steady_clock::now();
+    observe(Histogram::PHASE1, greeted - begin);
+
+    length = this->do_read_at_least(yield, chunk, length, 2 + 5, ec);
+    if (ec) {
+        return false;
+    }
+    std::size_t reply_length = 2 + 4;
+    switch (chunk[2 + 3]) {
+    case 0x01:
+        reply_length += 4;
+        break;
+    case 0x03:
+        reply_length += 1 + chunk[2 + 4];
+        break;
+    case 0x04:
+        reply_length += 16;
+        break;
+    default:
+        break;
+    }
+    // BND.PORT
+    reply_length += 2;
+    length = this->do_read_at_least(yield, chunk, length, reply_length, ec);
+    if (ec) {
+        return false;
+    }
+    this->do_check_request_reply(chunk, 2, length);
+
+    this->leftover.assign(std::next(std::begin(chunk), reply_length), std::next(std::begin(chunk), length));
+    observe(Histogram::PHASE2, std::chrono::steady_clock::now() - greeted);
+    return true;
+}
+
+std::size_t Tunnel::Private::do_read_at_least(YieldContext yield, Chunk & chunk, std::size_t offset, std::size_t minimum, ErrorCode & ec) {
+    while (offset < minimum) {
+        auto buffer = boost::asio::buffer(&chunk[offset], chunk.size() - offset);
+        offset += this->socket.async_read_some(buffer, yield[ec]);
+        if (ec) {
+            break;
+        }
+    }
+    return offset;
+}
+
+std::size_t Tunnel::Private::do_fill_greeting(Chunk & chunk, std::size_t offset) {
+    // VER
+    chunk[offset + 0] = 0x05;
+    // NMETHODS
+    chunk[offset + 1] = 0x01;
+    // METHODS
+    chunk[offset + 2] = 0x00;
+
+    return 3;
+}
+
+std::size_t Tunnel::Private::do_fill_request(Chunk & chunk, std::size_t offset) {
+    // VER
+    chunk[offset + 0] = 0x05;
+    // CMD
+    chunk[offset + 1] = this->command == Socks5Command::UDP_ASSOCIATE ? 0x03 : 0x01;
+    // RSV
+    chunk[offset + 2] = 0x00;
+
+    if (this->command == Socks5Command::UDP_ASSOCIATE) {
+        // the datagrams will come from an address the proxy does not know
+        // yet, all zeros lets the server take any
+        chunk[offset + 3] = 0x01;
+        std::fill_n(std::next(std::begin(chunk), offset + 4), 4 + 2, 0x00);
+        return 3 + 1 + 4 + 2;
+    }
+
+    return 3 + fill_target(chunk, offset + 3, this->target);
+}
+
+void Tunnel::Private::do_check_greeting_reply(const Chunk & chunk, std::size_t offset, std::size_t length) {
+    if (length < offset + 2) {
+        throw Socks5Error("wrong auth header length");
+    }
+    if (chunk[offset + 1] != 0x00) {
+        throw Socks5Error("provided auth not supported");
+    }
+}
+
+void Tunnel::Private::do_check_request_reply(const Chunk & chunk, std::size_t offset, std::size_t length) {
+    if (chunk[offset + 1] != 0x00) {
+        throw Socks5Error("server replied error", chunk[offset + 1]);
+    }
+    auto address = std::next(std::begin(chunk), offset + 4);
+    switch (chunk[offset + 3]) {
+    case 0x01:
+        if (length >= offset + 4 + 4 + 2) {
+            AddressV4::bytes_type bytes;
+            std::copy_n(address, bytes.size(), std::begin(bytes));
+            this->bound = EndPoint(AddressV4(bytes), get_big_endian(&chunk[offset + 4 + 4]));
+        }
+        break;
+    case 0x03:
+        // a name is of no use for a UDP relay, the server address is taken
+        break;
+    case 0x04:
+        if (length >= offset + 4 + 16 + 2) {
+            AddressV6::bytes_type bytes;
+            std::copy_n(address, bytes.size(), std::begin(bytes));
+            this->bound = EndPoint(AddressV6(bytes), get_big_endian(&chunk[offset + 4 + 16]));
+        }
+        break;
+    default:
+        throw Socks5Error("unknown address type");
+    }
+}
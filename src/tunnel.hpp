@@ -0,0 +1,75 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_TUNNEL_HPP
+#define S5P_TUNNEL_HPP
+
+#include "upstream.hpp"
+
+#include <memory>
+
+
+namespace s5p {
+
+// ATYP, DST.ADDR and DST.PORT of the target, returns the length
+std::size_t fill_target(Chunk & chunk, std::size_t offset, const Target & target);
+
+
+/**
+ * A connection to the SOCKS5 server which has been asked to CONNECT to the
+ * target, or to relay UDP for this client.
+ *
+ * The outcome and the latency of the handshake are reported to the upstream.
+ * Socket errors come back as error codes, only a malformed reply throws.
+ */
+class Tunnel {
+public:
+    Tunnel(IOLoop & loop, std::shared_ptr<Upstream> upstream);
+
+    Socket & socket();
+    std::shared_ptr<Upstream> upstream() const;
+    const EndPoint & bound() const;
+
+    void set_command(Socks5Command command);
+    void set_target(const Target & target);
+
+    bool connect(YieldContext yield);
+    bool handshake(YieldContext yield, ErrorCode & ec);
+    bool greet(YieldContext yield, ErrorCode & ec);
+    void cancel();
+
+    void set_early_data(const Chunk & chunk, std::size_t length);
+    std::size_t read_leftover(Chunk & chunk);
+
+private:
+    Tunnel(const Tunnel &);
+    Tunnel & operator = (const Tunnel &);
+    Tunnel(Tunnel &&);
+    Tunnel & operator = (Tunnel &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_TUNNEL_HPP_
+#define S5P_TUNNEL_HPP_
+
+#include "tunnel.hpp"
+#include "resolver_cache.hpp"
+
+#include <vector>
+
+
+namespace s5p {
+
+typedef std::shared_ptr<Socket> SocketPtr;
+
+/**
+ * Shared state of the connection attempts started by Tunnel::connect.
+ */
+struct ConnectRace {
+    explicit ConnectRace(IOLoop & loop);
+
+    SteadyTimer timer;
+    std::vector<SocketPtr> sockets;
+    std::size_t running;
+    bool failed;
+    SocketPtr winner;
+};
+
+
+class Tunnel::Private {
+public:
+    Private(IOLoop & loop, std::shared_ptr<Upstream> upstream);
+
+    EndPointList do_resolve(YieldContext yield);
+    bool do_connect(YieldContext yield, const EndPointList & endpoints);
+    void do_attempt(std::shared_ptr<ConnectRace> race, const EndPoint & endpoint);
+    bool do_socks5_phase1(YieldContext yield, ErrorCode & ec);
+    bool do_socks5_phase2(YieldContext yield, ErrorCode & ec);
+    bool do_socks5_pipelined(YieldContext yield, ErrorCode & ec);
+    std::size_t do_read_at_least(YieldContext yield, Chunk & chunk, std::size_t offset, std::size_t minimum, ErrorCode & ec);
+
+    std::size_t do_fill_greeting(Chunk & chunk, std::size_t offset);
+    std::size_t do_fill_request(Chunk & chunk, std::size_t offset);
+    void do_check_greeting_reply(const Chunk & chunk, std::size_t offset, std::size_t length);
+    void do_check_request_reply(const Chunk & chunk, std::size_t offset, std::size_t length);
+
+    IOLoop & loop;
+    Socket socket;
+    std::shared_ptr<Upstream> upstream;
+    Socks5Command command;
+    Target target;
+    EndPoint bound;
+    std::chrono::steady_clock::time_point started;
+    std::vector<uint8_t> early;
+    std::vector<uint8_t> leftover;
+    std::weak_ptr<ConnectRace> race;
+    bool cancelled;
+};
+
+}
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "tunnel_pool_p.hpp"
+
+#include "balancer.hpp"
+#include "exception.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+
+
+using s5p::TunnelPool;
+using s5p::Tunnel;
+using s5p::Balancer;
+using s5p::Socket;
+using s5p::ErrorCode;
+using s5p::YieldContext;
+using s5p::Counter;
+using s5p::Gauge;
+
+
+TunnelPool::TunnelPool(IOLoop & loop, std::size_t min_size, std::size_t max_size)
+    : _(std::make_shared<TunnelPool::Private>(loop, min_size, max_size))
+{
+}
+
+void TunnelPool::start() {
+    _->do_refill();
+    _->do_maintain();
+}
+
+std::shared_ptr<Tunnel> TunnelPool::acquire() {
+    ++_->acquired;
+    if (_->idle.empty()) {
+        // demand exceeds the pool, let it grow toward the maximum
+        ++_->misses;
+        _->target_size = std::min(_->max_size, _->target_size + 1);
+        _->do_refill();
+        return nullptr;
+    }
+
+    auto tunnel = _->idle.front();
+    _->idle.pop_front();
+    adjust(Gauge::POOL_IDLE, -1);
+    // stop watching for closure, the session owns it from now on
+    tunnel->socket().cancel();
+
+    _->do_refill();
+    return tunnel;
+}
+
+// a tunnel which has finished its HTTP exchanges cleanly, the next session
+// sends its own requests on it; the most recently used goes first, it is the
+// least likely to have been closed by the target
+void TunnelPool::release(std::shared_ptr<Tunnel> tunnel) {
+    if (_->idle.size() >= _->max_size) {
+        ErrorCode ignored;
+        tunnel->socket().close(ignored);
+        return;
+    }
+    count(Counter::TUNNELS_REUSED);
+    _->idle.push_front(tunnel);
+    adjust(Gauge::POOL_IDLE, 1);
+    _->do_watch(tunnel);
+}
+
+TunnelPool::Private::Private(IOLoop & loop, std::size_t min_size, std::size_t max_size)
+    : loop(loop)
+    , timer(loop)
+    , min_size(min_size)
+    , max_size(max_size)
+    , target_size(min_size)
+    , pending(0)
+    , misses(0)
+    , acquired(0)
+    , backing_off(false)
+    , idle()
+{
+}
+
+void TunnelPool::Private::do_refill() {
+    namespace ph = std::placeholders;
+
+    if (this->backing_off) {
+        return;
+    }
+    while (this->idle.size() + this->pending < this->target_size) {
+        ++this->pending;
+        boost::asio::spawn(this->loop, std::bind(&TunnelPool::Private::do_open, this, ph::_1), coroutine_attributes());
+    }
+}
+
+void TunnelPool::Private::do_open(YieldContext yield) {
+    auto & application = Application::instance();
+    auto tunnel = std::make_shared<Tunnel>(this->loop, Balancer::instance().pick());
+    bool ok = false;
+    ErrorCode ec;
+
+    // the same phase deadlines as a session, or a blackholed upstream keeps
+    // the refill pending for good
+    SteadyTimer deadline(this->loop);
+    auto timed_out = std::make_shared<bool>(false);
+    std::weak_ptr<Tunnel> victim = tunnel;
+    auto arm = [&deadline, victim, timed_out](Counter counter, std::size_t seconds) -> void {
+        ErrorCode ignored;
+        deadline.cancel(ignored);
+        if (seconds == 0) {
+            return;
+        }
+        deadline.expires_after(std::chrono::seconds(seconds));
+        deadline.async_wait([victim, timed_out, counter](const ErrorCode & ec) -> void {
+            auto tunnel = victim.lock();
+            if (!ec && tunnel) {
+                count(counter);
+                *timed_out = true;
+                tunnel->cancel();
+            }
+        });
+    };
+
+    try {
+        arm(Counter::TIMEOUTS_CONNECT, application.get_connect_timeout());
+        ok = tunnel->connect(yield);
+        if (!ok) {
+            count(Counter::ERRORS_CONNECTION);
+            report_error(*timed_out ? "socks5 connect timed out" : "no resolved address is available");
+        } else {
+            arm(Counter::TIMEOUTS_HANDSHAKE, application.get_handshake_timeout());
+            ok = tunnel->handshake(yield, ec);
+        }
+    } catch (ResolutionError & e) {
+        count(Counter::ERRORS_RESOLUTION);
+        report_error("cannot resolve the domain", e);
+        ok = false;
+    } catch (Socks5Error & e) {
+        count(Counter::ERRORS_SOCKS5);
+        report_error("socks5 auth error", e);
+        ok = false;
+    }
+    if (ec && *timed_out) {
+        count(Counter::ERRORS_CONNECTION);
+        report_error("socks5 handshake timed out");
+    } else if (ec == boost::asio::error::eof) {
+        count(Counter::ERRORS_END_OF_FILE);
+        report_error("socks5 server closed the pooled tunnel");
+    } else if (ec) {
+        count(Counter::ERRORS_CONNECTION);
+        report_error("socks5 connection error", ec);
+    }
+    ErrorCode ignored;
+    deadline.cancel(ignored);
+
+    --this->pending;
+    if (!ok) {
+        // the upstream is in trouble, retry on the next maintenance tick
+        this->backing_off = true;
+        return;
+    }
+
+    this->idle.push_back(tunnel);
+    adjust(Gauge::POOL_IDLE, 1);
+    this->do_watch(tunnel);
+}
+
+void TunnelPool::Private::do_watch(std::shared_ptr<Tunnel> tunnel) {
+    // nothing should arrive before the client speaks, so a readable idle
+    // tunnel has been closed or broken by the upstream
+    tunnel->socket().async_wait(Socket::wait_read, [this, tunnel](const ErrorCode & ec) -> void {
+        if (ec == boost::asio::error::operation_aborted) {
+            return;
+        }
+        this->idle.remove(tunnel);
+        adjust(Gauge::POOL_IDLE, -1);
+        ErrorCode ignored;
+        tunnel->socket().close(ignored);
+        this->do_refill();
+    });
+}
+
+void TunnelPool::Private::do_maintain() {
+    namespace ph = std::placeholders;
+
+    this->timer.expires_after(std::chrono::seconds(1));
+    this->timer.async_wait(std::bind(&TunnelPool::Private::on_maintain, this, ph::_1));
+}
+
+void TunnelPool::Private::on_maintain(const ErrorCode & ec) {
+    if (ec) {
+        return;
+    }
+
+    // shrink back toward the minimum after a quiet period
+    if (this->misses == 0 && this->target_size > this->min_size) {
+        --this->target_size;
+    }
+    // tunnels given back keep up with the demand of the last period
+    auto keep = std::max(this->target_size, this->acquired);
+    this->misses = 0;
+    this->acquired = 0;
+    while (this->idle.size() > keep) {
+        // the one waiting longest goes first
+        auto tunnel = this->idle.back();
+        this->idle.pop_back();
+        adjust(Gauge::POOL_IDLE, -1);
+        ErrorCode ignored;
+        tunnel->socket().close(ignored);
+    }
+
+    this->backing_off = false;
+    this->do_refill();
+    this->do_maintain();
+}
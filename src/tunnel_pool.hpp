@@ -0,0 +1,62 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_TUNNEL_POOL_HPP
+#define S5P_TUNNEL_POOL_HPP
+
+#include "global.hpp"
+
+#include <memory>
+
+
+namespace s5p {
+
+class Tunnel;
+
+
+/**
+ * Keeps tunnels which already finished CONNECT, so a new session can skip
+ * the resolve, connect and handshake round trips.
+ *
+ * Every thread has its own pool, since sockets are bound to an io_service.
+ */
+class TunnelPool {
+public:
+    TunnelPool(IOLoop & loop, std::size_t min_size, std::size_t max_size);
+
+    void start();
+    std::shared_ptr<Tunnel> acquire();
+    void release(std::shared_ptr<Tunnel> tunnel);
+
+private:
+    TunnelPool(const TunnelPool &);
+    TunnelPool & operator = (const TunnelPool &);
+    TunnelPool(TunnelPool &&);
+    TunnelPool & operator = (TunnelPool &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_TUNNEL_POOL_HPP_
+#define S5P_TUNNEL_POOL_HPP_
+
+#include "tunnel_pool.hpp"
+#include "tunnel.hpp"
+
+#include <list>
+
+
+namespace s5p {
+
+class TunnelPool::Private {
+public:
+    Private(IOLoop & loop, std::size_t min_size, std::size_t max_size);
+
+    void do_refill();
+    void do_open(YieldContext yield);
+    void do_watch(std::shared_ptr<Tunnel> tunnel);
+    void do_maintain();
+    void on_maintain(const ErrorCode & ec);
+
+    IOLoop & loop;
+    SteadyTimer timer;
+    std::size_t min_size;
+    std::size_t max_size;
+    std::size_t target_size;
+    std::size_t pending;
+    std::size_t misses;
+    std::size_t acquired;
+    bool backing_off;
+    std::list<std::shared_ptr<Tunnel>> idle;
+};
+
+}
+
+#endif
@@ -0,0 +1,531 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "udp_relay_p.hpp"
+
+#include "balancer.hpp"
+#include "exception.hpp"
+#include "metrics.hpp"
+#include "tunnel.hpp"
+
+#include <boost/asio/ip/v6_only.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+
+using s5p::UdpRelay;
+using s5p::DatagramBatch;
+using s5p::Association;
+using s5p::AssociationPtr;
+using s5p::UdpSocket;
+using s5p::UdpEndPoint;
+using s5p::Tunnel;
+using s5p::Balancer;
+using s5p::Counter;
+using s5p::Gauge;
+using s5p::Socks5Command;
+using s5p::YieldContext;
+using s5p::ErrorCode;
+using s5p::LogFields;
+
+
+namespace {
+
+// batches taken in a row before other handlers get their turn
+const std::size_t RECEIVE_BURST = 4;
+// datagrams held for an association which is still being set up
+const std::size_t MAX_WAITING = 64;
+const std::chrono::seconds SWEEP_INTERVAL(1);
+
+#ifdef SO_REUSEPORT
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> ReusePort;
+#endif
+
+typedef DatagramBatch::Message Message;
+
+// how many were received, 0 when nothing was waiting
+std::size_t receive_batch(int fd, Message * messages, std::size_t count) {
+#ifdef __linux__
+    auto rv = ::recvmmsg(fd, messages, static_cast<unsigned int>(count), MSG_DONTWAIT, nullptr);
+    s5p::count(Counter::UDP_SYSCALLS);
+    return rv > 0 ? static_cast<std::size_t>(rv) : 0;
+#else
+    std::size_t received = 0;
+    for (; received < count; ++received) {
+        auto rv = ::recvmsg(fd, &messages[received].msg_hdr, MSG_DONTWAIT);
+        s5p::count(Counter::UDP_SYSCALLS);
+        if (rv < 0) {
+            break;
+        }
+        messages[received].msg_len = static_cast<unsigned int>(rv);
+    }
+    return received;
+#endif
+}
+
+// how many went out, a full socket buffer drops the rest
+std::size_t send_batch(int fd, Message * messages, std::size_t count) {
+    std::size_t sent = 0;
+    while (sent < count) {
+#ifdef __linux__
+        auto rv = ::sendmmsg(fd, messages + sent, static_cast<unsigned int>(count - sent), MSG_DONTWAIT);
+#else
+        auto rv = ::sendmsg(fd, &messages[sent].msg_hdr, MSG_DONTWAIT) < 0 ? -1 : 1;
+#endif
+        s5p::count(Counter::UDP_SYSCALLS);
+        if (rv <= 0) {
+            break;
+        }
+        sent += static_cast<std::size_t>(rv);
+    }
+    if (sent < count) {
+        s5p::count(Counter::UDP_DROPS, count - sent);
+    }
+    return sent;
+}
+
+// the length of the SOCKS5 UDP header in front of a datagram from the relay,
+// 0 if it is malformed or a fragment
+std::size_t parse_header(const uint8_t * data, std::size_t length) {
+    // RSV RSV FRAG ATYP
+    if (length < 4 || data[2] != 0x00) {
+        return 0;
+    }
+    std::size_t header = 0;
+    switch (data[3]) {
+    case 0x01:
+        header = 4 + 4 + 2;
+        break;
+    case 0x03:
+        header = length > 4 ? 4 + 1 + data[4] + 2 : 0;
+        break;
+    case 0x04:
+        header = 4 + 16 + 2;
+        break;
+    default:
+        return 0;
+    }
+    return header <= length ? header : 0;
+}
+
+// the shards share the port, and so does the process that takes over on a
+// restart until this one stops, whatever the thread count of either
+void set_reuse_port(UdpSocket & socket) {
+#ifdef SO_REUSEPORT
+    socket.set_option(ReusePort(true));
+#endif
+}
+
+}
+
+
+UdpRelay::UdpRelay(IOLoop & loop)
+    : _(std::make_shared<Private>(loop))
+{
+}
+
+void UdpRelay::listen_v4(uint16_t port) {
+    _->do_listen(_->v4, UdpEndPoint(boost::asio::ip::udp::v4(), port));
+}
+
+void UdpRelay::listen_v6(uint16_t port) {
+    _->do_listen(_->v6, UdpEndPoint(boost::asio::ip::udp::v6(), port));
+}
+
+void UdpRelay::stop() {
+    auto self = _;
+    boost::asio::post(_->loop, [self]() -> void {
+        self->stopped = true;
+        ErrorCode ignored;
+        self->v4.close(ignored);
+        self->v6.close(ignored);
+        self->sweeper.cancel(ignored);
+        auto associations = self->associations;
+        for (auto & pair : associations) {
+            self->do_close(pair.second);
+        }
+    });
+}
+
+DatagramBatch::DatagramBatch()
+    : storage(SIZE * (HEADER_ROOM + PAYLOAD))
+    , messages()
+    , vectors()
+    , peers()
+    , outgoing()
+    , outgoing_vectors()
+{
+}
+
+uint8_t * DatagramBatch::slot(std::size_t index) {
+    return this->storage.data() + index * (HEADER_ROOM + PAYLOAD);
+}
+
+// every slot takes a datagram at offset, whatever the sender was
+void DatagramBatch::prepare_receive(std::size_t offset) {
+    for (std::size_t i = 0; i < SIZE; ++i) {
+        this->vectors[i].iov_base = this->slot(i) + offset;
+        this->vectors[i].iov_len = HEADER_ROOM + PAYLOAD - offset;
+        std::memset(&this->messages[i], 0, sizeof(Message));
+        this->messages[i].msg_hdr.msg_name = &this->peers[i];
+        this->messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        this->messages[i].msg_hdr.msg_iov = &this->vectors[i];
+        this->messages[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+// the index-th outgoing datagram, to the peer of the socket or to name
+void DatagramBatch::prepare_send(std::size_t index, uint8_t * data, std::size_t length, void * name, socklen_t name_length) {
+    this->outgoing_vectors[index].iov_base = data;
+    this->outgoing_vectors[index].iov_len = length;
+    std::memset(&this->outgoing[index], 0, sizeof(Message));
+    this->outgoing[index].msg_hdr.msg_name = name;
+    this->outgoing[index].msg_hdr.msg_namelen = name_length;
+    this->outgoing[index].msg_hdr.msg_iov = &this->outgoing_vectors[index];
+    this->outgoing[index].msg_hdr.msg_iovlen = 1;
+}
+
+Association::Association(IOLoop & loop, UdpSocket & listener, const UdpEndPoint & client)
+    : listener(listener)
+    , client(client)
+    , control(loop)
+    , relay(loop)
+    , upstream()
+    , waiting()
+    , control_byte()
+    , last_active(std::chrono::steady_clock::now())
+    , ready(false)
+    , closed(false)
+{
+}
+
+UdpRelay::Private::Private(IOLoop & loop)
+    : loop(loop)
+    , v4(loop)
+    , v6(loop)
+    , sweeper(loop)
+    , header()
+    , batch()
+    , associations()
+    , stopped(false)
+{
+    // RSV FRAG
+    Chunk chunk;
+    chunk[0] = 0x00;
+    chunk[1] = 0x00;
+    chunk[2] = 0x00;
+    auto length = 3 + fill_target(chunk, 3, Application::instance().get_http_target());
+    this->header.assign(std::begin(chunk), std::next(std::begin(chunk), length));
+}
+
+void UdpRelay::Private::do_listen(UdpSocket & listener, const UdpEndPoint & endpoint) {
+    listener.open(endpoint.protocol());
+    listener.set_option(UdpSocket::reuse_address(true));
+    if (endpoint.protocol() == boost::asio::ip::udp::v6()) {
+        listener.set_option(boost::asio::ip::v6_only(true));
+    }
+    set_reuse_port(listener);
+    listener.bind(endpoint);
+    this->do_receive(listener);
+    // the second listener restarts it, which cancels the first wait
+    this->do_sweep();
+}
+
+void UdpRelay::Private::do_receive(UdpSocket & listener) {
+    auto self = this->shared_from_this();
+    listener.async_wait(UdpSocket::wait_read, [self, &listener](const ErrorCode & ec) -> void {
+        self->on_client_readable(listener, ec);
+    });
+}
+
+void UdpRelay::Private::on_client_readable(UdpSocket & listener, const ErrorCode & ec) {
+    if (ec || this->stopped) {
+        return;
+    }
+    for (std::size_t round = 0; round < RECEIVE_BURST; ++round) {
+        // the payload lands after the room for the header
+        this->batch.prepare_receive(DatagramBatch::HEADER_ROOM);
+        auto received = receive_batch(listener.native_handle(), this->batch.messages.data(), DatagramBatch::SIZE);
+        if (received == 0) {
+            break;
+        }
+        this->do_forward(listener, received);
+        if (received < DatagramBatch::SIZE) {
+            break;
+        }
+    }
+    this->do_receive(listener);
+}
+
+void UdpRelay::Private::do_forward(UdpSocket & listener, std::size_t received) {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::pair<AssociationPtr, std::vector<std::size_t>>> groups;
+    for (std::size_t i = 0; i < received; ++i) {
+        auto & message = this->batch.messages[i];
+        if (message.msg_hdr.msg_flags & MSG_TRUNC) {
+            count(Counter::UDP_DROPS);
+            continue;
+        }
+        UdpEndPoint client;
+        std::memcpy(client.data(), &this->batch.peers[i], message.msg_hdr.msg_namelen);
+        client.resize(message.msg_hdr.msg_namelen);
+
+        auto payload = this->batch.slot(i) + DatagramBatch::HEADER_ROOM;
+        auto begin = payload - this->header.size();
+        std::copy(std::begin(this->header), std::end(this->header), begin);
+        count(Counter::UDP_DATAGRAMS_UPSTREAM);
+        count(Counter::BYTES_UPSTREAM, message.msg_len);
+
+        auto it = this->associations.find(client);
+        if (it == this->associations.end()) {
+            auto association = std::make_shared<Association>(this->loop, listener, client);
+            it = this->associations.emplace(client, association).first;
+            adjust(Gauge::UDP_ASSOCIATIONS, 1);
+            auto self = this->shared_from_this();
+            boost::asio::spawn(this->loop, [self, association](YieldContext yield) -> void {
+                self->do_associate(yield, association);
+            }, coroutine_attributes());
+        }
+        auto & association = it->second;
+        association->last_active = now;
+
+        if (!association->ready) {
+            if (association->waiting.size() < MAX_WAITING) {
+                association->waiting.emplace_back(begin, payload + message.msg_len);
+            } else {
+                count(Counter::UDP_DROPS);
+            }
+            continue;
+        }
+        auto group = std::find_if(std::begin(groups), std::end(groups), [&association](const std::pair<AssociationPtr, std::vector<std::size_t>> & group) -> bool {
+            return group.first == association;
+        });
+        if (group == std::end(groups)) {
+            groups.emplace_back(association, std::vector<std::size_t>());
+            group = std::prev(std::end(groups));
+        }
+        group->second.push_back(i);
+    }
+
+    for (auto & group : groups) {
+        this->do_send_upstream(*group.first, group.second);
+    }
+}
+
+// the relay socket is connected, the datagrams need no address
+void UdpRelay::Private::do_send_upstream(Association & association, const std::vector<std::size_t> & slots) {
+    for (std::size_t j = 0; j < slots.size(); ++j) {
+        auto i = slots[j];
+        auto begin = this->batch.slot(i) + DatagramBatch::HEADER_ROOM - this->header.size();
+        this->batch.prepare_send(j, begin, this->header.size() + this->batch.messages[i].msg_len, nullptr, 0);
+    }
+    send_batch(association.relay.native_handle(), this->batch.outgoing.data(), slots.size());
+}
+
+void UdpRelay::Private::do_associate(YieldContext yield, AssociationPtr association) {
+    auto & application = Application::instance();
+    auto tunnel = std::make_shared<Tunnel>(this->loop, Balancer::instance().pick());
+    tunnel->set_command(Socks5Command::UDP_ASSOCIATE);
+
+    LogFields fields = {
+        {"phase", "udp associate"},
+        {"client", boost::lexical_cast<std::string>(association->client)},
+    };
+
+    // one deadline for both phases
+    SteadyTimer deadline(this->loop);
+    auto timed_out = std::make_shared<bool>(false);
+    if (application.get_connect_timeout() > 0 && application.get_handshake_timeout() > 0) {
+        std::weak_ptr<Tunnel> victim = tunnel;
+        deadline.expires_after(std::chrono::seconds(application.get_connect_timeout() + application.get_handshake_timeout()));
+        deadline.async_wait([victim, timed_out](const ErrorCode & ec) -> void {
+            auto tunnel = victim.lock();
+            if (!ec && tunnel) {
+                *timed_out = true;
+                tunnel->cancel();
+            }
+        });
+    }
+
+    ErrorCode ec;
+    bool ok = false;
+    try {
+        ok = tunnel->connect(yield) && tunnel->handshake(yield, ec);
+        if (!ok) {
+            count(Counter::ERRORS_CONNECTION);
+            if (*timed_out) {
+                report_error("socks5 udp associate timed out", fields);
+            } else {
+                report_error("socks5 udp associate failed", ec, fields);
+            }
+        }
+    } catch (ResolutionError & e) {
+        count(Counter::ERRORS_RESOLUTION);
+        report_error("cannot resolve the domain", e, fields);
+    } catch (Socks5Error & e) {
+        count(Counter::ERRORS_SOCKS5);
+        report_error("socks5 udp associate refused", e, fields);
+    }
+    deadline.cancel(ec);
+    if (!ok || association->closed) {
+        this->do_close(association);
+        return;
+    }
+
+    // an unspecified address means the one the control connection reached
+    auto bound = tunnel->bound();
+    if (bound.address().is_unspecified() || bound.port() == 0) {
+        auto remote = tunnel->socket().remote_endpoint(ec);
+        if (!ec && bound.address().is_unspecified()) {
+            bound.address(remote.address());
+        }
+    }
+    UdpEndPoint relay(bound.address(), bound.port());
+    association->relay.open(relay.protocol(), ec);
+    if (!ec) {
+        association->relay.connect(relay, ec);
+    }
+    if (ec || bound.port() == 0) {
+        count(Counter::ERRORS_CONNECTION);
+        report_error("cannot reach the socks5 udp relay", ec, fields);
+        this->do_close(association);
+        return;
+    }
+
+    association->control = std::move(tunnel->socket());
+    association->upstream = tunnel->upstream();
+    association->upstream->begin_session();
+    association->ready = true;
+    for (auto & datagram : association->waiting) {
+        if (::send(association->relay.native_handle(), datagram.data(), datagram.size(), MSG_DONTWAIT) < 0) {
+            count(Counter::UDP_DROPS);
+        }
+        count(Counter::UDP_SYSCALLS);
+    }
+    association->waiting.clear();
+
+    this->do_receive_relay(association);
+    this->do_watch_control(association);
+}
+
+void UdpRelay::Private::do_receive_relay(AssociationPtr association) {
+    auto self = this->shared_from_this();
+    association->relay.async_wait(UdpSocket::wait_read, [self, association](const ErrorCode & ec) -> void {
+        self->on_relay_readable(association, ec);
+    });
+}
+
+void UdpRelay::Private::on_relay_readable(AssociationPtr association, const ErrorCode & ec) {
+    if (ec || association->closed) {
+        return;
+    }
+    auto & client = association->client;
+    for (std::size_t round = 0; round < RECEIVE_BURST; ++round) {
+        this->batch.prepare_receive(0);
+        auto received = receive_batch(association->relay.native_handle(), this->batch.messages.data(), DatagramBatch::SIZE);
+        if (received == 0) {
+            break;
+        }
+
+        // strip the header, the payload goes back where the client sent from
+        std::size_t out = 0;
+        for (std::size_t i = 0; i < received; ++i) {
+            auto & message = this->batch.messages[i];
+            auto data = this->batch.slot(i);
+            auto header = (message.msg_hdr.msg_flags & MSG_TRUNC) ? 0 : parse_header(data, message.msg_len);
+            if (header == 0) {
+                count(Counter::UDP_DROPS);
+                continue;
+            }
+            this->batch.prepare_send(out++, data + header, message.msg_len - header, client.data(), static_cast<socklen_t>(client.size()));
+            count(Counter::UDP_DATAGRAMS_DOWNSTREAM);
+            count(Counter::BYTES_DOWNSTREAM, message.msg_len - header);
+        }
+        send_batch(association->listener.native_handle(), this->batch.outgoing.data(), out);
+        association->last_active = std::chrono::steady_clock::now();
+        if (received < DatagramBatch::SIZE) {
+            break;
+        }
+    }
+    this->do_receive_relay(association);
+}
+
+// the association lives as long as its control connection
+void UdpRelay::Private::do_watch_control(AssociationPtr association) {
+    auto self = this->shared_from_this();
+    association->control.async_read_some(boost::asio::buffer(association->control_byte), [self, association](const ErrorCode & ec, std::size_t) -> void {
+        if (association->closed) {
+            return;
+        }
+        if (ec) {
+            self->do_close(association);
+            return;
+        }
+        self->do_watch_control(association);
+    });
+}
+
+// closes the associations which moved nothing for the idle timeout
+void UdpRelay::Private::do_sweep() {
+    auto self = this->shared_from_this();
+    this->sweeper.expires_after(SWEEP_INTERVAL);
+    this->sweeper.async_wait([self](const ErrorCode & ec) -> void {
+        if (ec || self->stopped) {
+            return;
+        }
+        auto idle_timeout = Application::instance().get_idle_timeout();
+        if (idle_timeout > 0) {
+            auto deadline = std::chrono::steady_clock::now() - std::chrono::seconds(idle_timeout);
+            std::vector<AssociationPtr> idle;
+            for (auto & pair : self->associations) {
+                if (pair.second->ready && pair.second->last_active < deadline) {
+                    idle.push_back(pair.second);
+                }
+            }
+            for (auto & association : idle) {
+                count(Counter::TIMEOUTS_IDLE);
+                self->do_close(association);
+            }
+        }
+        self->do_sweep();
+    });
+}
+
+void UdpRelay::Private::do_close(AssociationPtr association) {
+    if (association->closed) {
+        return;
+    }
+    association->closed = true;
+    ErrorCode ignored;
+    association->control.close(ignored);
+    association->relay.close(ignored);
+    if (association->upstream) {
+        association->upstream->end_session();
+    }
+    auto it = this->associations.find(association->client);
+    if (it != this->associations.end() && it->second == association) {
+        this->associations.erase(it);
+    }
+    adjust(Gauge::UDP_ASSOCIATIONS, -1);
+}
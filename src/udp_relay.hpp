@@ -0,0 +1,61 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_UDP_RELAY_HPP
+#define S5P_UDP_RELAY_HPP
+
+#include "global.hpp"
+
+#include <memory>
+
+
+namespace s5p {
+
+/**
+ * Forwards the datagrams sent to the UDP port to the HTTP target, through a
+ * SOCKS5 UDP ASSOCIATE for every client address.
+ *
+ * Datagrams move in batches: one recvmmsg() takes what has arrived, and one
+ * sendmmsg() per association passes it on. Every shard binds the same port,
+ * so the kernel keeps a client on one of them.
+ */
+class UdpRelay {
+public:
+    explicit UdpRelay(IOLoop & loop);
+
+    void listen_v4(uint16_t port);
+    void listen_v6(uint16_t port);
+    void stop();
+
+private:
+    UdpRelay(const UdpRelay &);
+    UdpRelay & operator = (const UdpRelay &);
+    UdpRelay(UdpRelay &&);
+    UdpRelay & operator = (UdpRelay &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
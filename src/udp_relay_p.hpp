@@ -0,0 +1,133 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_UDP_RELAY_HPP_
+#define S5P_UDP_RELAY_HPP_
+
+#include "udp_relay.hpp"
+#include "upstream.hpp"
+
+#include <boost/asio/ip/udp.hpp>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <array>
+#include <deque>
+#include <map>
+#include <vector>
+
+
+namespace s5p {
+
+typedef boost::asio::ip::udp::socket UdpSocket;
+typedef boost::asio::ip::udp::endpoint UdpEndPoint;
+
+
+/**
+ * Datagrams one recvmmsg() fills or one sendmmsg() takes. Every slot keeps
+ * room for the SOCKS5 UDP header in front of the payload, so the header is
+ * added without copying.
+ */
+struct DatagramBatch {
+#ifdef __linux__
+    typedef mmsghdr Message;
+#else
+    struct Message {
+        msghdr msg_hdr;
+        unsigned int msg_len;
+    };
+#endif
+
+    static const std::size_t SIZE = 64;
+    static const std::size_t HEADER_ROOM = 4 + 1 + 255 + 2;
+    static const std::size_t PAYLOAD = 8192;
+
+    DatagramBatch();
+
+    uint8_t * slot(std::size_t index);
+    void prepare_receive(std::size_t offset);
+    void prepare_send(std::size_t index, uint8_t * data, std::size_t length, void * name, socklen_t name_length);
+
+    std::vector<uint8_t> storage;
+    std::array<Message, SIZE> messages;
+    std::array<iovec, SIZE> vectors;
+    std::array<sockaddr_storage, SIZE> peers;
+    // what to send, pointing into the slots
+    std::array<Message, SIZE> outgoing;
+    std::array<iovec, SIZE> outgoing_vectors;
+};
+
+
+/**
+ * One client address and the SOCKS5 association which carries its
+ * datagrams. The control connection holds the association open.
+ */
+struct Association {
+    Association(IOLoop & loop, UdpSocket & listener, const UdpEndPoint & client);
+
+    UdpSocket & listener;
+    UdpEndPoint client;
+    Socket control;
+    UdpSocket relay;
+    std::shared_ptr<Upstream> upstream;
+    // datagrams with their headers, until the relay address is known
+    std::deque<std::vector<uint8_t>> waiting;
+    std::array<uint8_t, 1> control_byte;
+    std::chrono::steady_clock::time_point last_active;
+    bool ready;
+    bool closed;
+};
+
+typedef std::shared_ptr<Association> AssociationPtr;
+
+
+class UdpRelay::Private : public std::enable_shared_from_this<UdpRelay::Private> {
+public:
+    explicit Private(IOLoop & loop);
+
+    void do_listen(UdpSocket & listener, const UdpEndPoint & endpoint);
+    void do_receive(UdpSocket & listener);
+    void on_client_readable(UdpSocket & listener, const ErrorCode & ec);
+    void do_forward(UdpSocket & listener, std::size_t count);
+    void do_associate(YieldContext yield, AssociationPtr association);
+    void do_send_upstream(Association & association, const std::vector<std::size_t> & slots);
+    void do_receive_relay(AssociationPtr association);
+    void on_relay_readable(AssociationPtr association, const ErrorCode & ec);
+    void do_watch_control(AssociationPtr association);
+    void do_sweep();
+    void do_close(AssociationPtr association);
+
+    IOLoop & loop;
+    UdpSocket v4;
+    UdpSocket v6;
+    SteadyTimer sweeper;
+    // SOCKS5 UDP header for the HTTP target, RSV FRAG ATYP DST.ADDR DST.PORT
+    std::vector<uint8_t> header;
+    DatagramBatch batch;
+    std::map<UdpEndPoint, AssociationPtr> associations;
+    bool stopped;
+};
+
+}
+
+#endif
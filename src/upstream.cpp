@@ -0,0 +1,130 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "upstream_p.hpp"
+
+
+namespace {
+
+// weight of the newest sample in the latency average
+const double EWMA_ALPHA = 0.3;
+// consecutive failures before an upstream leaves the rotation
+const std::size_t FAILURE_THRESHOLD = 3;
+// consecutive successes before it comes back
+const std::size_t PROBATION_THRESHOLD = 3;
+
+}
+
+
+using s5p::Upstream;
+
+
+Upstream::Upstream(const std::string & host, uint16_t port)
+    : _(std::make_shared<Upstream::Private>(host, port))
+{
+}
+
+const std::string & Upstream::host() const {
+    return _->host;
+}
+
+uint16_t Upstream::port() const {
+    return _->port;
+}
+
+std::size_t Upstream::active_sessions() const {
+    return _->active.load(std::memory_order_relaxed);
+}
+
+double Upstream::latency() const {
+    std::lock_guard<std::mutex> lock(_->mutex);
+    return _->latency;
+}
+
+bool Upstream::is_healthy() const {
+    std::lock_guard<std::mutex> lock(_->mutex);
+    return _->healthy;
+}
+
+void Upstream::begin_session() {
+    _->active.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Upstream::end_session() {
+    _->active.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Upstream::report_success(std::chrono::steady_clock::duration elapsed) {
+    using namespace std::chrono;
+    auto sample = duration_cast<duration<double, std::milli>>(elapsed).count();
+
+    std::lock_guard<std::mutex> lock(_->mutex);
+    if (_->measured) {
+        _->latency = EWMA_ALPHA * sample + (1.0 - EWMA_ALPHA) * _->latency;
+    } else {
+        _->latency = sample;
+        _->measured = true;
+    }
+    _->failures = 0;
+    ++_->successes;
+    _->do_update_health();
+}
+
+void Upstream::report_failure() {
+    std::lock_guard<std::mutex> lock(_->mutex);
+    _->successes = 0;
+    ++_->failures;
+    _->do_update_health();
+}
+
+Upstream::Private::Private(const std::string & host, uint16_t port)
+    : host(host)
+    , port(port)
+    , active(0)
+    , mutex()
+    , latency(0.0)
+    , measured(false)
+    , healthy(true)
+    , failures(0)
+    , successes(0)
+{
+}
+
+void Upstream::Private::do_update_health() {
+    auto max_latency = Application::instance().get_health_max_latency();
+    bool slow = max_latency > 0 && this->latency > max_latency;
+
+    if (this->healthy) {
+        if (this->failures >= FAILURE_THRESHOLD || slow) {
+            this->healthy = false;
+            this->successes = 0;
+            report_warning("upstream leaves the rotation", {
+                {"upstream", this->host + ":" + std::to_string(this->port)},
+            });
+        }
+    } else if (this->successes >= PROBATION_THRESHOLD && !slow) {
+        this->healthy = true;
+        report_info("upstream is back in the rotation", {
+            {"upstream", this->host + ":" + std::to_string(this->port)},
+        });
+    }
+}
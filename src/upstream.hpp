@@ -0,0 +1,66 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_UPSTREAM_HPP
+#define S5P_UPSTREAM_HPP
+
+#include "global.hpp"
+
+#include <chrono>
+#include <memory>
+
+
+namespace s5p {
+
+/**
+ * One SOCKS5 server, with the load and health figures the balancer needs.
+ *
+ * Shared by every thread.
+ */
+class Upstream {
+public:
+    Upstream(const std::string & host, uint16_t port);
+
+    const std::string & host() const;
+    uint16_t port() const;
+    std::size_t active_sessions() const;
+    double latency() const;
+    bool is_healthy() const;
+
+    void begin_session();
+    void end_session();
+    void report_success(std::chrono::steady_clock::duration elapsed);
+    void report_failure();
+
+private:
+    Upstream(const Upstream &);
+    Upstream & operator = (const Upstream &);
+    Upstream(Upstream &&);
+    Upstream & operator = (Upstream &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,511 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "uring_p.hpp"
+#include "metrics.hpp"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+
+using s5p::Uring;
+using s5p::Counter;
+
+
+namespace {
+
+const unsigned ENTRIES = 4096;
+// the provided buffer group, shared by every receive on this ring
+const uint16_t BUFFER_GROUP = 0;
+const std::size_t BUFFERS = 64;
+const std::size_t BUFFER_SIZE = 64 * 1024;
+// marks the completions of operations nobody waits for
+const uint64_t IGNORED = 0;
+// submissions in a row which the kernel may refuse before the ring is given up
+const unsigned SUBMIT_TRIES = 16;
+
+}
+
+
+Uring::Uring(IOLoop & loop)
+    : _(std::make_shared<Private>(loop))
+{
+}
+
+#ifdef __linux__
+
+bool Uring::open(ErrorCode & ec) {
+    auto fail = [this, &ec]() -> bool {
+        ec.assign(errno, boost::system::system_category());
+        return false;
+    };
+
+    std::memset(&_->params, 0, sizeof(_->params));
+    _->fd = static_cast<int>(::syscall(__NR_io_uring_setup, ENTRIES, &_->params));
+    if (_->fd < 0) {
+        return fail();
+    }
+    auto & params = _->params;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        ec = boost::asio::error::operation_not_supported;
+        return false;
+    }
+
+    // both rings share one mapping
+    _->ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    _->ring = ::mmap(nullptr, _->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _->fd, IORING_OFF_SQ_RING);
+    if (_->ring == MAP_FAILED) {
+        _->ring = nullptr;
+        return fail();
+    }
+    _->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    _->sqes = ::mmap(nullptr, _->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _->fd, IORING_OFF_SQES);
+    if (_->sqes == MAP_FAILED) {
+        _->sqes = nullptr;
+        return fail();
+    }
+    auto base = static_cast<uint8_t *>(_->ring);
+    _->sq_head = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+    _->sq_tail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    _->sq_array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    _->cq_head = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    _->cq_tail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    _->cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+
+    // completions wake the loop through an eventfd
+    int event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event < 0) {
+        return fail();
+    }
+    _->event.assign(event);
+    if (::syscall(__NR_io_uring_register, _->fd, IORING_REGISTER_EVENTFD, &event, 1) != 0) {
+        return fail();
+    }
+
+    _->arena = static_cast<uint8_t *>(::mmap(nullptr, BUFFERS * BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (_->arena == MAP_FAILED) {
+        _->arena = nullptr;
+        return fail();
+    }
+    // pinning may exceed RLIMIT_MEMLOCK, plain sends work as well
+    struct iovec region = { _->arena, BUFFERS * BUFFER_SIZE };
+    _->fixed = ::syscall(__NR_io_uring_register, _->fd, IORING_REGISTER_BUFFERS, &region, 1) == 0;
+    if (!_->fixed) {
+        report_warning("cannot register io_uring buffers, send without them", {
+            {"what", std::strerror(errno)},
+        });
+    }
+
+    _->do_provide(0, BUFFERS, false);
+    _->do_wait();
+    ec.clear();
+    return true;
+}
+
+void Uring::accept(int fd, Completion completion) {
+    auto sqe = _->do_get_sqe();
+    if (!sqe) {
+        _->do_reject(std::move(completion));
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    _->do_queue(sqe, std::move(completion));
+}
+
+void Uring::recv(int fd, int release, std::size_t length, Completion completion) {
+    // the buffer goes back before the receive may pick one
+    if (release >= 0) {
+        _->do_provide(release, 1, true);
+    }
+    auto sqe = _->do_get_sqe();
+    if (!sqe) {
+        _->do_reject(std::move(completion));
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    // the kernel reads no more than this into the buffer it picks
+    sqe->len = static_cast<uint32_t>(std::min(length, BUFFER_SIZE));
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    _->do_queue(sqe, std::move(completion));
+}
+
+void Uring::recv(int fd, boost::asio::mutable_buffer buffer, Completion completion) {
+    auto sqe = _->do_get_sqe();
+    if (!sqe) {
+        _->do_reject(std::move(completion));
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer.data());
+    sqe->len = static_cast<uint32_t>(buffer.size());
+    _->do_queue(sqe, std::move(completion));
+}
+
+void Uring::send(int fd, int index, std::size_t offset, std::size_t length, Completion completion) {
+    auto data = _->arena + index * BUFFER_SIZE + offset;
+    if (!_->fixed) {
+        this->send(fd, boost::asio::const_buffer(data, length), std::move(completion));
+        return;
+    }
+    auto sqe = _->do_get_sqe();
+    if (!sqe) {
+        _->do_reject(std::move(completion));
+        return;
+    }
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(length);
+    // sockets have no file position
+    sqe->off = static_cast<uint64_t>(-1);
+    sqe->buf_index = 0;
+    _->do_queue(sqe, std::move(completion));
+}
+
+void Uring::send(int fd, boost::asio::const_buffer buffer, Completion completion) {
+    auto sqe = _->do_get_sqe();
+    if (!sqe) {
+        _->do_reject(std::move(completion));
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer.data());
+    sqe->len = static_cast<uint32_t>(buffer.size());
+    sqe->msg_flags = MSG_NOSIGNAL;
+    _->do_queue(sqe, std::move(completion));
+}
+
+void Uring::release(int index) {
+    _->do_provide(index, 1, false);
+}
+
+bool Uring::is_broken() const {
+    return _->error != 0;
+}
+
+bool Uring::has_more(uint32_t flags) {
+    return (flags & IORING_CQE_F_MORE) != 0;
+}
+
+int Uring::buffer_index(uint32_t flags) {
+    if (!(flags & IORING_CQE_F_BUFFER)) {
+        return -1;
+    }
+    return static_cast<int>(flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+// every operation on fd ends with -ECANCELED, the completion runs after the
+// kernel has dropped them, so fd may be closed from there
+void Uring::cancel(int fd, Completion completion) {
+    auto sqe = _->do_get_sqe();
+    if (!sqe) {
+        _->do_reject(std::move(completion));
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    _->do_queue(sqe, std::move(completion));
+}
+
+#else
+
+bool Uring::open(ErrorCode & ec) {
+    ec = boost::asio::error::operation_not_supported;
+    return false;
+}
+
+void Uring::accept(int, Completion) {
+}
+
+void Uring::recv(int, int, std::size_t, Completion) {
+}
+
+void Uring::recv(int, boost::asio::mutable_buffer, Completion) {
+}
+
+void Uring::send(int, int, std::size_t, std::size_t, Completion) {
+}
+
+void Uring::send(int, boost::asio::const_buffer, Completion) {
+}
+
+void Uring::release(int) {
+}
+
+void Uring::cancel(int, Completion) {
+}
+
+bool Uring::is_broken() const {
+    return true;
+}
+
+bool Uring::has_more(uint32_t) {
+    return false;
+}
+
+int Uring::buffer_index(uint32_t) {
+    return -1;
+}
+
+#endif
+
+Uring::Private::Private(IOLoop & loop)
+    : loop(loop)
+    , event(loop)
+    , fd(-1)
+    , ring(nullptr)
+    , ring_size(0)
+    , sqes(nullptr)
+    , sqes_size(0)
+    , arena(nullptr)
+    , fixed(false)
+    , flush_scheduled(false)
+    , pending(0)
+    , stalled(0)
+    , error(0)
+    , next_id(IGNORED + 1)
+    , completions()
+{
+}
+
+Uring::Private::~Private() {
+#ifdef __linux__
+    // closing the ring cancels whatever is still in flight
+    if (this->fd >= 0) {
+        ::close(this->fd);
+    }
+    if (this->sqes) {
+        ::munmap(this->sqes, this->sqes_size);
+    }
+    if (this->ring) {
+        ::munmap(this->ring, this->ring_size);
+    }
+    if (this->arena) {
+        ::munmap(this->arena, BUFFERS * BUFFER_SIZE);
+    }
+#endif
+}
+
+#ifdef __linux__
+
+// nullptr once the ring is broken
+io_uring_sqe * Uring::Private::do_get_sqe() {
+    auto tail = *this->sq_tail;
+    // the ring is full, hand the batch over right now, the slot at tail is
+    // not ours before the kernel has taken it
+    while (tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) >= this->params.sq_entries) {
+        if (this->error) {
+            break;
+        }
+        if (!this->do_submit()) {
+            // a busy completion queue takes nothing until it is reaped
+            this->do_reap();
+        }
+    }
+    if (this->error) {
+        return nullptr;
+    }
+    auto index = tail & *reinterpret_cast<unsigned *>(static_cast<uint8_t *>(this->ring) + this->params.sq_off.ring_mask);
+    auto sqe = static_cast<io_uring_sqe *>(this->sqes) + index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    this->sq_array[index] = index;
+    return sqe;
+}
+
+void Uring::Private::do_queue(io_uring_sqe * sqe, Completion completion) {
+    if (completion) {
+        sqe->user_data = this->next_id++;
+        this->completions.emplace(sqe->user_data, std::move(completion));
+    } else {
+        sqe->user_data = IGNORED;
+    }
+    __atomic_store_n(this->sq_tail, *this->sq_tail + 1, __ATOMIC_RELEASE);
+    ++this->pending;
+    this->do_schedule_flush();
+}
+
+void Uring::Private::do_provide(int index, std::size_t count, bool linked) {
+    auto sqe = this->do_get_sqe();
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = static_cast<int>(count);
+    sqe->addr = reinterpret_cast<uint64_t>(this->arena + index * BUFFER_SIZE);
+    sqe->len = BUFFER_SIZE;
+    sqe->off = static_cast<uint64_t>(index);
+    sqe->buf_group = BUFFER_GROUP;
+    if (linked) {
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    this->do_queue(sqe, Completion());
+}
+
+// everything queued in this turn of the loop goes in with one syscall
+void Uring::Private::do_schedule_flush() {
+    if (this->flush_scheduled) {
+        return;
+    }
+    this->flush_scheduled = true;
+    auto self = this->shared_from_this();
+    boost::asio::post(this->loop, [self]() -> void {
+        self->flush_scheduled = false;
+        self->do_flush();
+    });
+}
+
+void Uring::Private::do_flush() {
+    if (!this->do_submit() && !this->error) {
+        // the completion queue is busy, try again after reaping it
+        this->do_schedule_flush();
+    }
+}
+
+// false if the kernel did not take everything; a ring which keeps refusing,
+// or fails for any other reason than being busy, is broken for good
+bool Uring::Private::do_submit() {
+    while (this->pending > 0 && !this->error) {
+        auto rv = ::syscall(__NR_io_uring_enter, this->fd, this->pending, 0, 0, nullptr, 0);
+        count(Counter::RING_SUBMITS);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno != EAGAIN && errno != EBUSY) {
+            this->do_break(errno);
+            return false;
+        }
+        if (rv <= 0) {
+            if (++this->stalled >= SUBMIT_TRIES) {
+                this->do_break(EBUSY);
+            }
+            return false;
+        }
+        this->stalled = 0;
+        this->pending -= static_cast<unsigned>(rv);
+    }
+    return this->pending == 0;
+}
+
+// what the kernel has not taken yet is taken back and fails with the error,
+// so is everything queued from now on; operations already submitted still
+// complete as usual
+void Uring::Private::do_break(int error) {
+    this->error = error;
+    report_error("io_uring cannot submit, fall back to the reactor", ErrorCode(error, boost::system::system_category()));
+    auto mask = *reinterpret_cast<unsigned *>(static_cast<uint8_t *>(this->ring) + this->params.sq_off.ring_mask);
+    auto head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+    auto tail = *this->sq_tail;
+    for (auto i = head; i != tail; ++i) {
+        auto sqe = static_cast<io_uring_sqe *>(this->sqes) + this->sq_array[i & mask];
+        auto it = this->completions.find(sqe->user_data);
+        if (it == this->completions.end()) {
+            continue;
+        }
+        this->do_reject(std::move(it->second));
+        this->completions.erase(it);
+    }
+    __atomic_store_n(this->sq_tail, head, __ATOMIC_RELEASE);
+    this->pending = 0;
+}
+
+// the completion runs on the loop, never from within the call queueing it
+void Uring::Private::do_reject(Completion completion) {
+    if (!completion) {
+        return;
+    }
+    auto error = this->error;
+    boost::asio::post(this->loop, [completion, error]() -> void {
+        completion(-error, 0);
+    });
+}
+
+// takes the completions off the ring without running them, so this is safe
+// in the middle of queueing an operation, on_ready runs them in order
+void Uring::Private::do_reap() {
+    auto mask = *reinterpret_cast<unsigned *>(static_cast<uint8_t *>(this->ring) + this->params.cq_off.ring_mask);
+    auto head = *this->cq_head;
+    while (head != __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) {
+        this->reaped.push_back(this->cqes[head & mask]);
+        ++head;
+    }
+    __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void Uring::Private::do_wait() {
+    auto self = this->shared_from_this();
+    this->event.async_wait(boost::asio::posix::stream_descriptor::wait_read, [self](const ErrorCode & ec) -> void {
+        self->on_ready(ec);
+    });
+}
+
+void Uring::Private::on_ready(const ErrorCode & ec) {
+    if (ec) {
+        return;
+    }
+    uint64_t value = 0;
+    while (::read(this->event.native_handle(), &value, sizeof(value)) > 0) {
+    }
+
+    // a completion that reaps again appends to what this loop runs
+    this->do_reap();
+    while (!this->reaped.empty()) {
+        auto cqe = this->reaped.front();
+        this->reaped.pop_front();
+        if (cqe.user_data == IGNORED) {
+            continue;
+        }
+        auto it = this->completions.find(cqe.user_data);
+        if (it == this->completions.end()) {
+            continue;
+        }
+        // a multishot operation keeps its completion for the next one
+        if (cqe.flags & IORING_CQE_F_MORE) {
+            it->second(cqe.res, cqe.flags);
+            continue;
+        }
+        auto completion = std::move(it->second);
+        this->completions.erase(it);
+        completion(cqe.res, cqe.flags);
+    }
+    this->do_wait();
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_URING_HPP
+#define S5P_URING_HPP
+
+#include "global.hpp"
+
+#include <functional>
+#include <memory>
+
+
+namespace s5p {
+
+/**
+ * An io_uring instance driven from an IOLoop.
+ *
+ * Completions are delivered on the loop through a registered eventfd, and
+ * everything queued during one turn of the loop is submitted with a single
+ * io_uring_enter(). Receives pick a buffer from a group provided to the
+ * kernel, which is also registered, so sends from it are fixed writes.
+ *
+ * A ring the kernel stops taking submissions from is broken for good: every
+ * operation queued on it completes with the error, and callers go on with
+ * asio instead.
+ */
+class Uring {
+public:
+    typedef std::function<void (int result, uint32_t flags)> Completion;
+
+    explicit Uring(IOLoop & loop);
+
+    bool open(ErrorCode & ec);
+
+    void accept(int fd, Completion completion);
+    void recv(int fd, int release, std::size_t length, Completion completion);
+    void recv(int fd, boost::asio::mutable_buffer buffer, Completion completion);
+    void send(int fd, int index, std::size_t offset, std::size_t length, Completion completion);
+    void send(int fd, boost::asio::const_buffer buffer, Completion completion);
+    void release(int index);
+    void cancel(int fd, Completion completion);
+    bool is_broken() const;
+
+    static bool has_more(uint32_t flags);
+    static int buffer_index(uint32_t flags);
+
+private:
+    Uring(const Uring &);
+    Uring & operator = (const Uring &);
+    Uring(Uring &&);
+    Uring & operator = (Uring &&);
+
+    class Private;
+    std::shared_ptr<Private> _;
+};
+
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * SOCKS5 proxy server.
+ * Copyright (C) 2017  Wei-Cheng Pan <legnaleurc@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef S5P_URING_HPP_
+#define S5P_URING_HPP_
+
+#include "uring.hpp"
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+#include <deque>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+
+namespace s5p {
+
+class Uring::Private : public std::enable_shared_from_this<Uring::Private> {
+public:
+    explicit Private(IOLoop & loop);
+    ~Private();
+
+#ifdef __linux__
+    io_uring_sqe * do_get_sqe();
+    void do_queue(io_uring_sqe * sqe, Completion completion);
+    void do_provide(int index, std::size_t count, bool linked);
+    void do_schedule_flush();
+    void do_flush();
+    bool do_submit();
+    void do_break(int error);
+    void do_reject(Completion completion);
+    void do_reap();
+    void do_wait();
+    void on_ready(const ErrorCode & ec);
+#endif
+
+    IOLoop & loop;
+    boost::asio::posix::stream_descriptor event;
+    int fd;
+    void * ring;
+    std::size_t ring_size;
+    void * sqes;
+    std::size_t sqes_size;
+    uint8_t * arena;
+    bool fixed;
+    bool flush_scheduled;
+    unsigned pending;
+    unsigned stalled;
+    int error;
+    uint64_t next_id;
+    std::unordered_map<uint64_t, Completion> completions;
+
+#ifdef __linux__
+    io_uring_params params;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    io_uring_cqe * cqes;
+    std::deque<io_uring_cqe> reaped;
+#endif
+};
+
+}
+
+#endif